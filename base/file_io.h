@@ -12,190 +12,202 @@
   < Example >
   FileIO file_io("/Users/furukawa/data/office0");
   cout << "First panorama: " << file_io.GetPanoramaImage(0) << endl;
+
+  < Threads >
+
+  All the getters are const, so one FileIO can be shared by many
+  threads. The per-panorama paths used in the hot loops are formatted
+  once into a table (GetPanoramaPaths), and their getters return
+  references into it. The first call of GetNumPanoramas or of these
+  getters scans input/panorama to count the panoramas. Later changes
+  to the directory are not seen by GetNumPanoramas.
 */
 
 #ifndef FILE_IO_H__
 #define FILE_IO_H__
 
+#include <deque>
 #include <fstream>
+#include <mutex>
+#include <set>
 #include <string>
 #include <vector>
 #include <stdio.h>
-#include <string>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
 namespace structured_indoor_modeling {
 
+// Pre-formatted paths of the files that belong to one panorama.
+struct PanoramaPaths {
+  std::string local_ply;
+  std::string local_to_global_transformation;
+  std::string panorama_image;
+  std::string panorama_to_global_transformation;
+  std::string depth_panorama;
+  std::string smooth_depth_panorama;
+};
+
 class FileIO {
  public:
- FileIO(const std::string data_directory) : data_directory(data_directory) {
+ FileIO(const std::string data_directory)
+   : data_directory(data_directory), num_panoramas(-1) {
+  }
+
+  int GetNumPanoramas() const {
+    std::lock_guard<std::mutex> lock(panorama_mutex);
+    ScanPanoramas();
+    return num_panoramas;
+  }
+  // Valid for panorama >= 0. Panoramas beyond GetNumPanoramas() (e.g.,
+  // ones about to be written) are added to the table on demand. The
+  // reference stays valid for the lifetime of the FileIO.
+  const PanoramaPaths& GetPanoramaPaths(const int panorama) const {
+    std::lock_guard<std::mutex> lock(panorama_mutex);
+    ScanPanoramas();
+    while ((int)panorama_paths.size() <= panorama)
+      AddPanoramaPaths();
+    return panorama_paths[panorama];
   }
 
   std::string GetDataDirectory() const {
     return data_directory;
   }
   std::string GetRawImage(const int panorama, const int image, const int dynamic_range_index) const {
-    sprintf(buffer, "%s/data/%03d/%02d_%d.jpg",
-            data_directory.c_str(), panorama + 1, image + 1, dynamic_range_index);
-    return buffer;
+    return Format("%s/data/%03d/%02d_%d.jpg",
+                  data_directory.c_str(), panorama + 1, image + 1, dynamic_range_index);
   }
-  std::string GetLocalPly(const int panorama) const {
-    sprintf(buffer, "%s/input/ply/%03d.ply", data_directory.c_str(), panorama);
-    return buffer;
+  const std::string& GetLocalPly(const int panorama) const {
+    return GetPanoramaPaths(panorama).local_ply;
   }
   std::string GetSuperPixelFile(const int panorama) const{
-      sprintf(buffer, "%s/input/panorama/SLIC%03d", data_directory.c_str(), panorama);
-      return buffer;
+      return Format("%s/input/panorama/SLIC%03d", data_directory.c_str(), panorama);
   }
-  std::string GetLocalToGlobalTransformation(const int panorama) const {
-    sprintf(buffer, "%s/input/transformations/%03d.txt", data_directory.c_str(), panorama);
-    return buffer;
+  const std::string& GetLocalToGlobalTransformation(const int panorama) const {
+    return GetPanoramaPaths(panorama).local_to_global_transformation;
   }
   std::string GetMeta(const int panorama) const {
-    sprintf(buffer, "%s/data/%03d/meta.txt", data_directory.c_str(), panorama + 1);
-    return buffer;
+    return Format("%s/data/%03d/meta.txt", data_directory.c_str(), panorama + 1);
   }
 
-  std::string GetPanoramaImage(const int panorama) const {
-    sprintf(buffer, "%s/input/panorama/%03d.png", data_directory.c_str(), panorama);
-    return buffer;
+  const std::string& GetPanoramaImage(const int panorama) const {
+    return GetPanoramaPaths(panorama).panorama_image;
   }
   std::string GetImageAlignmentCalibration(const int panorama) const {
-    sprintf(buffer, "%s/input/calibration/%03d.calibration", data_directory.c_str(), panorama);
-    return buffer;
+    return Format("%s/input/calibration/%03d.calibration", data_directory.c_str(), panorama);
   }
   std::string GetPanoramaDepthAlignmentCalibration(const int panorama) const {
-    sprintf(buffer, "%s/input/calibration/%03d.calibration2", data_directory.c_str(), panorama);
-    return buffer;
+    return Format("%s/input/calibration/%03d.calibration2", data_directory.c_str(), panorama);
   }
   std::string GetPanoramaDepthAlignmentVisualization(const int panorama) const {
-    sprintf(buffer, "%s/input/panorama/%03d.jpg", data_directory.c_str(), panorama);
-    return buffer;
+    return Format("%s/input/panorama/%03d.jpg", data_directory.c_str(), panorama);
   }
-  std::string GetPanoramaToGlobalTransformation(const int panorama) const {
-    sprintf(buffer, "%s/input/calibration/%03d.camera_to_global", data_directory.c_str(), panorama);
-    return buffer;
+  const std::string& GetPanoramaToGlobalTransformation(const int panorama) const {
+    return GetPanoramaPaths(panorama).panorama_to_global_transformation;
   }
-  std::string GetDepthPanorama(const int panorama) const {
-    sprintf(buffer, "%s/input/panorama/%03d_raw.depth", data_directory.c_str(), panorama);
-    return buffer;
+  const std::string& GetDepthPanorama(const int panorama) const {
+    return GetPanoramaPaths(panorama).depth_panorama;
   }
   std::string GetDepthVisualization(const int panorama) const {
-    sprintf(buffer, "%s/input/panorama/%03d_raw_depth.png", data_directory.c_str(), panorama);
-    return buffer;
+    return Format("%s/input/panorama/%03d_raw_depth.png", data_directory.c_str(), panorama);
   }
   
-  std::string GetSmoothDepthPanorama(const int panorama) const {
-    sprintf(buffer, "%s/input/panorama/%03d.depth", data_directory.c_str(), panorama);
-    return buffer;
+  const std::string& GetSmoothDepthPanorama(const int panorama) const {
+    return GetPanoramaPaths(panorama).smooth_depth_panorama;
   }
   std::string GetSmoothDepthVisualization(const int panorama) const {
-    sprintf(buffer, "%s/input/panorama/%03d_depth.png", data_directory.c_str(), panorama);
-    return buffer;
+    return Format("%s/input/panorama/%03d_depth.png", data_directory.c_str(), panorama);
   }
   std::string GetFloorplan() const {
-    sprintf(buffer, "%s/input/floorplan.txt", data_directory.c_str());
-    return buffer;
+    return Format("%s/input/floorplan.txt", data_directory.c_str());
   }
   std::string GetFloorplanSVG() const {
-    sprintf(buffer, "%s/floorplan/floorplan.svg", data_directory.c_str());
-    return buffer;
+    return Format("%s/floorplan/floorplan.svg", data_directory.c_str());
   }
   std::string GetIndoorPolygonSimple() const {
-    sprintf(buffer, "%s/input/floorplan_detailed_simple.txt", data_directory.c_str());
-    return buffer;
+    return Format("%s/input/floorplan_detailed_simple.txt", data_directory.c_str());
   }
   std::string GetIndoorPolygon() const {
-    // sprintf(buffer, "%s/indoor_polygon.txt", data_directory.c_str());
-    sprintf(buffer, "%s/input/floorplan_detailed.txt", data_directory.c_str());
-    return buffer;
+    // return Format("%s/indoor_polygon.txt", data_directory.c_str());
+    return Format("%s/input/floorplan_detailed.txt", data_directory.c_str());
   }
   std::string GetIndoorPolygonWithCeiling() const {
-    sprintf(buffer, "%s/input/floorplan_detailed_ceil.txt", data_directory.c_str());
-    return buffer;
+    return Format("%s/input/floorplan_detailed_ceil.txt", data_directory.c_str());
   }
   std::string GetFloorplanFinal() const {
-    sprintf(buffer, "%s/floorplan/floorplan_final.txt", data_directory.c_str());
-    return buffer;
+    return Format("%s/floorplan/floorplan_final.txt", data_directory.c_str());
   }
   std::string GetIndoorPolygonFinal(const std::string& suffix) const {
-    // sprintf(buffer, "%s/indoor_polygon_final.txt", data_directory.c_str());
+    // return Format("%s/indoor_polygon_final.txt", data_directory.c_str());
     if (suffix == "")
-      sprintf(buffer, "%s/floorplan/floorplan_detailed_final.txt", data_directory.c_str());
+      return Format("%s/floorplan/floorplan_detailed_final.txt", data_directory.c_str());
     else
-      sprintf(buffer, "%s/floorplan/floorplan_detailed_final_%s.txt", data_directory.c_str(), suffix.c_str());
-    return buffer;
+      return Format("%s/floorplan/floorplan_detailed_final_%s.txt", data_directory.c_str(), suffix.c_str());
   }  
 
   std::string GetTextureImage(const int index) const {
-    sprintf(buffer, "%s/texture_atlas/texture_image_%03d.png", data_directory.c_str(), index);
-    return buffer;
+    return Format("%s/texture_atlas/texture_image_%03d.png", data_directory.c_str(), index);
   }
 
   std::string GetTextureImageIndoorPolygon(const int index, const std::string& suffix) const {
     if (suffix == "")
-      sprintf(buffer, "%s/texture_atlas/texture_image_detailed_%03d.png", data_directory.c_str(), index);
+      return Format("%s/texture_atlas/texture_image_detailed_%03d.png", data_directory.c_str(), index);
     else
-      sprintf(buffer, "%s/texture_atlas/texture_image_detailed_%s_%03d.png", data_directory.c_str(), suffix.c_str(), index);
-    return buffer;
+      return Format("%s/texture_atlas/texture_image_detailed_%s_%03d.png", data_directory.c_str(), suffix.c_str(), index);
   }
   
   std::string GetRoomThumbnail(const int room) const {
-    sprintf(buffer, "%s/thumbnail/room_thumbnail%03d.png", data_directory.c_str(), room);
-    return buffer;
+    return Format("%s/thumbnail/room_thumbnail%03d.png", data_directory.c_str(), room);
   }
   std::string GetRoomThumbnailPerPanorama(const int room, const int panorama) const {
-    sprintf(buffer, "%s/thumbnail/room_thumbnail_per_panorama_%03d_%03d.png",
-            data_directory.c_str(), room, panorama);
-    return buffer;
+    return Format("%s/thumbnail/room_thumbnail_per_panorama_%03d_%03d.png",
+                  data_directory.c_str(), room, panorama);
   }
   
 
   std::string GetObjectPointCloudsWithColor() const {
-    sprintf(buffer, "%s/object/object_color.ply", data_directory.c_str());
-    return buffer;
+    return Format("%s/object/object_color.ply", data_directory.c_str());
   }    
   std::string GetObjectPointClouds(const int room) const {
-    sprintf(buffer, "%s/object/object_%03d.ply", data_directory.c_str(), room);
-    return buffer;
+    return Format("%s/object/object_%03d.ply", data_directory.c_str(), room);
   }
   
   std::string GetObjectPointCloudsFinal(const int room) const {
-    sprintf(buffer, "%s/object/object_final_%03d.ply", data_directory.c_str(), room);
-    return buffer;
+    return Format("%s/object/object_final_%03d.ply", data_directory.c_str(), room);
   }    
 
   std::string GetFloorWallPointClouds(const int room) const {
-    sprintf(buffer, "%s/object/floor_wall_%03d.ply", data_directory.c_str(), room);
-    return buffer;
+    return Format("%s/object/floor_wall_%03d.ply", data_directory.c_str(), room);
   }
   std::string GetRefinedObjectClouds(const int room) const{
-    sprintf(buffer, "%s/object/object_refined_room%03d.ply", data_directory.c_str(),room);
-    return buffer;
+    return Format("%s/object/object_refined_room%03d.ply", data_directory.c_str(),room);
   }
 
   std::string GetEvaluationDirectory() const {
-    sprintf(buffer, "%s/evaluation", data_directory.c_str());
-    return buffer;
+    return Format("%s/evaluation", data_directory.c_str());
   }
 
   std::string GetObjectDetections() const {
-    sprintf(buffer, "%s/input/detections.txt", data_directory.c_str());
-    return buffer;
+    return Format("%s/input/detections.txt", data_directory.c_str());
   }
   std::string GetObjectDetectionsFinal() const {
-    sprintf(buffer, "%s/object_detection/detections_final.txt", data_directory.c_str());
-    return buffer;
+    return Format("%s/object_detection/detections_final.txt", data_directory.c_str());
   }
 
   std::string GetPoissonInput() const {
-    sprintf(buffer, "%s/evaluation/poisson_input.npts", data_directory.c_str());
-    return buffer;
+    return Format("%s/evaluation/poisson_input.npts", data_directory.c_str());
+  }
+  std::string GetPoissonBinaryInput() const {
+    return Format("%s/evaluation/poisson_input.bnpts", data_directory.c_str());
   }
   std::vector<std::string> GetPoissonMeshes() const {
     std::vector<std::string> filenames;
     const int kNumVersions = 4;
     for (int i = 0; i < kNumVersions; ++i) {
-      sprintf(buffer, "%s/input/poisson/poisson%d.ply", data_directory.c_str(), i);
-      filenames.push_back(buffer);
+      filenames.push_back(Format("%s/input/poisson/poisson%d.ply", data_directory.c_str(), i));
     }
     return filenames;
   }
@@ -203,8 +215,7 @@ class FileIO {
     std::vector<std::string> filenames;
     const int kNumVersions = 4;
     for (int i = 0; i < kNumVersions; ++i) {
-      sprintf(buffer, "%s/input/poisson/poisson_filtered%d.ply", data_directory.c_str(), i);
-      filenames.push_back(buffer);
+      filenames.push_back(Format("%s/input/poisson/poisson_filtered%d.ply", data_directory.c_str(), i));
     }
     return filenames;
   }
@@ -212,8 +223,7 @@ class FileIO {
     std::vector<std::string> filenames;
     const int kNumVersions = 3;
     for (int i = 0; i < kNumVersions; ++i) {
-      sprintf(buffer, "%s/input/vgcut/vgcut%d.ply", data_directory.c_str(), i);
-      filenames.push_back(buffer);
+      filenames.push_back(Format("%s/input/vgcut/vgcut%d.ply", data_directory.c_str(), i));
     }
     return filenames;
   }
@@ -221,54 +231,105 @@ class FileIO {
     std::vector<std::string> filenames;
     const int kNumVersions = 3;
     for (int i = 0; i < kNumVersions; ++i) {
-      sprintf(buffer, "%s/input/vgcut/vgcut_filtered%d.ply", data_directory.c_str(), i);
-      filenames.push_back(buffer);
+      filenames.push_back(Format("%s/input/vgcut/vgcut_filtered%d.ply", data_directory.c_str(), i));
     }
     return filenames;
   }
 
   std::string GetColladaSimple() const {
-    sprintf(buffer, "%s/evaluation/floorplan_detailed_simple.dae", data_directory.c_str());
-    return buffer;
+    return Format("%s/evaluation/floorplan_detailed_simple.dae", data_directory.c_str());
   }
   std::string GetCollada() const {
-    sprintf(buffer, "%s/evaluation/floorplan_detailed.dae", data_directory.c_str());
-    return buffer;
+    return Format("%s/evaluation/floorplan_detailed.dae", data_directory.c_str());
   }
   std::string GetColladaWithCeiling() const {
-    sprintf(buffer, "%s/evaluation/floorplan_detailed_ceil.dae", data_directory.c_str());
-    return buffer;
+    return Format("%s/evaluation/floorplan_detailed_ceil.dae", data_directory.c_str());
   }
 
   std::string GetErrorReport(const std::string& prefix) const {
-    sprintf(buffer, "%s/evaluation/error_%s.txt", data_directory.c_str(), prefix.c_str());
-    return buffer;
+    return Format("%s/evaluation/error_%s.txt", data_directory.c_str(), prefix.c_str());
   }
 
   std::string GetErrorHistogram(const std::string& prefix) const {
-    sprintf(buffer, "%s/evaluation/error_histogram_%s.txt", data_directory.c_str(), prefix.c_str());
-    return buffer;
+    return Format("%s/evaluation/error_histogram_%s.txt", data_directory.c_str(), prefix.c_str());
   }
   
   
  private:
+  // Formats into a local buffer, so that concurrent calls are safe.
+  template <typename... Args>
+  static std::string Format(const char* format, const Args&... args) {
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer), format, args...);
+    return buffer;
+  }
+
+  // Panoramas are numbered consecutively from 0, and the count stops
+  // at the first missing panorama image. Called with panorama_mutex
+  // held, and scans only once.
+  void ScanPanoramas() const {
+    if (num_panoramas >= 0)
+      return;
+    int count = 0;
+#ifdef _WIN32
+    while (true) {
+      std::ifstream ifstr(Format("%s/input/panorama/%03d.png", data_directory.c_str(), count).c_str());
+      if (!ifstr.is_open())
+        break;
+      ++count;
+    }
+#else
+    std::set<int> indexes;
+    DIR* directory = opendir(Format("%s/input/panorama", data_directory.c_str()).c_str());
+    if (directory != NULL) {
+      struct dirent* entry;
+      while ((entry = readdir(directory)) != NULL) {
+        const std::string name = entry->d_name;
+        if (name.size() < 7 || name.compare(name.size() - 4, 4, ".png") != 0)
+          continue;
+        const std::string number = name.substr(0, name.size() - 4);
+        if (number.find_first_not_of("0123456789") != std::string::npos)
+          continue;
+        const int index = atoi(number.c_str());
+        if (Format("%03d", index) == number)
+          indexes.insert(index);
+      }
+      closedir(directory);
+    }
+    while (indexes.count(count) != 0)
+      ++count;
+#endif
+
+    num_panoramas = count;
+    while ((int)panorama_paths.size() < num_panoramas)
+      AddPanoramaPaths();
+  }
+
+  void AddPanoramaPaths() const {
+    const char* directory_name = data_directory.c_str();
+    const int p = panorama_paths.size();
+    PanoramaPaths paths;
+    paths.local_ply = Format("%s/input/ply/%03d.ply", directory_name, p);
+    paths.local_to_global_transformation =
+      Format("%s/input/transformations/%03d.txt", directory_name, p);
+    paths.panorama_image = Format("%s/input/panorama/%03d.png", directory_name, p);
+    paths.panorama_to_global_transformation =
+      Format("%s/input/calibration/%03d.camera_to_global", directory_name, p);
+    paths.depth_panorama = Format("%s/input/panorama/%03d_raw.depth", directory_name, p);
+    paths.smooth_depth_panorama = Format("%s/input/panorama/%03d.depth", directory_name, p);
+    panorama_paths.push_back(paths);
+  }
+
   const std::string data_directory;
-  mutable char buffer[1024];
+  // The scan and the table are filled on first use under panorama_mutex.
+  // A deque keeps the returned references valid while it grows.
+  mutable std::mutex panorama_mutex;
+  mutable int num_panoramas;
+  mutable std::deque<PanoramaPaths> panorama_paths;
 };
 
 inline int GetNumPanoramas(const FileIO& file_io) {
-  int panorama = 0;
-  while (1) {
-    const std::string filename = file_io.GetPanoramaImage(panorama);
-    std::ifstream ifstr;
-    ifstr.open(filename.c_str());
-    if (!ifstr.is_open()) {
-      ifstr.close();
-      return panorama;
-    }
-    ifstr.close();
-    ++panorama;
-  }
+  return file_io.GetNumPanoramas();
 }
  
 }  // namespace structured_indoor_modeling
@@ -20,12 +20,15 @@ Sample usage:
 	PoolAlloc MyClass::memPool(sizeof(MyClass));
 
 Does *no* error checking.
+alloc() and free() are serialized, so instances of the class can be
+created and destroyed from several threads.
 Make sure sizeof(MyClass) is larger than sizeof(void *).
 Based on the description of the Pool class in _Effective C++_ by Scott Meyers.
 */
 
 #include <vector>
 #include <algorithm>
+#include <mutex>
 
 #define POOL_MEMBLOCK 4088
 
@@ -34,6 +37,7 @@ class PoolAlloc {
 private:
 	size_t itemsize;
 	void *freelist;
+	std::mutex mutex;
 	void grow_freelist()
 	{
 		size_t n = POOL_MEMBLOCK / itemsize;
@@ -50,6 +54,7 @@ public:
 	{
 		if (n != itemsize)
 			return ::operator new(n);
+		std::lock_guard<std::mutex> lock(mutex);
 		if (!freelist)
 			grow_freelist();
 		void *next = freelist;
@@ -63,12 +68,14 @@ public:
 		else if (n != itemsize)
 			::operator delete(p);
 		else {
+			std::lock_guard<std::mutex> lock(mutex);
 			*(void **)p = freelist;
 			freelist = p;
 		}
 	}
 	void sort_freelist()
 	{
+		std::lock_guard<std::mutex> lock(mutex);
 		if (!freelist)
 			return;
 		std::vector<void *> v;
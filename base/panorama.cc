@@ -1,13 +1,96 @@
 #include <fstream>
+#include <mutex>
+#include <stdint.h>
+#include <string.h>
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include "panorama.h"
+#include "parallel.h"
 
 using namespace Eigen;
 using namespace std;
 
 namespace structured_indoor_modeling {
 
+namespace {
+
+// Binary depth panorama: a 48 byte header followed by width x height
+// samples in row-major order.
+//
+//   char[8]  "SIMDEPTH"
+//   uint32   version (1)
+//   uint32   sample type (0: float, 1: half float)
+//   uint32   width
+//   uint32   height
+//   double   min depth, max depth (over valid samples)
+//   double   average distance (over all samples)
+//
+// All values are little-endian.
+const char kDepthMagic[] = "SIMDEPTH";
+const int kDepthMagicLength = 8;
+const uint32_t kDepthVersion = 1;
+const int kDepthHeaderSize = 48;
+const uint32_t kFloatSample = 0;
+const uint32_t kHalfFloatSample = 1;
+// Largest finite half float.
+const double kMaxHalfFloat = 65504.0;
+
+uint16_t FloatToHalf(const float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  const uint32_t sign = (bits >> 16) & 0x8000;
+  const int exponent = static_cast<int>((bits >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = bits & 0x7fffff;
+  if (exponent <= 0) {
+    if (exponent < -10)
+      return sign;
+    mantissa |= 0x800000;
+    const int shift = 14 - exponent;
+    return sign | ((mantissa + (1 << (shift - 1))) >> shift);
+  } else if (exponent >= 31) {
+    return sign | 0x7c00;
+  }
+  // Round to nearest. A carry into the exponent is correct.
+  return sign | ((exponent << 10) + ((mantissa + 0x1000) >> 13));
+}
+
+float HalfToFloat(const uint16_t half) {
+  const uint32_t sign = (half & 0x8000) << 16;
+  int exponent = (half >> 10) & 0x1f;
+  uint32_t mantissa = half & 0x3ff;
+  uint32_t bits;
+  if (exponent == 0) {
+    if (mantissa == 0) {
+      bits = sign;
+    } else {
+      // Subnormal.
+      exponent = 1;
+      while ((mantissa & 0x400) == 0) {
+        mantissa <<= 1;
+        --exponent;
+      }
+      mantissa &= 0x3ff;
+      bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+  } else if (exponent == 31) {
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  } else {
+    bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+  }
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+}  // namespace
+
+struct Panorama::LazyDepth {
+  std::string filename;
+  std::once_flag once;
+  std::vector<double> depths;
+  double average_distance;
+};
+
 Panorama::Panorama() {
   only_background_black = false;
 }
@@ -28,6 +111,30 @@ bool Panorama::Init(const FileIO& file_io,
   return true;
 }
 
+bool Panorama::InitWithLazyDepths(const FileIO& file_io, const int panorama) {
+  rgb_image = cv::imread(file_io.GetPanoramaImage(panorama), 1);
+  if (rgb_image.cols == 0 && rgb_image.rows == 0) {
+    cerr << "Panorama image cannot be loaded: " << file_io.GetPanoramaImage(panorama) << endl;
+    return false;
+  }
+  width  = rgb_image.cols;
+  height = rgb_image.rows;
+
+  const string filename = file_io.GetDepthPanorama(panorama);
+  if (!ReadDepthPanorama(filename, &depth_width, &depth_height, NULL, NULL)) {
+    cerr << "Cannot open a file: " << filename << endl;
+    exit (1);
+  }
+  depth_image.clear();
+  lazy_depth.reset(new LazyDepth);
+  lazy_depth->filename = filename;
+
+  InitCameraParameters(file_io, panorama);
+  phi_per_pixel = phi_range / height;
+  phi_per_depth_pixel = phi_range / depth_height;
+  return true;
+}
+
 bool Panorama::InitWithoutLoadingImages(const FileIO& file_io, const int panorama) {
   InitCameraParameters(file_io, panorama);
   phi_per_pixel = phi_range / height;
@@ -36,6 +143,9 @@ bool Panorama::InitWithoutLoadingImages(const FileIO& file_io, const int panoram
 }
 
 bool Panorama::InitWithoutDepths(const FileIO& file_io, const int panorama) {
+  // Drop the depths of a previous initialization.
+  lazy_depth.reset();
+  depth_image.clear();
   rgb_image = cv::imread(file_io.GetPanoramaImage(panorama), 1);
   if (rgb_image.cols == 0 && rgb_image.rows == 0) {
     cerr << "Panorama image cannot be loaded: " << file_io.GetPanoramaImage(panorama) << endl;
@@ -200,12 +310,37 @@ double Panorama::GetDepth(const Eigen::Vector2d& depth_pixel) const {
   const int u1_corrected = (u1 % depth_width);
 
   v1 = min(v1, depth_height - 1);
-  
+
+  const vector<double>& depths = DepthImage();
   return
-    weight00 * depth_image[v0 * depth_width + u0] +
-    weight01 * depth_image[v0 * depth_width + u1_corrected] +
-    weight10 * depth_image[v1 * depth_width + u0] +
-    weight11 * depth_image[v1 * depth_width + u1_corrected];
+    weight00 * depths[v0 * depth_width + u0] +
+    weight01 * depths[v0 * depth_width + u1_corrected] +
+    weight10 * depths[v1 * depth_width + u0] +
+    weight11 * depths[v1 * depth_width + u1_corrected];
+}
+
+double Panorama::GetAverageDistance() const {
+  if (lazy_depth) {
+    DepthImage();
+    return lazy_depth->average_distance;
+  }
+  return average_distance;
+}
+
+const std::vector<double>& Panorama::DepthImage() const {
+  if (!lazy_depth)
+    return depth_image;
+
+  LazyDepth* lazy = lazy_depth.get();
+  call_once(lazy->once, [lazy]() {
+      int width, height;
+      if (!ReadDepthPanorama(lazy->filename, &width, &height,
+                             &lazy->depths, &lazy->average_distance)) {
+        cerr << "Cannot open a file: " << lazy->filename << endl;
+        exit (1);
+      }
+    });
+  return lazy->depths;
 }
 
 double Panorama::GetPhiRange() const {
@@ -243,6 +378,12 @@ bool Panorama::IsInsideDepth(const Eigen::Vector2d& depth_pixel) const {
 }
 
 void Panorama::Resize(const Eigen::Vector2i& size) {
+  if (lazy_depth) {
+    depth_image = DepthImage();
+    average_distance = lazy_depth->average_distance;
+    lazy_depth.reset();
+  }
+
   const int new_width = size[0];
   const int new_height = size[1];
   
@@ -354,31 +495,12 @@ void Panorama::ReleaseMemory() {
 
 void Panorama::InitDepthImage(const FileIO& file_io,
                               const int panorama) {
-  // Interpolate myself.
-  ifstream ifstr;
-  ifstr.open(file_io.GetDepthPanorama(panorama));
-  if (!ifstr.is_open()) {
+  lazy_depth.reset();
+  if (!ReadDepthPanorama(file_io.GetDepthPanorama(panorama),
+                         &depth_width, &depth_height, &depth_image, &average_distance)) {
     cerr << "Cannot open a file: " << file_io.GetDepthPanorama(panorama) << endl;
     exit (1);
   }
-
-  string header;
-  double min_depth, max_depth;
-  ifstr >> header >> depth_width >> depth_height >> min_depth >> max_depth;
-    
-  depth_image.resize(depth_width * depth_height);
-  
-  int index = 0;
-  average_distance = 0.0;
-  for (int y = 0; y < depth_height; ++y) {
-    for (int x = 0; x < depth_width; ++x, ++index) {
-      ifstr >> depth_image[index];
-      average_distance += depth_image[index];
-    }
-  }
-  ifstr.close();
-
-  average_distance /= depth_width * depth_height;
 }
   
 void Panorama::InitCameraParameters(const FileIO& file_io,
@@ -458,6 +580,160 @@ void Panorama::MakeOnlyBackgroundBlack() {
 
 //----------------------------------------------------------------------
 // Utility functions.  
+void WriteDepthPanorama(const std::string& filename,
+                        const int width,
+                        const int height,
+                        const std::vector<double>& depths,
+                        const DepthPanoramaFormat format) {
+  const double kInvalid = -1.0;
+  double min_distance = 0.0, max_distance = 0.0, average_distance = 0.0;
+  bool first = true;
+  for (const auto value : depths) {
+    average_distance += value;
+    if (value != kInvalid) {
+      if (first) {
+        min_distance = value;
+        max_distance = value;
+        first = false;
+      } else {
+        min_distance = min(min_distance, value);
+        max_distance = max(max_distance, value);
+      }
+    }
+  }
+  if (!depths.empty())
+    average_distance /= depths.size();
+
+  ofstream ofstr;
+  if (format == kAsciiDepth) {
+    ofstr.precision(5);
+    ofstr.open(filename.c_str());
+  } else {
+    ofstr.open(filename.c_str(), ios::binary);
+  }
+  if (!ofstr.is_open()) {
+    cerr << "Failed in writing: " << filename << endl;
+    exit (1);
+  }
+
+  if (format == kAsciiDepth) {
+    ofstr << "Depth" << endl
+          << width << ' ' << height << endl
+          << min_distance << ' ' << max_distance << endl;
+    for (const auto value : depths) {
+      ofstr << value << ' ';
+    }
+    ofstr.close();
+    return;
+  }
+
+  const uint32_t header[4] = { kDepthVersion,
+                               format == kHalfFloatDepth ? kHalfFloatSample : kFloatSample,
+                               static_cast<uint32_t>(width),
+                               static_cast<uint32_t>(height) };
+  const double statistics[3] = { min_distance, max_distance, average_distance };
+  ofstr.write(kDepthMagic, kDepthMagicLength);
+  ofstr.write(reinterpret_cast<const char*>(header), sizeof(header));
+  ofstr.write(reinterpret_cast<const char*>(statistics), sizeof(statistics));
+  if (format == kHalfFloatDepth) {
+    vector<uint16_t> samples(depths.size());
+    int num_clamped = 0;
+    for (int i = 0; i < (int)depths.size(); ++i) {
+      if (depths[i] > kMaxHalfFloat)
+        ++num_clamped;
+      samples[i] = FloatToHalf(static_cast<float>(min(depths[i], kMaxHalfFloat)));
+    }
+    if (num_clamped != 0)
+      cerr << num_clamped << " depths clamped to " << kMaxHalfFloat << " in " << filename << endl;
+    ofstr.write(reinterpret_cast<const char*>(samples.data()), samples.size() * sizeof(uint16_t));
+  } else {
+    vector<float> samples(depths.begin(), depths.end());
+    ofstr.write(reinterpret_cast<const char*>(samples.data()), samples.size() * sizeof(float));
+  }
+  ofstr.close();
+}
+
+DepthPanoramaFormat DepthPanoramaFormatFromName(const std::string& name) {
+  if (name == "ascii")
+    return kAsciiDepth;
+  if (name == "float")
+    return kFloatDepth;
+  if (name == "half")
+    return kHalfFloatDepth;
+  cerr << "Unknown depth format: " << name << endl;
+  exit (1);
+}
+
+bool ReadDepthPanorama(const std::string& filename,
+                       int* width,
+                       int* height,
+                       std::vector<double>* depths,
+                       double* average_distance) {
+  ifstream ifstr;
+  ifstr.open(filename.c_str(), ios::binary);
+  if (!ifstr.is_open())
+    return false;
+
+  char magic[kDepthMagicLength];
+  ifstr.read(magic, kDepthMagicLength);
+  if (ifstr.gcount() == kDepthMagicLength &&
+      memcmp(magic, kDepthMagic, kDepthMagicLength) == 0) {
+    uint32_t header[4];
+    double statistics[3];
+    ifstr.read(reinterpret_cast<char*>(header), sizeof(header));
+    ifstr.read(reinterpret_cast<char*>(statistics), sizeof(statistics));
+    if (!ifstr || header[0] != kDepthVersion)
+      return false;
+    *width  = header[2];
+    *height = header[3];
+    if (average_distance != NULL)
+      *average_distance = statistics[2];
+    if (depths == NULL)
+      return true;
+
+    const int num_samples = (*width) * (*height);
+    depths->resize(num_samples);
+    if (header[1] == kHalfFloatSample) {
+      vector<uint16_t> samples(num_samples);
+      ifstr.read(reinterpret_cast<char*>(samples.data()), num_samples * sizeof(uint16_t));
+      for (int i = 0; i < num_samples; ++i)
+        depths->at(i) = HalfToFloat(samples[i]);
+    } else {
+      vector<float> samples(num_samples);
+      ifstr.read(reinterpret_cast<char*>(samples.data()), num_samples * sizeof(float));
+      for (int i = 0; i < num_samples; ++i)
+        depths->at(i) = samples[i];
+    }
+    return static_cast<bool>(ifstr);
+  }
+
+  // Text format.
+  ifstr.close();
+  ifstr.open(filename.c_str());
+  string header;
+  double min_depth, max_depth;
+  ifstr >> header >> *width >> *height >> min_depth >> max_depth;
+  if (depths == NULL && average_distance == NULL)
+    return true;
+
+  const int num_samples = (*width) * (*height);
+  if (depths != NULL)
+    depths->resize(num_samples);
+  double sum = 0.0;
+  double value;
+  for (int index = 0; index < num_samples; ++index) {
+    ifstr >> value;
+    if (depths != NULL)
+      depths->at(index) = value;
+    sum += value;
+  }
+  ifstr.close();
+
+  if (average_distance != NULL)
+    *average_distance = sum / num_samples;
+  return true;
+}
+
 void ReadPanoramas(const FileIO& file_io,
                    vector<Panorama>* panoramas) {
   const int num_panoramas = GetNumPanoramas(file_io);
@@ -466,7 +742,8 @@ void ReadPanoramas(const FileIO& file_io,
   cerr << "ReadPanoramas:" << flush;
   for (int p = 0; p < num_panoramas; ++p) {
     cerr << '.' << flush;
-    panoramas->at(p).Init(file_io, p);
+    // Depth samples are read when first used.
+    panoramas->at(p).InitWithLazyDepths(file_io, p);
   }
   cerr << endl;
 }
@@ -492,19 +769,21 @@ void ReadPanoramaPyramids(const FileIO& file_io,
   panorama_pyramids->clear();
   panorama_pyramids->resize(num_panoramas);
   cout << "Reading panorama_pyramids" << flush;
-  for (int p = 0; p < num_panoramas; ++p) {
-    cout << '.' << flush;
-    panorama_pyramids->at(p).resize(num_levels);
-    for (int level = 0; level < num_levels; ++level) {
-      panorama_pyramids->at(p)[level].Init(file_io, p);
-      panorama_pyramids->at(p)[level].MakeOnlyBackgroundBlack();
-      if (level != 0) {
-        const int new_width  = panorama_pyramids->at(p)[level].Width()  / (0x01 << level);
-        const int new_height = panorama_pyramids->at(p)[level].Height() / (0x01 << level);
-        panorama_pyramids->at(p)[level].Resize(Vector2i(new_width, new_height));
-      }
+  // Each panorama is decoded once, and a level is shrunk by half from
+  // the level below it. Panoramas are independent and read in parallel.
+  ParallelFor(0, num_panoramas, [&](const int p) {
+    vector<Panorama>& pyramid = panorama_pyramids->at(p);
+    pyramid.resize(num_levels);
+    pyramid[0].Init(file_io, p);
+    pyramid[0].MakeOnlyBackgroundBlack();
+    for (int level = 1; level < num_levels; ++level) {
+      pyramid[level] = pyramid[level - 1];
+      const int new_width  = pyramid[level - 1].Width()  / 2;
+      const int new_height = pyramid[level - 1].Height() / 2;
+      pyramid[level].Resize(Vector2i(new_width, new_height));
     }
-  }
+    cout << '.' << flush;
+  });
   cout << " done." << endl;
 }
   
@@ -40,12 +40,25 @@
   const int kPanoramaID = 3;
   Panorama panorama;
   panorama.Init(file_io, kPanoramaID);
+
+
+  < Depth files >
+
+  Depth panoramas are stored either as text (a "Depth" header
+  followed by whitespace separated values) or in a binary format with
+  float or half-float samples (see WriteDepthPanorama). Both are
+  accepted everywhere. InitWithLazyDepths reads only the header of
+  the depth file, and the samples are read on the first access
+  (GetDepth, GetAverageDistance or Resize). This is useful for tools
+  that need only camera parameters or RGB.
  */
 
 #pragma clang diagnostic ignored "-Woverloaded-virtual"
 
 #include <Eigen/Dense>
+#include <memory>
 #include <opencv2/opencv.hpp>
+#include <string>
 #include <vector>
 
 #include "file_io.h"
@@ -58,6 +71,8 @@ public:
   bool Init(const FileIO& file_io, const int panorama);
   bool InitWithoutLoadingImages(const FileIO& file_io, const int panorama);
   bool InitWithoutDepths(const FileIO& file_io, const int panorama);
+  // Depth samples are read on the first access.
+  bool InitWithLazyDepths(const FileIO& file_io, const int panorama);
 
   Eigen::Vector2d Project(const Eigen::Vector3d& global) const;
   Eigen::Vector3d Unproject(const Eigen::Vector2d& pixel,
@@ -70,7 +85,7 @@ public:
   
   const Eigen::Vector3d& GetCenter() const { return center; }
 
-  double GetAverageDistance() const { return average_distance; }
+  double GetAverageDistance() const;
   Eigen::Vector2d RGBToDepth(const Eigen::Vector2d& pixel) const;
   Eigen::Vector2d DepthToRGB(const Eigen::Vector2d& depth_pixel) const;
 
@@ -105,7 +120,11 @@ public:
   void AdjustCenter(const Eigen::Vector3d& new_center);
 
 private:
+  struct LazyDepth;
+
   void InitDepthImage(const FileIO& file_io, const int panorama);
+  // Returns the depth samples, reading them first in the lazy mode.
+  const std::vector<double>& DepthImage() const;
   void InitCameraParameters(const FileIO& file_io, const int panorama);
   void SetGlobalToLocalFromLocalToGlobal();
 
@@ -129,8 +148,38 @@ private:
   double average_distance;
 
   bool only_background_black;
+
+  // Non-NULL while the depth samples have not been moved into
+  // depth_image. Shared by copies, which all see the same file.
+  std::shared_ptr<LazyDepth> lazy_depth;
 };
 
+//----------------------------------------------------------------------
+enum DepthPanoramaFormat {
+  kAsciiDepth,
+  kFloatDepth,
+  kHalfFloatDepth
+};
+
+// Writes a depth panorama. min/max depth and the average distance are
+// stored in the header of the binary formats. Half floats are lossy:
+// steps are 4 between 4096 and 8192 (i.e., 4mm at 4-8m), and depths
+// above 65504 are clamped to it, as they would overflow to inf.
+void WriteDepthPanorama(const std::string& filename,
+                        const int width,
+                        const int height,
+                        const std::vector<double>& depths,
+                        const DepthPanoramaFormat format);
+// "ascii", "float" or "half". Exits on an unknown name.
+DepthPanoramaFormat DepthPanoramaFormatFromName(const std::string& name);
+// Reads either format. Any of the outputs except width and height can be NULL.
+bool ReadDepthPanorama(const std::string& filename,
+                       int* width,
+                       int* height,
+                       std::vector<double>* depths,
+                       double* average_distance);
+
+
 //----------------------------------------------------------------------
 void ReadPanoramas(const FileIO& file_io, std::vector<Panorama>* panoramas);
 void ReadPanoramasWithoutDepths(const FileIO& file_io,
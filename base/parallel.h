@@ -0,0 +1,67 @@
+/*
+  A minimal thread pool helper. ParallelFor runs a function for every
+  index in [begin, end) over a fixed number of worker threads. Indices
+  are handed out one at a time from a shared counter, so uneven
+  per-index costs (e.g., panoramas or rooms of different sizes) are
+  balanced automatically.
+
+  The function must be safe to call concurrently for different
+  indices. Results should be written to pre-allocated, per-index slots.
+
+  < Example >
+
+  vector<Panorama> panoramas(num_panoramas);
+  ParallelFor(0, num_panoramas, [&](const int p) {
+    panoramas[p].Init(file_io, p);
+  });
+ */
+
+#ifndef BASE_PARALLEL_H_
+#define BASE_PARALLEL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace structured_indoor_modeling {
+
+// Number of threads used when ParallelFor is called without one.
+inline int GetDefaultNumThreads() {
+  const int num_threads = static_cast<int>(std::thread::hardware_concurrency());
+  return std::max(1, num_threads);
+}
+
+template <typename Function>
+void ParallelFor(const int begin,
+                 const int end,
+                 const Function& function,
+                 const int num_threads = GetDefaultNumThreads()) {
+  const int num_workers = std::min(std::max(1, num_threads), end - begin);
+  if (num_workers <= 1) {
+    for (int i = begin; i < end; ++i)
+      function(i);
+    return;
+  }
+
+  std::atomic<int> next(begin);
+  auto worker = [&]() {
+    while (true) {
+      const int i = next++;
+      if (i >= end)
+        break;
+      function(i);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int t = 1; t < num_workers; ++t)
+    threads.push_back(std::thread(worker));
+  worker();
+  for (auto& thread : threads)
+    thread.join();
+}
+
+}  // namespace structured_indoor_modeling
+
+#endif  // BASE_PARALLEL_H_
@@ -1,8 +1,20 @@
 #include <Eigen/Dense>
 #include <assert.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cmath>
 #include <fstream>
 #include <iostream>
 #include <limits>
+#include <sstream>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include "file_io.h"
 #include "point_cloud.h"
 
@@ -13,100 +25,490 @@ namespace structured_indoor_modeling {
 
 const int PointCloud::kDepthPositionOffset = 1;
 
-PointCloud::PointCloud() {
-  InitializeMembers();
-}
+namespace {
 
-void PointCloud::InitializeMembers() {
-  center.resize(3);
-  center[0] = 0;
-  center[1] = 0;
-  center[2] = 0;
+// Native layout: a 24 byte header followed by packed 40 byte records.
+//
+//   char[8]  "SIMPCLD1"
+//   uint32   version (1)
+//   uint32   record size (40)
+//   uint64   number of points
+//
+//   int32    depth_position[1], depth_position[0] (0-based)
+//   float    position[3]
+//   float    normal[3]
+//   uint8    color[3], intensity
+//   int32    object_id
+//
+// All values are little-endian.
+const char kNativeMagic[] = "SIMPCLD1";
+const int kNativeMagicLength = 8;
+const uint32_t kNativeVersion = 1;
+const int kNativeHeaderSize = 24;
+const int kNativeRecordSize = 40;
 
-  bounding_box.resize(6);
-  bounding_box[0] = numeric_limits<double>::max();
-  bounding_box[2] = numeric_limits<double>::max();
-  bounding_box[4] = numeric_limits<double>::max();
-  bounding_box[1] = -numeric_limits<double>::max();
-  bounding_box[3] = -numeric_limits<double>::max();
-  bounding_box[5] = -numeric_limits<double>::max();
+const int kInvalidObjectId = -1;
 
-  depth_width = 0;
-  depth_height = 0;
-  num_objects = 0;
+// Read-only view of a whole file. Uses mmap where available.
+class MappedFile {
+ public:
+  MappedFile() : data(NULL), size(0) {
+#ifndef _WIN32
+    mapped = false;
+#endif
+  }
+  ~MappedFile() {
+#ifndef _WIN32
+    if (mapped)
+      munmap(const_cast<char*>(data), size);
+#endif
+  }
+
+  bool Open(const std::string& filename) {
+#ifndef _WIN32
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+      return false;
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+      close(fd);
+      return false;
+    }
+    size = file_stat.st_size;
+    if (size != 0) {
+      void* address = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (address != MAP_FAILED) {
+        data = static_cast<const char*>(address);
+        mapped = true;
+      }
+    }
+    close(fd);
+    if (mapped || size == 0)
+      return true;
+#endif
+    ifstream ifstr;
+    ifstr.open(filename.c_str(), ios::binary);
+    if (!ifstr.is_open())
+      return false;
+    ifstr.seekg(0, ios::end);
+    buffer.resize(static_cast<size_t>(ifstr.tellg()));
+    ifstr.seekg(0, ios::beg);
+    ifstr.read(&buffer[0], buffer.size());
+    ifstr.close();
+    data = buffer.empty() ? NULL : &buffer[0];
+    size = buffer.size();
+    return true;
+  }
+
+  const char* Data() const { return data; }
+  size_t Size() const { return size; }
+
+ private:
+  const char* data;
+  size_t size;
+  vector<char> buffer;
+#ifndef _WIN32
+  bool mapped;
+#endif
+};
+
+// Vertex columns in the order Write() emits them. The first two
+// columns are named "height" and "width", but hold the depth x and y.
+// Files may list them in any order.
+enum PlyField {
+  kPlyDepthX,
+  kPlyDepthY,
+  kPlyX,
+  kPlyY,
+  kPlyZ,
+  kPlyRed,
+  kPlyGreen,
+  kPlyBlue,
+  kPlyNx,
+  kPlyNy,
+  kPlyNz,
+  kPlyIntensity,
+  kPlyObjectId,
+  kPlyUnknown
+};
+
+struct PlyProperty {
+  PlyField field;
+  // One of c, C, s, S, i, I, f, d (PLY char...double).
+  char type;
+  int size;
+  int offset;
+};
+
+struct PlyHeader {
+  bool binary;
+  int num_points;
+  bool has_object_id;
+  // PointChannel bits of the optional columns in the file.
+  int channels;
+  int record_size;
+  // Number of bytes up to and including the "end_header" line.
+  size_t header_size;
+  vector<PlyProperty> properties;
+};
+
+bool PlyFieldFromName(const string& name, PlyField* field) {
+  static const char* const kNames[kPlyUnknown] = {
+    "height", "width", "x", "y", "z", "red", "green", "blue",
+    "nx", "ny", "nz", "intensity", "object_id" };
+  for (int f = 0; f < kPlyUnknown; ++f) {
+    if (name == kNames[f]) {
+      *field = static_cast<PlyField>(f);
+      return true;
+    }
+  }
+  return false;
 }
 
-bool PointCloud::Init(const FileIO& file_io, const int panorama) {
-  return Init(file_io.GetLocalPly(panorama).c_str());
+bool PlyTypeFromName(const string& name, char* type, int* size) {
+  if (name == "char" || name == "int8") { *type = 'c'; *size = 1; return true; }
+  if (name == "uchar" || name == "uint8") { *type = 'C'; *size = 1; return true; }
+  if (name == "short" || name == "int16") { *type = 's'; *size = 2; return true; }
+  if (name == "ushort" || name == "uint16") { *type = 'S'; *size = 2; return true; }
+  if (name == "int" || name == "int32") { *type = 'i'; *size = 4; return true; }
+  if (name == "uint" || name == "uint32") { *type = 'I'; *size = 4; return true; }
+  if (name == "float" || name == "float32") { *type = 'f'; *size = 4; return true; }
+  if (name == "double" || name == "float64") { *type = 'd'; *size = 8; return true; }
+  return false;
 }
 
-bool PointCloud::Init(const std::string& filename) {
-  InitializeMembers();
-  
-  ifstream ifstr;
-  ifstr.open(filename.c_str());
-  if (!ifstr.is_open()) {
-    ifstr.close();
-    return false;
+bool ParsePlyHeader(const char* data, const size_t size, PlyHeader* header) {
+  header->binary = false;
+  header->num_points = 0;
+  header->has_object_id = false;
+  header->channels = 0;
+  header->record_size = 0;
+  header->properties.clear();
+
+  bool in_vertex_element = false;
+  bool has_vertex_element = false;
+  vector<bool> has_field(kPlyUnknown, false);
+  size_t position = 0;
+  int line_index = 0;
+  while (position < size) {
+    size_t end = position;
+    while (end < size && data[end] != '\n')
+      ++end;
+    istringstream isstr(string(data + position, end - position));
+    position = min(size, end + 1);
+
+    string keyword;
+    isstr >> keyword;
+    if (line_index++ == 0) {
+      if (keyword != "ply")
+        return false;
+      continue;
+    }
+    if (keyword == "format") {
+      string format;
+      isstr >> format;
+      if (format == "ascii") {
+        header->binary = false;
+      } else if (format == "binary_little_endian") {
+        header->binary = true;
+      } else {
+        cerr << "Unsupported ply format: " << format << endl;
+        return false;
+      }
+    } else if (keyword == "element") {
+      string name;
+      int count;
+      isstr >> name >> count;
+      in_vertex_element = (name == "vertex");
+      if (in_vertex_element) {
+        header->num_points = count;
+        has_vertex_element = true;
+      } else if (!has_vertex_element && count != 0) {
+        // The data of this element would come before the points.
+        cerr << "Unsupported ply element before vertex: " << name << endl;
+        return false;
+      }
+    } else if (keyword == "property" && in_vertex_element) {
+      string type_name, name;
+      isstr >> type_name >> name;
+      PlyProperty property;
+      if (!PlyTypeFromName(type_name, &property.type, &property.size) ||
+          !PlyFieldFromName(name, &property.field) || has_field[property.field]) {
+        cerr << "Unsupported ply property: " << type_name << ' ' << name << endl;
+        return false;
+      }
+      has_field[property.field] = true;
+      property.offset = header->record_size;
+      header->record_size += property.size;
+      if (property.field == kPlyObjectId)
+        header->has_object_id = true;
+      if (property.field == kPlyDepthX || property.field == kPlyDepthY)
+        header->channels |= kDepthPositionChannel;
+      else if (property.field == kPlyIntensity)
+        header->channels |= kIntensityChannel;
+      else if (property.field == kPlyObjectId)
+        header->channels |= kObjectIdChannel;
+      header->properties.push_back(property);
+    } else if (keyword == "end_header") {
+      if (!has_field[kPlyX] || !has_field[kPlyY] || !has_field[kPlyZ]) {
+        cerr << "A ply file without x, y and z." << endl;
+        return false;
+      }
+      header->header_size = position;
+      return true;
+    }
   }
+  return false;
+}
 
-  string stmp;
-  for (int i = 0; i < 6; ++i)
-    ifstr >> stmp;
-  int num_points;
-  ifstr >> num_points;
-  for (int i = 0; i < 36; ++i)
-    ifstr >> stmp;
+inline double ReadPlyValue(const char* data, const char type) {
+  switch (type) {
+  case 'c': { int8_t v; memcpy(&v, data, sizeof(v)); return v; }
+  case 'C': { uint8_t v; memcpy(&v, data, sizeof(v)); return v; }
+  case 's': { int16_t v; memcpy(&v, data, sizeof(v)); return v; }
+  case 'S': { uint16_t v; memcpy(&v, data, sizeof(v)); return v; }
+  case 'i': { int32_t v; memcpy(&v, data, sizeof(v)); return v; }
+  case 'I': { uint32_t v; memcpy(&v, data, sizeof(v)); return v; }
+  case 'f': { float v; memcpy(&v, data, sizeof(v)); return v; }
+  default: { double v; memcpy(&v, data, sizeof(v)); return v; }
+  }
+}
 
-  ifstr >> stmp;
-  bool has_object_id = false;
-  if(stmp == "property") {
-    has_object_id = true;
-    for(int i = 0; i < 3; ++i)
-      ifstr >> stmp;
+inline void SetPlyField(const PlyField field, const double value, const int depth_position_offset, Point* point) {
+  switch (field) {
+  case kPlyDepthX: point->depth_position[1] = static_cast<int>(value) - depth_position_offset; break;
+  case kPlyDepthY: point->depth_position[0] = static_cast<int>(value) - depth_position_offset; break;
+  case kPlyX: point->position[0] = value; break;
+  case kPlyY: point->position[1] = value; break;
+  case kPlyZ: point->position[2] = value; break;
+  case kPlyRed: point->color[0] = value; break;
+  case kPlyGreen: point->color[1] = value; break;
+  case kPlyBlue: point->color[2] = value; break;
+  case kPlyNx: point->normal[0] = value; break;
+  case kPlyNy: point->normal[1] = value; break;
+  case kPlyNz: point->normal[2] = value; break;
+  case kPlyIntensity: point->intensity = static_cast<int>(value); break;
+  case kPlyObjectId: point->object_id = static_cast<int>(value); break;
+  default: break;
   }
-    
-  points.clear();
-  points.resize(num_points);
+}
 
-  const int kInvalidObjectId = -1;
+// The readers below decode one point at a time and hand it to
+// add_point(const Point&), so that both PointCloud and
+// ColumnarPointCloud can be filled without an intermediate vector.
+// Reads the next whitespace separated number in [*position, size).
+inline bool ReadAsciiValue(const char* data, const size_t size, size_t* position, double* value) {
+  while (*position < size && isspace(static_cast<unsigned char>(data[*position])))
+    ++*position;
+  size_t end = *position;
+  while (end < size && !isspace(static_cast<unsigned char>(data[end])))
+    ++end;
+  // The mapping is not null terminated, so the token is copied.
+  char token[64];
+  const size_t length = end - *position;
+  if (length == 0 || length >= sizeof(token))
+    return false;
+  memcpy(token, data + *position, length);
+  token[length] = '\0';
+  char* parsed;
+  *value = strtod(token, &parsed);
+  *position = end;
+  return parsed == token + length;
+}
 
-  // To handle different point format.
-  for (auto& point : points) {
-    ifstr >> point.depth_position[1] >> point.depth_position[0]
-          >> point.position[0] >> point.position[1] >> point.position[2]
-          >> point.color[0] >> point.color[1] >> point.color[2]
-          >> point.normal[0] >> point.normal[1] >> point.normal[2]
-          >> point.intensity;
-
-    if (has_object_id){
-      ifstr >> point.object_id;
-    } else {
+template <typename AddPoint>
+bool ReadAsciiPlyPoints(const char* data,
+                        const size_t size,
+                        const PlyHeader& header,
+                        const int depth_position_offset,
+                        const AddPoint& add_point) {
+  size_t position = 0;
+  double value;
+  for (int p = 0; p < header.num_points; ++p) {
+    Point point;
+    for (const auto& property : header.properties) {
+      if (!ReadAsciiValue(data, size, &position, &value))
+        return false;
+      SetPlyField(property.field, value, depth_position_offset, &point);
+    }
+    if (!header.has_object_id)
       point.object_id = kInvalidObjectId;
+    add_point(point);
+  }
+  return true;
+}
+
+template <typename AddPoint>
+bool ReadBinaryPlyPoints(const char* data,
+                         const size_t size,
+                         const PlyHeader& header,
+                         const int depth_position_offset,
+                         const AddPoint& add_point) {
+  if (size < (size_t)header.num_points * header.record_size)
+    return false;
+
+  const char* record = data;
+  for (int p = 0; p < header.num_points; ++p) {
+    Point point;
+    for (const auto& property : header.properties) {
+      SetPlyField(property.field, ReadPlyValue(record + property.offset, property.type),
+                  depth_position_offset, &point);
     }
-    
-    point.depth_position[0] -= kDepthPositionOffset;
-    point.depth_position[1] -= kDepthPositionOffset;
+    if (!header.has_object_id)
+      point.object_id = kInvalidObjectId;
+    add_point(point);
+    record += header.record_size;
   }
+  return true;
+}
 
-  ifstr.close();
+template <typename Reserve, typename AddPoint>
+bool ReadNativePoints(const char* data,
+                      const size_t size,
+                      const Reserve& reserve,
+                      const AddPoint& add_point) {
+  if (size < (size_t)kNativeHeaderSize)
+    return false;
+  uint32_t version, record_size;
+  uint64_t num_points;
+  memcpy(&version, data + 8, sizeof(version));
+  memcpy(&record_size, data + 12, sizeof(record_size));
+  memcpy(&num_points, data + 16, sizeof(num_points));
+  if (version != kNativeVersion || record_size != (uint32_t)kNativeRecordSize ||
+      size < kNativeHeaderSize + num_points * kNativeRecordSize)
+    return false;
 
-  Update();
+  reserve(num_points);
+  const char* record = data + kNativeHeaderSize;
+  int32_t ivalues[2];
+  float fvalues[6];
+  uint8_t bvalues[4];
+  int32_t object_id;
+  for (uint64_t p = 0; p < num_points; ++p) {
+    Point point;
+    memcpy(ivalues, record, sizeof(ivalues));
+    memcpy(fvalues, record + 8, sizeof(fvalues));
+    memcpy(bvalues, record + 32, sizeof(bvalues));
+    memcpy(&object_id, record + 36, sizeof(object_id));
 
+    point.depth_position[1] = ivalues[0];
+    point.depth_position[0] = ivalues[1];
+    point.position = Vector3d(fvalues[0], fvalues[1], fvalues[2]);
+    point.normal = Vector3d(fvalues[3], fvalues[4], fvalues[5]);
+    point.color = Vector3f(bvalues[0], bvalues[1], bvalues[2]);
+    point.intensity = bvalues[3];
+    point.object_id = object_id;
+    add_point(point);
+    record += kNativeRecordSize;
+  }
   return true;
 }
-  
-void PointCloud::Write(const std::string& filename) {
+
+inline uint8_t ToUchar(const double value) {
+  return static_cast<uint8_t>(max(0, min(255, static_cast<int>(value))));
+}
+
+// A normal coordinate in [-1, 1] as a fixed point int16.
+inline int16_t PackNormal(const double value) {
+  return static_cast<int16_t>(round(max(-1.0, min(1.0, value)) * ColumnarPointCloud::kNormalScale));
+}
+
+// Detects the format of filename and reads its points. channels is set
+// to the PointChannel bits of the optional columns in the file.
+template <typename Reserve, typename AddPoint>
+bool ReadPointFile(const std::string& filename,
+                   const int depth_position_offset,
+                   int* channels,
+                   const Reserve& reserve,
+                   const AddPoint& add_point) {
+  MappedFile file;
+  if (!file.Open(filename))
+    return false;
+
+  bool success;
+  if (file.Size() >= (size_t)kNativeMagicLength &&
+      memcmp(file.Data(), kNativeMagic, kNativeMagicLength) == 0) {
+    *channels = kAllChannels;
+    success = ReadNativePoints(file.Data(), file.Size(), reserve, add_point);
+  } else {
+    PlyHeader header;
+    if (!ParsePlyHeader(file.Data(), file.Size(), &header)) {
+      cerr << "Invalid point cloud header: " << filename << endl;
+      return false;
+    }
+    *channels = header.channels;
+    reserve(header.num_points);
+    if (header.binary) {
+      success = ReadBinaryPlyPoints(file.Data() + header.header_size,
+                                    file.Size() - header.header_size,
+                                    header, depth_position_offset, add_point);
+    } else {
+      success = ReadAsciiPlyPoints(file.Data() + header.header_size,
+                                   file.Size() - header.header_size,
+                                   header, depth_position_offset, add_point);
+    }
+  }
+  if (!success)
+    cerr << "Failed in reading: " << filename << endl;
+  return success;
+}
+
+// Writes num_points points given by get_point(p) in the given format.
+template <typename GetPoint>
+void WritePointFile(const std::string& filename,
+                    const PointCloudFormat format,
+                    const int depth_position_offset,
+                    const int num_points,
+                    const GetPoint& get_point) {
   ofstream ofstr;
-  ofstr.open(filename.c_str());
+  if (format == kAsciiPly)
+    ofstr.open(filename.c_str());
+  else
+    ofstr.open(filename.c_str(), ios::binary);
   if (!ofstr.is_open()) {
     cerr << "Failed in writing: " << filename << endl;
     exit (1);
   }
 
+  if (format == kNativeBinary) {
+    const uint32_t version = kNativeVersion;
+    const uint32_t record_size = kNativeRecordSize;
+    const uint64_t num_records = num_points;
+    ofstr.write(kNativeMagic, kNativeMagicLength);
+    ofstr.write(reinterpret_cast<const char*>(&version), sizeof(version));
+    ofstr.write(reinterpret_cast<const char*>(&record_size), sizeof(record_size));
+    ofstr.write(reinterpret_cast<const char*>(&num_records), sizeof(num_records));
+
+    vector<char> records((size_t)num_points * kNativeRecordSize);
+    char* record = records.empty() ? NULL : &records[0];
+    for (int p = 0; p < num_points; ++p) {
+      const Point& point = get_point(p);
+      const int32_t ivalues[2] = { point.depth_position[1], point.depth_position[0] };
+      const float fvalues[6] = { static_cast<float>(point.position[0]),
+                                 static_cast<float>(point.position[1]),
+                                 static_cast<float>(point.position[2]),
+                                 static_cast<float>(point.normal[0]),
+                                 static_cast<float>(point.normal[1]),
+                                 static_cast<float>(point.normal[2]) };
+      const uint8_t bvalues[4] = { ToUchar(point.color[0]),
+                                   ToUchar(point.color[1]),
+                                   ToUchar(point.color[2]),
+                                   ToUchar(point.intensity) };
+      const int32_t object_id = point.object_id;
+      memcpy(record, ivalues, sizeof(ivalues));
+      memcpy(record + 8, fvalues, sizeof(fvalues));
+      memcpy(record + 32, bvalues, sizeof(bvalues));
+      memcpy(record + 36, &object_id, sizeof(object_id));
+      record += kNativeRecordSize;
+    }
+    ofstr.write(records.empty() ? NULL : &records[0], records.size());
+    ofstr.close();
+    return;
+  }
+
   ofstr << "ply" << endl
-        << "format ascii 1.0" << endl
-        << "element vertex " << (int)points.size() << endl
+        << (format == kAsciiPly ? "format ascii 1.0" : "format binary_little_endian 1.0") << endl
+        << "element vertex " << num_points << endl
         << "property int height" << endl
         << "property int width" << endl
         << "property float x" << endl
@@ -119,12 +521,46 @@ void PointCloud::Write(const std::string& filename) {
         << "property float ny" << endl
         << "property float nz" << endl
         << "property uchar intensity" << endl
-	<< "property uchar object_id" << endl
+	<< (format == kAsciiPly ? "property uchar object_id" : "property int object_id") << endl
 	<< "end_header" << endl;
 
-  for (const auto& point : points) {
-    ofstr << point.depth_position[1] + kDepthPositionOffset << ' '
-          << point.depth_position[0] + kDepthPositionOffset << ' '
+  if (format == kBinaryPly) {
+    // Same column order as the ascii format, 4 + 4 + 12 + 3 + 12 + 1 + 4 bytes.
+    const int kRecordSize = 40;
+    vector<char> records((size_t)num_points * kRecordSize);
+    char* record = records.empty() ? NULL : &records[0];
+    for (int p = 0; p < num_points; ++p) {
+      const Point& point = get_point(p);
+      const int32_t ivalues[2] = { point.depth_position[1] + depth_position_offset,
+                                   point.depth_position[0] + depth_position_offset };
+      const float position[3] = { static_cast<float>(point.position[0]),
+                                  static_cast<float>(point.position[1]),
+                                  static_cast<float>(point.position[2]) };
+      const uint8_t color[3] = { ToUchar(point.color[0]),
+                                 ToUchar(point.color[1]),
+                                 ToUchar(point.color[2]) };
+      const float normal[3] = { static_cast<float>(point.normal[0]),
+                                static_cast<float>(point.normal[1]),
+                                static_cast<float>(point.normal[2]) };
+      const uint8_t intensity = ToUchar(point.intensity);
+      const int32_t object_id = point.object_id;
+      memcpy(record, ivalues, sizeof(ivalues));
+      memcpy(record + 8, position, sizeof(position));
+      memcpy(record + 20, color, sizeof(color));
+      memcpy(record + 23, normal, sizeof(normal));
+      memcpy(record + 35, &intensity, sizeof(intensity));
+      memcpy(record + 36, &object_id, sizeof(object_id));
+      record += kRecordSize;
+    }
+    ofstr.write(records.empty() ? NULL : &records[0], records.size());
+    ofstr.close();
+    return;
+  }
+
+  for (int p = 0; p < num_points; ++p) {
+    const Point& point = get_point(p);
+    ofstr << point.depth_position[1] + depth_position_offset << ' '
+          << point.depth_position[0] + depth_position_offset << ' '
           << point.position[0] << ' '
           << point.position[1] << ' '
           << point.position[2] << ' '
@@ -141,13 +577,83 @@ void PointCloud::Write(const std::string& filename) {
   ofstr.close();
 }
 
+Matrix4d ReadLocalToGlobal(const FileIO& file_io, const int panorama) {
+  Matrix4d local_to_global;
+  ifstream ifstr;
+  ifstr.open(file_io.GetLocalToGlobalTransformation(panorama).c_str());
+
+  char ctmp;
+  ifstr >> ctmp;
+  for (int y = 0; y < 3; ++y) {
+    for (int x = 0; x < 4; ++x) {
+      ifstr >> local_to_global(y, x);
+    }
+  }
+  ifstr.close();
+  local_to_global(3, 0) = 0;
+  local_to_global(3, 1) = 0;
+  local_to_global(3, 2) = 0;
+  local_to_global(3, 3) = 1;
+  return local_to_global;
+}
+
+}  // namespace
+
+PointCloud::PointCloud() {
+  InitializeMembers();
+}
+
+void PointCloud::InitializeMembers() {
+  center.resize(3);
+  center[0] = 0;
+  center[1] = 0;
+  center[2] = 0;
+
+  bounding_box.resize(6);
+  bounding_box[0] = numeric_limits<double>::max();
+  bounding_box[2] = numeric_limits<double>::max();
+  bounding_box[4] = numeric_limits<double>::max();
+  bounding_box[1] = -numeric_limits<double>::max();
+  bounding_box[3] = -numeric_limits<double>::max();
+  bounding_box[5] = -numeric_limits<double>::max();
+
+  depth_width = 0;
+  depth_height = 0;
+  num_objects = 0;
+
+  InvalidateObjectIndex();
+}
+
+bool PointCloud::Init(const FileIO& file_io, const int panorama) {
+  return Init(file_io.GetLocalPly(panorama).c_str());
+}
+
+bool PointCloud::Init(const std::string& filename) {
+  InitializeMembers();
+
+  points.clear();
+  int channels;
+  if (!ReadPointFile(filename, kDepthPositionOffset, &channels,
+                     [&](const size_t num_points) { points.reserve(num_points); },
+                     [&](const Point& point) { points.push_back(point); })) {
+    points.clear();
+    return false;
+  }
+
+  Update();
+
+  return true;
+}
+  
+void PointCloud::Write(const std::string& filename, const PointCloudFormat format) {
+  WritePointFile(filename, format, kDepthPositionOffset, points.size(),
+                 [&](const int p) -> const Point& { return points[p]; });
+}
+
 void PointCloud::WriteObject(const string& filename, const int objectid){
     vector<Point>object_points;
-    for(const auto&pt: points){
-	if(pt.object_id == objectid)
-	    object_points.push_back(pt);
-    }
-    
+    GetObjectPoints(objectid, object_points);
+
     PointCloud objectcloud;
     objectcloud.AddPoints(object_points);
     objectcloud.Write(filename);
@@ -177,25 +683,7 @@ void PointCloud::Translate(const Eigen::Vector3d& translation){
 }
   
 void PointCloud::ToGlobal(const FileIO& file_io, const int panorama) {
-  Matrix4d local_to_global;
-  {
-    ifstream ifstr;
-    ifstr.open(file_io.GetLocalToGlobalTransformation(panorama).c_str());
-    
-    char ctmp;
-    ifstr >> ctmp;
-    for (int y = 0; y < 3; ++y) {
-      for (int x = 0; x < 4; ++x) {
-        ifstr >> local_to_global(y, x);
-      }
-    }
-    ifstr.close();
-    local_to_global(3, 0) = 0;
-    local_to_global(3, 1) = 0;
-    local_to_global(3, 2) = 0;
-    local_to_global(3, 3) = 1;
-  }
-  Transform(local_to_global);
+  Transform(ReadLocalToGlobal(file_io, panorama));
 }
 
 void PointCloud::AddPoints(const PointCloud& point_cloud, bool mergeid){
@@ -211,7 +699,9 @@ void PointCloud::AddPoints(const vector<Point>& new_points, bool mergeid) {
 	  points[i].object_id += num_objects;
       }
   }
-  Update();
+  // Only the new points are visited, so that appending clouds one by
+  // one stays linear in the total size.
+  ExtendStatistics(orinum);
 }
 
 void PointCloud::RemovePoints(const std::vector<int>& indexes) {
@@ -221,52 +711,134 @@ void PointCloud::RemovePoints(const std::vector<int>& indexes) {
     keep[index] = false;
   }
   
-  vector<Point> new_points;
+  // Stable compaction in place.
+  int num_kept = 0;
   for (int p = 0; p < (int)points.size(); ++p) {
-    if (keep[p])
-      new_points.push_back(points[p]);
+    if (!keep[p])
+      continue;
+    if (num_kept != p)
+      points[num_kept] = points[p];
+    ++num_kept;
   }
-
-  new_points.swap(points);
+  points.resize(num_kept);
   Update();
 }
 
-void PointCloud::GetObjectIndice(int objectid, vector<int>&indices) const{
-  for(int i=0; i<GetNumPoints(); i++){
-    const Point& curpt = GetPoint(i);
-    if(curpt.object_id == objectid)
-      indices.push_back(i);
+PointCloud::ObjectIndex& PointCloud::ObjectIndex::operator=(const ObjectIndex& object_index) {
+  if (this == &object_index)
+    return *this;
+  std::lock_guard<std::mutex> lock(object_index.mutex);
+  first_object_id = object_index.first_object_id;
+  offsets = object_index.offsets;
+  indices = object_index.indices;
+  bounding_boxes = object_index.bounding_boxes;
+  centers = object_index.centers;
+  valid = object_index.valid.load();
+  return *this;
+}
+
+const PointCloud::ObjectIndex& PointCloud::GetValidObjectIndex() const {
+  ObjectIndex& index = object_index;
+  // The release store below publishes the index to the other readers.
+  if (index.valid.load(memory_order_acquire))
+    return index;
+  std::lock_guard<std::mutex> lock(index.mutex);
+  if (index.valid.load(memory_order_relaxed))
+    return index;
+
+  // Objects are indexed from the smallest id, which is -1 for points
+  // read without an object id.
+  index.first_object_id = 0;
+  int end_object_id = 0;
+  for (const auto& point : points) {
+    index.first_object_id = min(index.first_object_id, point.object_id);
+    end_object_id = max(end_object_id, point.object_id + 1);
   }
+  const int num_ids = end_object_id - index.first_object_id;
+
+  // Counting sort of the point indices by object id.
+  index.offsets.assign(num_ids + 1, 0);
+  for (const auto& point : points)
+    ++index.offsets[point.object_id - index.first_object_id + 1];
+  for (int i = 0; i < num_ids; ++i)
+    index.offsets[i + 1] += index.offsets[i];
+
+  index.indices.resize(points.size());
+  index.bounding_boxes.resize(6 * num_ids);
+  for (int i = 0; i < num_ids; ++i) {
+    for (int a = 0; a < 3; ++a) {
+      index.bounding_boxes[6 * i + 2 * a] = numeric_limits<double>::max();
+      index.bounding_boxes[6 * i + 2 * a + 1] = -numeric_limits<double>::max();
+    }
+  }
+  index.centers.assign(num_ids, Vector3d(0, 0, 0));
+
+  vector<int> filled(index.offsets.begin(), index.offsets.end() - 1);
+  for (int p = 0; p < (int)points.size(); ++p) {
+    const int id = points[p].object_id - index.first_object_id;
+    index.indices[filled[id]++] = p;
+    const Vector3d& position = points[p].position;
+    for (int a = 0; a < 3; ++a) {
+      index.bounding_boxes[6 * id + 2 * a] = min(index.bounding_boxes[6 * id + 2 * a], position[a]);
+      index.bounding_boxes[6 * id + 2 * a + 1] = max(index.bounding_boxes[6 * id + 2 * a + 1], position[a]);
+    }
+    index.centers[id] += position;
+  }
+  for (int i = 0; i < num_ids; ++i) {
+    if (index.offsets[i + 1] != index.offsets[i])
+      index.centers[i] /= index.offsets[i + 1] - index.offsets[i];
+  }
+  index.valid.store(true, memory_order_release);
+  return index;
+}
+
+PointCloud::ObjectIndices PointCloud::GetObjectIndices(const int objectid) const {
+  const ObjectIndex& index = GetValidObjectIndex();
+  const int id = objectid - index.first_object_id;
+  if (id < 0 || (int)index.offsets.size() <= id + 1)
+    return ObjectIndices(NULL, 0);
+  return ObjectIndices(index.indices.data() + index.offsets[id],
+                       index.offsets[id + 1] - index.offsets[id]);
+}
+
+void PointCloud::GetObjectIndice(int objectid, vector<int>&indices) const{
+  const ObjectIndices object = GetObjectIndices(objectid);
+  indices.insert(indices.end(), object.begin(), object.end());
 }
 
 void PointCloud::GetObjectPoints(int objectid, vector<Point>&object_points) const{
-    object_points.clear();
-    for(const auto& pt: points){
-	if(pt.object_id == objectid)
-	    object_points.push_back(pt);
-    }
+  const ObjectIndices object = GetObjectIndices(objectid);
+  object_points.clear();
+  object_points.reserve(object.size());
+  for (const int p : object)
+    object_points.push_back(points[p]);
 }
 
 void PointCloud::GetObjectBoundingbox(int objectid, vector<double>&bbox) const{
-    bbox.clear();
-    bbox.resize(6);
-    bbox[0] = numeric_limits<double>::max();
-    bbox[1] = numeric_limits<double>::min();
-    bbox[2] = numeric_limits<double>::max();
-    bbox[3] = numeric_limits<double>::min();
-    bbox[4] = numeric_limits<double>::max();
-    bbox[5] = numeric_limits<double>::min();
-    for(int ptid=0; ptid<GetNumPoints(); ptid++){
-	Point curpt = GetPoint(ptid);
-	if(curpt.object_id == objectid){
-	    bbox[0] = std::min(bbox[0], curpt.position[0]);
-	    bbox[1] = std::max(bbox[1], curpt.position[0]);
-	    bbox[2] = std::min(bbox[2], curpt.position[1]);
-	    bbox[3] = std::max(bbox[3], curpt.position[1]);
-	    bbox[4] = std::min(bbox[4], curpt.position[2]);
-	    bbox[5] = std::max(bbox[5], curpt.position[2]);
-	}
-    }
+  // Maxima start from numeric_limits<double>::min() (not the lowest
+  // value), as callers have always seen.
+  bbox.resize(6);
+  bbox[0] = numeric_limits<double>::max();
+  bbox[1] = numeric_limits<double>::min();
+  bbox[2] = numeric_limits<double>::max();
+  bbox[3] = numeric_limits<double>::min();
+  bbox[4] = numeric_limits<double>::max();
+  bbox[5] = numeric_limits<double>::min();
+  if (GetObjectIndices(objectid).size() == 0)
+    return;
+  const ObjectIndex& index = GetValidObjectIndex();
+  const int id = objectid - index.first_object_id;
+  for (int i = 0; i < 6; i += 2) {
+    bbox[i] = index.bounding_boxes[6 * id + i];
+    bbox[i + 1] = max(bbox[i + 1], index.bounding_boxes[6 * id + i + 1]);
+  }
+}
+
+Eigen::Vector3d PointCloud::GetObjectCenter(const int objectid) const {
+  if (GetObjectIndices(objectid).size() == 0)
+    return Vector3d(0, 0, 0);
+  const ObjectIndex& index = GetValidObjectIndex();
+  return index.centers[objectid - index.first_object_id];
 }
     
 void PointCloud::SetAllColor(float r,float g,float b){
@@ -299,9 +871,14 @@ void PointCloud::SetColor(int ind, float r,float g,float b){
 // Note that num_object is not changed, to avoid confusing.
 void PointCloud::Update(){
   InitializeMembers();
+  ExtendStatistics(0);
+}
 
-  for (const auto& point : points) {
-    center += point.position;
+void PointCloud::ExtendStatistics(const int begin) {
+  Vector3d sum = center * begin;
+  for (int p = begin; p < (int)points.size(); ++p) {
+    const Point& point = points[p];
+    sum += point.position;
 
     depth_width = max(point.depth_position[1] + 1, depth_width);
     depth_height = max(point.depth_position[0] + 1, depth_height);
@@ -316,7 +893,8 @@ void PointCloud::Update(){
     bounding_box[5] = max(point.position[2],bounding_box[5]);
   }
   if (!points.empty())
-    center /= (int)points.size();
+    center = sum / (int)points.size();
+  InvalidateObjectIndex();
 }
    
 double PointCloud::GetBoundingboxVolume(){
@@ -325,7 +903,7 @@ double PointCloud::GetBoundingboxVolume(){
   return (bounding_box[1]-bounding_box[0])*(bounding_box[3]-bounding_box[2])*(bounding_box[5]-bounding_box[4]);
 }
 
-double PointCloud::GetObjectBoundingboxVolume(const int objectid){
+double PointCloud::GetObjectBoundingboxVolume(const int objectid) const {
     vector<double>bbox;
     GetObjectBoundingbox(objectid, bbox);
     if(bbox[1] <= bbox[0] || bbox[3] <= bbox[2] || bbox[5] <= bbox[4])
@@ -350,15 +928,171 @@ void PointCloud::RandomSampleScale(const double scale) {
   const int target_size = static_cast<int>(scale * points.size());
   random_shuffle(points.begin(), points.end());
   points.resize(target_size);
+  InvalidateObjectIndex();
 }
 
 void PointCloud::RandomSampleCount(const int max_count) {
   if (max_count < (int)points.size()) {
     random_shuffle(points.begin(), points.end());
     points.resize(max_count);
+    InvalidateObjectIndex();
   }
 }
   
+//----------------------------------------------------------------------
+const float ColumnarPointCloud::kNormalScale = 32767.0f;
+
+ColumnarPointCloud::ColumnarPointCloud() : channels(kAllChannels) {
+}
+
+bool ColumnarPointCloud::Init(const FileIO& file_io, const int panorama) {
+  return Init(file_io.GetLocalPly(panorama));
+}
+
+bool ColumnarPointCloud::Init(const std::string& filename) {
+  Clear(kAllChannels);
+  int file_channels;
+  // Every channel is filled while reading, and missing ones dropped after.
+  if (!ReadPointFile(filename, PointCloud::kDepthPositionOffset, &file_channels,
+                     [&](const size_t num_points) { Reserve(num_points); },
+                     [&](const Point& point) { AddPoint(point); })) {
+    Clear(kAllChannels);
+    return false;
+  }
+  channels = file_channels;
+  if (!HasChannel(kDepthPositionChannel))
+    vector<int32_t>().swap(depth_positions);
+  if (!HasChannel(kIntensityChannel))
+    vector<uint8_t>().swap(intensities);
+  if (!HasChannel(kObjectIdChannel))
+    vector<int32_t>().swap(object_ids);
+  return true;
+}
+
+void ColumnarPointCloud::SetPoints(const std::vector<Point>& points, const int new_channels) {
+  Clear(new_channels);
+  Reserve(points.size());
+  for (const auto& point : points)
+    AddPoint(point);
+}
+
+void ColumnarPointCloud::Write(const std::string& filename, const PointCloudFormat format) const {
+  WritePointFile(filename, format, PointCloud::kDepthPositionOffset, GetNumPoints(),
+                 [&](const int p) { return GetPoint(p); });
+}
+
+void ColumnarPointCloud::ToGlobal(const FileIO& file_io, const int panorama) {
+  Transform(ReadLocalToGlobal(file_io, panorama));
+}
+
+void ColumnarPointCloud::Transform(const Eigen::Matrix4d& transformation) {
+  const Matrix3d rotation = transformation.block<3, 3>(0, 0);
+  const Vector3d translation = transformation.block<3, 1>(0, 3);
+  for (int p = 0; p < GetNumPoints(); ++p) {
+    const Vector3d position = rotation * GetPosition(p) + translation;
+    const Vector3d normal = rotation * GetNormal(p);
+    for (int i = 0; i < 3; ++i) {
+      positions[3 * p + i] = position[i];
+      normals[3 * p + i] = PackNormal(normal[i]);
+    }
+  }
+}
+
+Eigen::Vector3d ColumnarPointCloud::GetPosition(const int p) const {
+  return Vector3d(positions[3 * p], positions[3 * p + 1], positions[3 * p + 2]);
+}
+
+Eigen::Vector3d ColumnarPointCloud::GetNormal(const int p) const {
+  return Vector3d(normals[3 * p], normals[3 * p + 1], normals[3 * p + 2]) / kNormalScale;
+}
+
+Eigen::Vector3f ColumnarPointCloud::GetColor(const int p) const {
+  return Vector3f(colors[3 * p], colors[3 * p + 1], colors[3 * p + 2]);
+}
+
+Eigen::Vector2i ColumnarPointCloud::GetDepthPosition(const int p) const {
+  if (!HasChannel(kDepthPositionChannel))
+    return Vector2i(0, 0);
+  return Vector2i(depth_positions[2 * p], depth_positions[2 * p + 1]);
+}
+
+int ColumnarPointCloud::GetIntensity(const int p) const {
+  return HasChannel(kIntensityChannel) ? intensities[p] : 0;
+}
+
+int ColumnarPointCloud::GetObjectId(const int p) const {
+  return HasChannel(kObjectIdChannel) ? object_ids[p] : kInvalidObjectId;
+}
+
+Point ColumnarPointCloud::GetPoint(const int p) const {
+  Point point;
+  point.depth_position = GetDepthPosition(p);
+  point.position = GetPosition(p);
+  point.color = GetColor(p);
+  point.normal = GetNormal(p);
+  point.intensity = GetIntensity(p);
+  point.object_id = GetObjectId(p);
+  return point;
+}
+
+void ColumnarPointCloud::GetPoints(std::vector<Point>* points) const {
+  points->resize(GetNumPoints());
+  for (int p = 0; p < GetNumPoints(); ++p)
+    points->at(p) = GetPoint(p);
+}
+
+void ColumnarPointCloud::GetBoundingbox(std::vector<double>* bounding_box) const {
+  bounding_box->resize(6);
+  for (int i = 0; i < 3; ++i) {
+    bounding_box->at(2 * i) = numeric_limits<double>::max();
+    bounding_box->at(2 * i + 1) = -numeric_limits<double>::max();
+  }
+  for (int p = 0; p < GetNumPoints(); ++p) {
+    for (int i = 0; i < 3; ++i) {
+      bounding_box->at(2 * i) = min<double>(bounding_box->at(2 * i), positions[3 * p + i]);
+      bounding_box->at(2 * i + 1) = max<double>(bounding_box->at(2 * i + 1), positions[3 * p + i]);
+    }
+  }
+}
+
+void ColumnarPointCloud::Clear(const int new_channels) {
+  channels = new_channels;
+  positions.clear();
+  normals.clear();
+  colors.clear();
+  depth_positions.clear();
+  intensities.clear();
+  object_ids.clear();
+}
+
+void ColumnarPointCloud::Reserve(const int num_points) {
+  positions.reserve(3 * num_points);
+  normals.reserve(3 * num_points);
+  colors.reserve(3 * num_points);
+  if (HasChannel(kDepthPositionChannel))
+    depth_positions.reserve(2 * num_points);
+  if (HasChannel(kIntensityChannel))
+    intensities.reserve(num_points);
+  if (HasChannel(kObjectIdChannel))
+    object_ids.reserve(num_points);
+}
+
+void ColumnarPointCloud::AddPoint(const Point& point) {
+  for (int i = 0; i < 3; ++i) {
+    positions.push_back(point.position[i]);
+    normals.push_back(PackNormal(point.normal[i]));
+    colors.push_back(ToUchar(point.color[i]));
+  }
+  if (HasChannel(kDepthPositionChannel)) {
+    depth_positions.push_back(point.depth_position[0]);
+    depth_positions.push_back(point.depth_position[1]);
+  }
+  if (HasChannel(kIntensityChannel))
+    intensities.push_back(ToUchar(point.intensity));
+  if (HasChannel(kObjectIdChannel))
+    object_ids.push_back(point.object_id);
+}
+
 //----------------------------------------------------------------------
 void ReadPointClouds(const FileIO& file_io, std::vector<PointCloud>* point_clouds) {
   cout << "Reading pointclouds" << flush;
@@ -28,18 +28,63 @@
   point_cloud3.AddPoints(point_cloud);
   point_cloud3.AddPoints(point_cloud2);
   point_cloud3.Write("new_file.ply");
+
+  < File formats >
+
+  Init() detects the format from the file header, so callers do not
+  need to know how a file was written. Three layouts are supported:
+  ASCII PLY (the default output of Write), binary little-endian PLY,
+  and a compact native layout (kNativeBinary) that is a fixed header
+  followed by packed 40 byte records. Binary files are memory-mapped
+  and decoded in one pass. PLY columns are matched by name, and unknown
+  ones are rejected. convert_point_cloud_cli converts existing ASCII
+  files in place, given an explicit --format.
+
+  < Columnar storage >
+
+  ColumnarPointCloud reads and writes the same files, but keeps each
+  attribute in its own array: float positions, normals packed to int16,
+  uint8 colors, and the depth position, intensity and object id only
+  when the file has them. A point takes 21 to 34 bytes instead of the
+  80 of struct Point. Use it for large, mostly read-only clouds; its
+  raw columns can be handed to a KDtree or a projection loop as is.
+  PointCloud itself, e.g., the room clouds of object segmentation and
+  refinement, keeps the struct Point layout.
+
+  ColumnarPointCloud columnar;
+  columnar.Init(file_io, kPanoramaID);
+  columnar.ToGlobal(file_io, kPanoramaID);
+  KDtree kdtree(columnar.GetPositionData());
  */
 
 #ifndef BASE_POINT_CLOUD_H_
 #define BASE_POINT_CLOUD_H_
 
 #include <Eigen/Dense>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <string>
 #include <vector>
 
 namespace structured_indoor_modeling {
 
 class FileIO;
 
+enum PointCloudFormat {
+  kAsciiPly,
+  kBinaryPly,
+  kNativeBinary
+};
+
+// Optional columns of a point cloud file.
+enum PointChannel {
+  kDepthPositionChannel = 1,
+  kIntensityChannel = 2,
+  kObjectIdChannel = 4,
+  kAllChannels = 7
+};
+
 struct Point {
   Eigen::Vector2i depth_position;
   Eigen::Vector3d position;
@@ -53,14 +98,28 @@ struct Point {
 
 class PointCloud {
  public:
+  // Read-only view of the indices of the points of one object.
+  class ObjectIndices {
+  public:
+    ObjectIndices(const int* indices, const int length)
+      : indices(indices), length(length) {}
+    int size() const { return length; }
+    int operator[](const int i) const { return indices[i]; }
+    const int* begin() const { return indices; }
+    const int* end() const { return indices + length; }
+  private:
+    const int* indices;
+    int length;
+  };
+
   PointCloud();
   
   // Read the corresponding point cloud in the local coordinate frame.
   bool Init(const FileIO& file_io, const int panorama);
-  // Read the point cloud with the given filename.
+  // Read the point cloud with the given filename. Any PointCloudFormat is accepted.
   bool Init(const std::string& filename);
   // Writer.
-  void Write(const std::string& filename);
+  void Write(const std::string& filename, const PointCloudFormat format = kAsciiPly);
   void WriteObject(const std::string& filename, const int objectid);
 
   // Transformations.
@@ -77,7 +136,9 @@ class PointCloud {
   inline int GetDepthWidth() const { return depth_width; }
   inline int GetDepthHeight() const { return depth_height; }
   inline const std::vector<Point>& GetPointData() const {return points;}
-  inline std::vector<Point> &GetPointData() {return points;}
+  // Call Update() after changing positions or object ids through a
+  // non-const reference.
+  inline std::vector<Point> &GetPointData() { return points;}
   // yasu This should return const reference to speed-up.
   inline const std::vector<double>& GetBoundingbox() const { return bounding_box; }
   inline int GetNumObjects() const { return num_objects; }
@@ -86,11 +147,20 @@ class PointCloud {
   inline const Point& GetPoint(const int p) const { return points[p]; }
   inline Point& GetPoint(const int p) { return points[p]; }
   inline bool isempty() const {return (int)points.size() == 0;}
+
+  // Object queries use an index of the points grouped by object id. It
+  // is built by the first query after Update() or a mutator, and makes
+  // each query proportional to the size of the object. Concurrent
+  // queries on one cloud are safe; the first one builds the index.
+  ObjectIndices GetObjectIndices(const int objectid) const;
+  // Appends the indices to indices.
   void GetObjectIndice(int objectid, std::vector<int>&indices) const;
   void GetObjectPoints(int objectid, std::vector<structured_indoor_modeling::Point>& object_points) const;
   void GetObjectBoundingbox(int objectid, std::vector<double>&bbox)const;
+  // Average position of the points of an object, or zero if it has none.
+  Eigen::Vector3d GetObjectCenter(const int objectid) const;
   double GetBoundingboxVolume();
-  double GetObjectBoundingboxVolume(const int objectid);
+  double GetObjectBoundingboxVolume(const int objectid) const;
   // Setters.
   void SetPoints(const std::vector<Point>& new_points) {
     points = new_points;
@@ -104,14 +174,46 @@ class PointCloud {
       SetColor(ind, new_color[0], new_color[1], new_color[2]);
   }
 
+  // Reserves memory for num_points points in total before a series of
+  // AddPoints.
+  void Reserve(const int num_points) { points.reserve(num_points); }
+  // Statistics (center, bounding box, etc.) are extended with the new
+  // points only, so the cost is proportional to the added points.
   void AddPoints(const PointCloud& point_cloud, bool mergeid = false);
   void AddPoints(const std::vector<Point>& new_points, bool mergeid = false);
 
   void RemovePoints(const std::vector<int>& indexes);
   void Update();  
  private:
+  friend class ColumnarPointCloud;
+
   void InitializeMembers();
+  // Updates the statistics of points [0, begin) with the rest.
+  void ExtendStatistics(const int begin);
+
+  // Points of the object with id first_object_id + i are
+  // indices[offsets[i], offsets[i + 1]), in increasing order.
+  // bounding_boxes holds 6 values per object as bounding_box does. The
+  // mutex guards the build, and copies take the index as is.
+  struct ObjectIndex {
+    ObjectIndex() : valid(false), first_object_id(0) {}
+    ObjectIndex(const ObjectIndex& object_index) : valid(false) { *this = object_index; }
+    ObjectIndex& operator=(const ObjectIndex& object_index);
+
+    std::atomic<bool> valid;
+    mutable std::mutex mutex;
+    int first_object_id;
+    std::vector<int> offsets;
+    std::vector<int> indices;
+    std::vector<double> bounding_boxes;
+    std::vector<Eigen::Vector3d> centers;
+  };
+
+  // Returns the object index, building it first if needed.
+  const ObjectIndex& GetValidObjectIndex() const;
+  inline void InvalidateObjectIndex() { object_index.valid = false; }
   std::vector<Point> points;
+  mutable ObjectIndex object_index;
 
   Eigen::Vector3d center;
   int depth_width;
@@ -124,6 +226,63 @@ class PointCloud {
 
 typedef std::vector<PointCloud> PointClouds;
 
+class ColumnarPointCloud {
+ public:
+  ColumnarPointCloud();
+
+  // Same as PointCloud::Init.
+  bool Init(const FileIO& file_io, const int panorama);
+  bool Init(const std::string& filename);
+  // Copies points. Optional channels not in channels are dropped.
+  void SetPoints(const std::vector<Point>& points, const int channels = kAllChannels);
+  void Write(const std::string& filename, const PointCloudFormat format = kAsciiPly) const;
+
+  // Transformations.
+  void ToGlobal(const FileIO& file_io, const int panorama);
+  void Transform(const Eigen::Matrix4d& transformation);
+
+  // Accessors. Missing channels read as 0, and -1 for object ids.
+  inline int GetNumPoints() const { return positions.size() / 3; }
+  inline int GetChannels() const { return channels; }
+  inline bool HasChannel(const PointChannel channel) const { return (channels & channel) != 0; }
+  Eigen::Vector3d GetPosition(const int p) const;
+  Eigen::Vector3d GetNormal(const int p) const;
+  Eigen::Vector3f GetColor(const int p) const;
+  Eigen::Vector2i GetDepthPosition(const int p) const;
+  int GetIntensity(const int p) const;
+  int GetObjectId(const int p) const;
+  // Adapters for code written against struct Point.
+  Point GetPoint(const int p) const;
+  void GetPoints(std::vector<Point>* points) const;
+  // xmin, xmax, ymin, ymax, zmin, zmax.
+  void GetBoundingbox(std::vector<double>* bounding_box) const;
+
+  // Raw columns. Positions, normals and colors hold 3 values per point
+  // and depth positions 2 (y and x). Normals are scaled by kNormalScale.
+  // Optional columns are empty when the channel is missing.
+  inline const std::vector<float>& GetPositionData() const { return positions; }
+  inline const std::vector<int16_t>& GetNormalData() const { return normals; }
+  inline const std::vector<uint8_t>& GetColorData() const { return colors; }
+  inline const std::vector<int32_t>& GetDepthPositionData() const { return depth_positions; }
+  inline const std::vector<uint8_t>& GetIntensityData() const { return intensities; }
+  inline const std::vector<int32_t>& GetObjectIdData() const { return object_ids; }
+
+  static const float kNormalScale;
+
+ private:
+  void Clear(const int new_channels);
+  void Reserve(const int num_points);
+  void AddPoint(const Point& point);
+
+  int channels;
+  std::vector<float> positions;
+  std::vector<int16_t> normals;
+  std::vector<uint8_t> colors;
+  std::vector<int32_t> depth_positions;
+  std::vector<uint8_t> intensities;
+  std::vector<int32_t> object_ids;
+};
+
 //----------------------------------------------------------------------
 void ReadPointClouds(const FileIO& file_io, std::vector<PointCloud>* point_clouds);
 
@@ -4,6 +4,7 @@
 #include "../../base/file_io.h"
 #include <numeric>
 #include <fstream>
+#include <Eigen/Sparse>
 
 #define MAX_DEPTH_DIFF 800
 
@@ -13,38 +14,6 @@ using namespace cv;
 
 namespace structured_indoor_modeling{
 
-    vector<double> JacobiMethod(const vector< vector<double> >& A, const vector<double>& B, int max_iter = 300){
-	vector<double>solution(B.size());
-	for(auto& v:solution) v=0.0;
-	for(int iter=0;iter<max_iter;iter++){
-	    for(int i=0;i<solution.size();i++){
-		double sum = 0.0;
-		for(int j=0;j<solution.size();j++){
-		    if(j!=i)
-			sum += A[i][j] * solution[j];
-		}
-		solution[i] = (B[i] - sum) / A[i][i];
-	    }
-	    //evaluate the result
-	    double ssd = 0;
-	    for(int i=0;i<solution.size();i++){
-		double tempsum = 0.0;
-		for(int j=0;j<solution.size();j++){
-		    tempsum += A[i][j] * solution[j];
-		}
-		tempsum -= B[i];
-		ssd += tempsum * tempsum;
-	    }
-	    ssd = sqrt(ssd);
-#if 0
-	    cout<<"Iteration "<<iter<<", ssd: "<<ssd<<endl;
-#endif
-	    if(ssd < 0.001)
-		break;
-	}
-	return solution;
-    }
-  
     void DepthFilling::Init(const PointCloud& point_cloud, const Panorama &panorama, bool maskv){
 	depthwidth = panorama.DepthWidth();
 	depthheight = panorama.DepthHeight();
@@ -143,76 +112,107 @@ namespace structured_indoor_modeling{
 
     void DepthFilling::fill_hole(const Panorama& panorama){
 	printf("Performing depth impainting...\n");
-	int invalidnum= 0;
-    
-	//invalidcoord: size of invalidnum
-	//invalidindx: size of depthnum
-    
-	vector <int> invalidcoord;
-	vector <int> invalidindex(depthmap.size());
-    
+	const int dx[4] = {-1, 1, 0, 0};
+	const int dy[4] = {0, 0, -1, 1};
+
+	//candidate: invalid depth inside the mask and off the black background
+	vector <bool> candidate(depthmap.size(), false);
 	for(int i=0;i<depthmap.size();i++){
 	    Vector2d depth_pixel((double)(i%depthwidth), (double)(i/depthwidth));
 	    Vector2d color_pixel = panorama.DepthToRGB(depth_pixel);
 	    if(panorama.GetRGB(color_pixel) == Vector3f(0,0,0))
 		continue;
-	    if(depthmap[i] < 0 && mask[i] == 1){
-		invalidnum ++;
+	    if(depthmap[i] < 0 && mask[i] == 1)
+		candidate[i] = true;
+	}
+
+	//Only the connected components of candidates that touch a valid
+	//depth (a Dirichlet boundary) are solved. The others have nothing
+	//to interpolate and are left untouched.
+	//invalidcoord: size of invalidnum
+	//invalidindx: size of depthnum
+	int invalidnum= 0;
+	vector <int> invalidcoord;
+	vector <int> invalidindex(depthmap.size(), -1);
+	vector <bool> visited(depthmap.size(), false);
+	vector <int> component;
+	for(int seed=0;seed<depthmap.size();seed++){
+	    if(!candidate[seed] || visited[seed])
+		continue;
+	    component.clear();
+	    component.push_back(seed);
+	    visited[seed] = true;
+	    bool has_boundary = false;
+	    for(int c=0;c<component.size();c++){
+		const int x = component[c] % depthwidth;
+		const int y = component[c] / depthwidth;
+		for(int k=0;k<4;k++){
+		    const int nx = x + dx[k];
+		    const int ny = y + dy[k];
+		    if(!insideDepth(nx,ny))
+			continue;
+		    const int neighbor = ny*depthwidth + nx;
+		    if(depthmap[neighbor] >= 0)
+			has_boundary = true;
+		    else if(candidate[neighbor] && !visited[neighbor]){
+			visited[neighbor] = true;
+			component.push_back(neighbor);
+		    }
+		}
+	    }
+	    if(!has_boundary)
+		continue;
+	    for(const auto& i: component){
 		invalidcoord.push_back(i);
-		invalidindex[i] = invalidnum - 1;
+		invalidindex[i] = invalidnum++;
 	    }
 	}
 	cout<<"Invalid depth num:"<<invalidnum<<endl;
-    
-	//construct matrix A and B
-	vector< vector<double> > A(invalidnum);
-	vector <double> B(invalidnum);
-	for(int i=0;i<invalidnum;i++){
-	    A[i].resize(invalidnum);
-	    for(int j=0;j<invalidnum;j++){
-		A[i][j] = 0.0;
-	    }
-	    B[i] = 0.0;
-	}
-    
+	if(invalidnum == 0)
+	    return;
+
+	//construct the sparse Laplacian system A x = B over the invalid
+	//pixels. Each row has at most 5 non-zeros, so memory is linear in
+	//the number of invalid pixels.
+	vector< Triplet<double> > triplets;
+	triplets.reserve(5 * invalidnum);
+	VectorXd B = VectorXd::Zero(invalidnum);
 	for(int i=0;i<invalidnum;i++){
 	    //(x,y) is the coordinate of invalid pixel
 	    int x = invalidcoord[i] % depthwidth;
 	    int y = invalidcoord[i] / depthwidth;
 	    int count = 0;
-	    if(insideDepth(x-1,y)){
-		count++;
-		if(depthmap[y*depthwidth + x-1] <0 )
-		    A[i][invalidindex[y*depthwidth+x-1]] = -1;
-		else
-		    B[i] += depthmap[y*depthwidth+x-1];
-	    }
-	    if(insideDepth(x+1,y)){
-		count++;
-		if(depthmap[y*depthwidth + x+1] <0 )
-		    A[i][invalidindex[y*depthwidth+x+1]] = -1;
-		else
-		    B[i] += depthmap[y*depthwidth+x+1];
-	    }
-	    if(insideDepth(x,y-1)){
-		count++;
-		if(depthmap[(y-1)*depthwidth + x] <0 )
-		    A[i][invalidindex[(y-1)*depthwidth+x]] = -1;
-		else
-		    B[i] += depthmap[(y-1)*depthwidth+x];
-	    }
-	    if(insideDepth(x,y+1)){
+	    for(int k=0;k<4;k++){
+		const int nx = x + dx[k];
+		const int ny = y + dy[k];
+		if(!insideDepth(nx,ny))
+		    continue;
+		const int neighbor = ny*depthwidth + nx;
+		//every neighbor inside the mask counts on the diagonal. An
+		//invalid one on the black background is not an unknown and
+		//adds nothing to the right hand side.
 		count++;
-		if(depthmap[(y+1)*depthwidth + x] <0 )
-		    A[i][invalidindex[(y+1)*depthwidth+x]] = -1;
-		else
-		    B[i] += depthmap[(y+1)*depthwidth+x];
+		if(depthmap[neighbor] < 0){
+		    if(invalidindex[neighbor] >= 0)
+			triplets.push_back(Triplet<double>(i, invalidindex[neighbor], -1.0));
+		}else
+		    B[i] += depthmap[neighbor];
 	    }
-	    A[i][i] = (double)count;
+	    triplets.push_back(Triplet<double>(i, i, (double)count));
 	}
-    
-	//solve the linear problem with Jacobi iterative method
-	vector <double> solution = JacobiMethod(A,B);
+	SparseMatrix<double> A(invalidnum, invalidnum);
+	A.setFromTriplets(triplets.begin(), triplets.end());
+
+	//Every component has a Dirichlet boundary, so A is symmetric
+	//positive definite. Solve with Jacobi preconditioned conjugate
+	//gradient from zero, like the previous dense Jacobi iterations.
+	ConjugateGradient<SparseMatrix<double>, Lower|Upper> solver;
+	solver.setTolerance(1e-8);
+	solver.compute(A);
+	VectorXd solution = solver.solve(B);
+#if 0
+	cout<<"Iterations "<<solver.iterations()<<", error: "<<solver.error()<<endl;
+#endif
     
 	//copy the result to original depthmap
 	for(int i=0;i<invalidnum;i++){
@@ -10,9 +10,6 @@ namespace structured_indoor_modeling{
   class PointCloud;
   class Panorama;
 
-  std::vector <double> JacobiMethod(const std::vector <std::vector<double> >& A, const std::vector<double>& B, int max_iter);
-
-
   class DepthFilling{
   public:
     DepthFilling(){}
@@ -1,6 +1,8 @@
 #include "object_refinement.h"
 #include "SLIC/SLIC.h"
+#include "../../base/parallel.h"
 #include <numeric>
+#include <queue>
 #include <iostream>
 #include <iterator>
 #include <algorithm>
@@ -98,106 +100,190 @@ void AllRange(vector<int>&array, vector<vector<int> >&result, int k, int m){
 }
 
 
-void getObjectColor(PointCloud &objectcloud,const vector<Panorama>&panorama,const vector<vector<int> >&objectgroup, const int roomid){
-     if(panorama.size() == 0 || objectgroup.size() == 0 || objectcloud.GetNumPoints() == 0)
-	  return;
-     const int depthwidth = panorama[0].DepthWidth();
-     const int depthheight = panorama[0].DepthHeight();
+namespace {
+// Panoramas farther than this from an object on average never color it.
+const double kMaxObjectDistance = 5000.0;
+
+// Object points visible from one panorama, and where they land in its
+// depthmap (-1 if outside).
+struct PanoramaVisibility{
+    std::vector<int> points;
+    std::vector<int> depth_pixels;
+    // Average distance of the visible points, -1 if none.
+    double averagedis;
+    // Number of distinct depth pixels covered by the visible points.
+    int depthcoverage;
+};
+
+// Computes visibility[objid][panid] for every object of a room, in
+// parallel over the candidate panoramas. Each panorama is held only
+// while its points are projected. Others see nothing.
+void ComputeVisibility(const PointCloud &objectcloud,
+		       PanoramaCache &panoramas,
+		       const vector<int>&candidates,
+		       const vector<vector<int> >&objectgroup,
+		       const int num_threads,
+		       vector<vector<PanoramaVisibility> >&visibility){
     const double kDepthMarginRatio = 0.03;
+    PanoramaVisibility invisible;
+    invisible.averagedis = -1;
+    invisible.depthcoverage = 0;
+    visibility.assign(objectgroup.size(), vector<PanoramaVisibility>(panoramas.GetNumPanoramas(), invisible));
+    ParallelFor(0, (int)candidates.size(), [&](const int c){
+	const int panid = candidates[c];
+	const shared_ptr<const Panorama> panorama = panoramas.Get(panid);
+	const Panorama& pan = *panorama;
+	const double depth_margin = pan.GetAverageDistance() * kDepthMarginRatio;
+	const int depthwidth = pan.DepthWidth();
+	vector<bool>depth_occupicy(depthwidth * pan.DepthHeight(), false);
+	for(int objid=0; objid<objectgroup.size(); objid++){
+	    PanoramaVisibility& vis = visibility[objid][panid];
+	    vis.averagedis = 0.0;
+	    vis.depthcoverage = 0;
+	    for(const auto& ptid: objectgroup[objid]){
+		const Vector3d& curpt = objectcloud.GetPoint(ptid).position;
+		double ptdepth = (curpt - pan.GetCenter()).norm();
+		Vector2d RGB_pix = pan.Project(curpt);
+		if(!pan.IsInsideRGB(RGB_pix))
+		    continue;
+		if(pan.GetRGB(RGB_pix).norm() == 0)
+		    continue;
+		Vector2d depth_pix = pan.RGBToDepth(RGB_pix);
+		if(ptdepth >= pan.GetDepth(depth_pix) + depth_margin)
+		    continue;
+		int depth_index = -1;
+		if(pan.IsInsideDepth(depth_pix)){
+		    depth_index = (int)floor(depth_pix[1]) * depthwidth + (int)floor(depth_pix[0]);
+		    if(!depth_occupicy[depth_index])
+			vis.depthcoverage++;
+		    depth_occupicy[depth_index] = true;
+		}
+		vis.points.push_back(ptid);
+		vis.depth_pixels.push_back(depth_index);
+		vis.averagedis += ptdepth;
+	    }
+	    //only reset the pixels this object touched
+	    for(const auto& depth_index: vis.depth_pixels){
+		if(depth_index != -1)
+		    depth_occupicy[depth_index] = false;
+	    }
+	    if(vis.points.size() != 0)
+		vis.averagedis /= (double)vis.points.size();
+	    else
+		vis.averagedis = -1;
+	}
+    }, num_threads);
+}
+}  // namespace
+
+void getCandidatePanoramas(const PointCloud &objectcloud, const PanoramaCache &panoramas, vector<int>&candidates){
+    candidates.clear();
+    if(objectcloud.GetNumPoints() == 0)
+	return;
+    //no object point is closer than the bounding box
+    const vector<double>& bbox = objectcloud.GetBoundingbox();
+    for(int panid=0; panid<panoramas.GetNumPanoramas(); panid++){
+	const Vector3d& center = panoramas.GetCenter(panid);
+	Vector3d offset;
+	for(int a=0; a<3; a++)
+	    offset[a] = max(0.0, max(bbox[2 * a] - center[a], center[a] - bbox[2 * a + 1]));
+	if(offset.norm() < kMaxObjectDistance)
+	    candidates.push_back(panid);
+    }
+}
+
+void scheduleRooms(const vector<vector<int> >&candidates, vector<int>&order){
+    const int roomnum = candidates.size();
+    order.clear();
+    vector<bool>scheduled(roomnum, false);
+    vector<int>last_candidates;
+    for(int i=0; i<roomnum; i++){
+	//greedily, the room sharing the most panoramas with the previous
+	//one. This is a heuristic and does not bound the reloads.
+	int best_room = -1;
+	int best_shared = -1;
+	for(int roomid=0; roomid<roomnum; roomid++){
+	    if(scheduled[roomid])
+		continue;
+	    vector<int>shared;
+	    set_intersection(candidates[roomid].begin(), candidates[roomid].end(),
+			     last_candidates.begin(), last_candidates.end(),
+			     back_inserter(shared));
+	    if((int)shared.size() > best_shared){
+		best_shared = shared.size();
+		best_room = roomid;
+	    }
+	}
+	scheduled[best_room] = true;
+	order.push_back(best_room);
+	last_candidates = candidates[best_room];
+    }
+}
+
+void getObjectColor(PointCloud &objectcloud, PanoramaCache &panoramas, const vector<int>&candidates, const vector<vector<int> >&objectgroup, const int roomid, const int num_threads){
+     if(panoramas.GetNumPanoramas() == 0 || objectgroup.size() == 0 || objectcloud.GetNumPoints() == 0)
+	  return;
     const int min_overlap_points = 10;
-    const int pansize = panorama.size();
+    const int pansize = panoramas.GetNumPanoramas();
     const double min_assigned_ratio = 0.98;
-    const double max_averagedis = 5000.0;
-    const double max_pt_per_pixel = 0.2;
     const double weight_depthcoverage = 7.0;
     char buffer[100];
 
     vector<bool>assigned(objectcloud.GetNumPoints());
-    vector<bool>is_used(pansize);
-    vector<double>averagedis(pansize);
-
+    vector<int>local_index(objectcloud.GetNumPoints(), -1);
     vector<int>point_to_remove;
 
+    vector<vector<PanoramaVisibility> >visibility;
+    ComputeVisibility(objectcloud, panoramas, candidates, objectgroup, num_threads, visibility);
+
     for(int objid=0; objid<objectgroup.size(); objid++){
 	for(const auto&v: objectgroup[objid])
 	    assigned[v] = false;
-	for(auto &v: averagedis)
-	    v = 0.0;
-	vector<vector<int> >point_list(pansize);
-	//Get list of visible points of each panorama
+	const vector<PanoramaVisibility>& point_list = visibility[objid];
+
+	//For each point, the panoramas seeing it
+	for(int i=0; i<objectgroup[objid].size(); i++)
+	    local_index[objectgroup[objid][i]] = i;
+	vector<vector<int> >seen_by(objectgroup[objid].size());
 	for(int panid=0; panid<pansize; panid++){
-	    const double depth_margin = panorama[panid].GetAverageDistance() * kDepthMarginRatio;
-	    for(const auto& ptid: objectgroup[objid]){
-		Vector3d curpt = objectcloud.GetPoint(ptid).position;
-		double ptdepth = (curpt - panorama[panid].GetCenter()).norm();
-		Vector2d RGB_pix = panorama[panid].Project(curpt);
-		if(!panorama[panid].IsInsideRGB(RGB_pix))
-		    continue;
-		if(panorama[panid].GetRGB(RGB_pix).norm() == 0)
-		    continue;
-		Vector2d depth_pix = panorama[panid].RGBToDepth(RGB_pix);
-		if(ptdepth < panorama[panid].GetDepth(depth_pix) + depth_margin){
-		    point_list[panid].push_back(ptid);
-		    averagedis[panid] += ptdepth;
-		}
-	    }
-	    if(point_list[panid].size() != 0)
-		averagedis[panid] /= (double)point_list[panid].size();
-	    else
-		averagedis[panid] = -1;
+	    for(const auto& ptid: point_list[panid].points)
+		seen_by[local_index[ptid]].push_back(panid);
+	}
+
+	//Geeadily search for smallest set of panorama. The depth coverage of
+	//a panorama is fixed and its coverage gain only drops as points get
+	//assigned, so queued scores are upper bounds and are refreshed lazily.
+	vector<int>coveragegain(pansize);
+	priority_queue<pair<double, int> >candidates;
+	for(int panid=0; panid<pansize; panid++){
+	    coveragegain[panid] = point_list[panid].points.size();
+	    if(point_list[panid].averagedis == 0 || point_list[panid].averagedis >= kMaxObjectDistance)
+		continue;
+	    //ties go to the smaller panorama id
+	    candidates.push(make_pair(coveragegain[panid] + point_list[panid].depthcoverage * weight_depthcoverage, -panid));
 	}
-	//Geeadily search for smallest set of panorama
 	vector<int>pan_selected;
-	for(int i=0; i<pansize; i++)
-	    is_used[i] = false;
-	while(true){
-	    double totalcoverage = 0;
-	    for(const auto&v: objectgroup[objid]){
-		if(assigned[v])
-		    totalcoverage += 1.0;
+	int num_assigned = 0;
+	while(num_assigned < min_assigned_ratio * (double)objectgroup[objid].size() && !candidates.empty()){
+	    const int panid = -candidates.top().second;
+	    const double score = coveragegain[panid] + point_list[panid].depthcoverage * weight_depthcoverage;
+	    if(score < candidates.top().first){
+		candidates.pop();
+		candidates.push(make_pair(score, -panid));
+		continue;
 	    }
-	    if(totalcoverage >= min_assigned_ratio * (double)objectgroup[objid].size())
+	    if(score <= 0)
 		break;
-	       
-	    double max_score = 0;
-	    int max_panid = -1;
-	    vector<vector<bool> >depth_occupicy(depthwidth);
-	    for(int x=0; x<depthwidth; ++x)
-		 depth_occupicy[x].resize(depthheight);
-	    for(int panid=0; panid<pansize; panid++){
-		if(is_used[panid] || (averagedis[panid] == 0))
+	    candidates.pop();
+	    for(const auto&v: point_list[panid].points){
+		if(assigned[v])
 		    continue;
-		double curcoveragegain = 0;
-		double depthcoverage = 0;
-		for(int x=0;x<depthwidth;++x){
-		     for(int y=0;y<depthheight;++y)
-			  depth_occupicy[x][y] = false;
-		}
-
-		for(const auto &ptid: point_list[panid]){
-		    if(!assigned[ptid])
-			curcoveragegain += 1.0;
-		    structured_indoor_modeling::Point curpt = objectcloud.GetPoint(ptid);
-		    Vector2d RGB_pix = panorama[panid].Project(curpt.position);
-		    Vector2d depth_pixel = panorama[panid].RGBToDepth(RGB_pix);
-		    if(panorama[panid].IsInsideDepth(depth_pixel) == false)
-			 continue;
-		    if(depth_occupicy[floor(depth_pixel[0])][floor(depth_pixel[1])] == false)
-			 depthcoverage += 1.0;
-		    depth_occupicy[floor(depth_pixel[0])][floor(depth_pixel[1])] = true;
-		}
-		double curscore = curcoveragegain + depthcoverage * weight_depthcoverage;
-		if(curscore > max_score && averagedis[panid] < max_averagedis){
-		    max_score = curscore;
-		    max_panid = panid;
-		}
-	    }
-	    if(max_panid == -1)
-		break;
-	    for(const auto&v: point_list[max_panid])
 		assigned[v] = true;
-	    is_used[max_panid] = true;
-	    pan_selected.push_back(max_panid);
+		num_assigned++;
+		for(const auto& other: seen_by[local_index[v]])
+		    coveragegain[other]--;
+	    }
+	    pan_selected.push_back(panid);
 	}//while
 #if 0
 	cout<<"object "<<objid<<",used panorama: ";
@@ -210,18 +296,19 @@ void getObjectColor(PointCloud &objectcloud,const vector<Panorama>&panorama,cons
 	for(int ptid=0; ptid<objectcloud.GetNumPoints(); ptid++)
 	    assigned[ptid] = false;
 	for(const auto& panid: pan_selected){
-	    Mat panout = panorama[panid].GetRGBImage().clone();
+	    const shared_ptr<const Panorama> panorama = panoramas.Get(panid);
+	    Mat panout = panorama->GetRGBImage().clone();
 	    vector<Vector3f>color_src;
 	    vector<Vector3f>color_tgt;
-	    for(const auto& ptid: point_list[panid]){
+	    for(const auto& ptid: point_list[panid].points){
 		Vector3d curpt = objectcloud.GetPoint(ptid).position;
-		Vector2d RGB_pix = panorama[panid].Project(curpt);
+		Vector2d RGB_pix = panorama->Project(curpt);
 		
 		panout.at<Vec3b>((int)RGB_pix[1], (int)RGB_pix[0])[0] = 255;
 		panout.at<Vec3b>((int)RGB_pix[1], (int)RGB_pix[0])[1] = 0;
 		panout.at<Vec3b>((int)RGB_pix[1], (int)RGB_pix[0])[2] = 0;
 		
-		Vector3f curColor = panorama[panid].GetRGB(RGB_pix);
+		Vector3f curColor = panorama->GetRGB(RGB_pix);
 		swap(curColor[0],curColor[2]);
 		if(assigned[ptid]){
 		    color_src.push_back(curColor);
@@ -231,17 +318,16 @@ void getObjectColor(PointCloud &objectcloud,const vector<Panorama>&panorama,cons
 	    
 	    sprintf(buffer,"temp/room%03d_obj%03d_pan%03d.png", roomid, objid, panid);
 	    imwrite(string(buffer), panout);
-	    waitKey(10);
 	    
 	    Matrix3f colorTransform = Matrix3f::Identity();
 	    if(color_src.size() > min_overlap_points)
 		computeColorTransform(color_src, color_tgt, colorTransform);
-	    for(const auto& ptid: point_list[panid]){
+	    for(const auto& ptid: point_list[panid].points){
 		if(assigned[ptid])
 		    continue;
 		Vector3d curpt = objectcloud.GetPoint(ptid).position;
-		Vector2d RGB_pix = panorama[panid].Project(curpt);
-		Vector3f curColor = panorama[panid].GetRGB(RGB_pix);
+		Vector2d RGB_pix = panorama->Project(curpt);
+		Vector3f curColor = panorama->GetRGB(RGB_pix);
 		swap(curColor[0], curColor[2]);
 		Vector3f color_to_assigned =  colorTransform*curColor;
 		
@@ -415,7 +501,10 @@ void removeNearWallObjects(const IndoorPolygon& indoor_polygon,
 
 
 //     if 95% points are too near to a wall, remove
+     // Points are removed after the loop, so that the object index is
+     // built only once.
      const double removeRatio = 0.75;
+     vector<int>point_to_remove;
      for(int objid=0; objid<objectcloud.GetNumObjects(); objid++){
      	  vector<structured_indoor_modeling::Point> objpt;
      	  objectcloud.GetObjectPoints(objid, objpt);
@@ -434,12 +523,11 @@ void removeNearWallObjects(const IndoorPolygon& indoor_polygon,
 	      if(occupancy[index])
 		  removecount += 1.0;
      	  }
-     	  if(removecount / (double)objpt.size() > removeRatio){
-	      vector<int>point_to_remove;
+     	  if(removecount / (double)objpt.size() > removeRatio)
 	      objectcloud.GetObjectIndice(objid, point_to_remove);
-	      objectcloud.RemovePoints(point_to_remove);
-     	  }
      }
+     if(!point_to_remove.empty())
+	 objectcloud.RemovePoints(point_to_remove);
 }
 
 
@@ -781,12 +869,11 @@ void ReadObjectCloud(const FileIO &file_io, const Floorplan& plan, vector<PointC
 //	    if(object_bbox[4] > max_z)
 //		isremove = true;
 
-	    if(isremove){
-		vector<int>points_to_remove;
+	    if(isremove)
 		curob.GetObjectIndice(objid, points_to_remove);
-		curob.RemovePoints(points_to_remove);
-	    }
 	}
+	if(!points_to_remove.empty())
+	    curob.RemovePoints(points_to_remove);
 //	cleanObjects(curob);
 	vector <vector <int> > curgroup;
 	groupObject(curob, curgroup);
@@ -13,6 +13,7 @@
 #include "MRF/mrf.h"
 #include "MRF/GCoptimization.h"
 #include "depth_filling.h"
+#include "panorama_cache.h"
 
 
 void initPanorama(const structured_indoor_modeling::FileIO &file_io, std::vector<structured_indoor_modeling::Panorama>&panorama, std::vector<std::vector<int> >&labels, const int expected_num, std::vector<int>&numlabels,std::vector<structured_indoor_modeling::DepthFilling>&depth, int &imgwidth, int &imgheight, const int startid, const int endid, const bool recompute = false);
@@ -20,7 +21,14 @@ void initPanorama(const structured_indoor_modeling::FileIO &file_io, std::vector
 void AllRange(std::vector<int>&array, std::vector<std::vector<int> >&result, int k, int m);
 
 
-void getObjectColor(structured_indoor_modeling::PointCloud &objectcloud, const std::vector<structured_indoor_modeling::Panorama>&panorama, const std::vector<std::vector<int> >&objectgroup, const int roomid);
+//panoramas that may color objects of the room, in increasing order
+void getCandidatePanoramas(const structured_indoor_modeling::PointCloud &objectcloud, const structured_indoor_modeling::PanoramaCache &panoramas, std::vector<int>&candidates);
+
+//best-effort room order in which consecutive rooms tend to share
+//candidate panoramas (greedy, so reloads are reduced but not bounded)
+void scheduleRooms(const std::vector<std::vector<int> >&candidates, std::vector<int>&order);
+
+void getObjectColor(structured_indoor_modeling::PointCloud &objectcloud, structured_indoor_modeling::PanoramaCache &panoramas, const std::vector<int>&candidates, const std::vector<std::vector<int> >&objectgroup, const int roomid, const int num_threads);
 
 
 void removeNearWallObjects(const structured_indoor_modeling::IndoorPolygon& indoor_polygon,
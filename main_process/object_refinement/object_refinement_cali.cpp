@@ -11,8 +11,10 @@
 #include <typeinfo>
 #include "object_refinement.h"
 #include "depth_filling.h"
+#include "panorama_cache.h"
+#include "../../base/parallel.h"
 #include <algorithm>
-#include "time.h"
+#include <chrono>
 
 //#define __INCOMPLETE__
 
@@ -28,6 +30,11 @@ DEFINE_int32(start_id, 0,"Start id");
 DEFINE_int32(end_id,-1, "End id");
 DEFINE_int32(nsmooth, 3, "Iterations of smoothing");
 DEFINE_bool(recompute, false, "Recompute superpixel");
+DEFINE_int32(num_threads, 0, "Total number of threads shared by all the rooms (0 uses all the cores).");
+DEFINE_int32(num_concurrent_rooms, 0,
+             "Number of rooms processed at the same time (0 uses one per thread).");
+DEFINE_int32(panorama_budget_mb, 4096,
+             "Approximate memory for panoramas kept loaded between rooms. 0 means no limit.");
 
 bool compare_by_z(const structured_indoor_modeling::Point &pt1, const structured_indoor_modeling::Point &pt2){
      return pt1.position[2] < pt2.position[2];
@@ -54,14 +61,11 @@ int main(int argc, char **argv){
 
     //get path to data
 
-    char buffer[1024];
     FileIO file_io(argv[1]);
 
     const int &startid = FLAGS_start_id;
     const int &endid = GetNumPanoramas(file_io) - 1;
 
-    clock_t start,end;
-
     //////////////////////////////////////
     //Init Panoramas
     //objectgroup: room->object->points
@@ -69,44 +73,63 @@ int main(int argc, char **argv){
     vector <PointCloud> objectcloud;
     vector <PointCloud> backgroundCloud;
     vector <vector <vector<int> > >objectgroup;
-    vector <Panorama> panorama;
-    vector <vector <int> >labels;
-    vector <int> numlabels;
     vector <vector<int> >superpixelLabel(endid - startid + 1); //label of superpixel for each panorama
     vector <vector<vector<int> > >labelgroup(endid - startid + 1);
     vector < vector<list<PointCloud> > > objectlist; //room->object->object part
-    vector<DepthFilling> depth(endid - startid + 1);
 
     IndoorPolygon indoor_polygon(file_io.GetIndoorPolygon());
     Floorplan floorplan(file_io.GetFloorplan());
 
 
 //    cout<<"Init..."<<endl;
-    int imgheight, imgwidth;
-    initPanorama(file_io, panorama, labels, FLAGS_label_num, numlabels,depth, imgwidth, imgheight, startid, endid, FLAGS_recompute);
+    //Panoramas are loaded on demand and shared by the rooms
+    PanoramaCache panoramas(file_io, startid, endid, (size_t)max(0, FLAGS_panorama_budget_mb) * 1024 * 1024);
     ReadObjectCloud(file_io, floorplan, objectcloud, objectgroup);
 
-    start = clock();    
-
-    for(int roomid=0; roomid<objectcloud.size(); roomid++){
+    const auto start_time = chrono::steady_clock::now();
+
+    //Rooms seeing the same panoramas are processed close in time, so
+    //that their panoramas are likely still in the cache. The order is
+    //best-effort, and a panorama may still be read more than once when
+    //the budget is small or the rooms run concurrently.
+    vector<vector<int> >candidates(objectcloud.size());
+    for(int roomid=0; roomid<objectcloud.size(); roomid++)
+	getCandidatePanoramas(objectcloud[roomid], panoramas, candidates[roomid]);
+    vector<int>room_order;
+    scheduleRooms(candidates, room_order);
+
+    const int num_threads =
+	FLAGS_num_threads > 0 ? FLAGS_num_threads : GetDefaultNumThreads();
+    const int num_concurrent_rooms =
+	max(1, min(num_threads,
+		   FLAGS_num_concurrent_rooms > 0 ? FLAGS_num_concurrent_rooms : num_threads));
+    const int num_threads_per_room = max(1, num_threads / num_concurrent_rooms);
+
+    ParallelFor(0, (int)room_order.size(), [&](const int i){
+	const int roomid = room_order[i];
+	char buffer[1024];
     	 // for(int objid=0; objid<objectgroup[roomid].size(); objid++){
     	 //      sprintf(buffer,"temp/object_room%03d_obj%03d.ply",roomid,objid);
     	 //      objectcloud[roomid].WriteObject(string(buffer), objid);
     	 // }
 //    	cout<<"---------------------"<<endl;
 //  	cout<<"Room "<<roomid<<endl;
-    	getObjectColor(objectcloud[roomid], panorama, objectgroup[roomid] ,roomid);
+    	getObjectColor(objectcloud[roomid], panoramas, candidates[roomid], objectgroup[roomid], roomid, num_threads_per_room);
 	removeNearWallObjects(indoor_polygon,
 			      floorplan,
 			      roomid,
 			      objectcloud[roomid]);
 	cleanObjects(objectcloud[roomid], objectgroup[roomid]);
 	//sort point according to z
+	vector<vector<int> >objinds(objectgroup[roomid].size());
+	for(int objid=0; objid<objectgroup[roomid].size(); objid++)
+	     objectcloud[roomid].GetObjectIndice(objid, objinds[objid]);
 	for(int objid=0; objid<objectgroup[roomid].size(); objid++){
+	     const vector<int>& objind = objinds[objid];
 	     vector<structured_indoor_modeling::Point>sort_array;
-	     vector<int>objind;
-	     objectcloud[roomid].GetObjectPoints(objid, sort_array);
-	     objectcloud[roomid].GetObjectIndice(objid, objind);
+	     sort_array.reserve(objind.size());
+	     for(const int ind: objind)
+		  sort_array.push_back(objectcloud[roomid].GetPointData()[ind]);
 	     sort(sort_array.begin(), sort_array.end(), compare_by_z);
 	     for(int i=0; i<objind.size(); ++i)
 		  objectcloud[roomid].GetPoint(objind[i]) = sort_array[i];
@@ -122,6 +145,8 @@ int main(int argc, char **argv){
 //	cout<<"Smoothing..."<<flush;
 	for(int t=0;t<FLAGS_nsmooth;t++)
 	    SmoothObjects(neighbors, &objectcloud[roomid].GetPointData());
+	// Positions were changed through GetPointData.
+	objectcloud[roomid].Update();
 //	cout<<"done!"<<endl;
 //	cout<<"Saving "<<file_io.GetRefinedObjectClouds(roomid)<<endl;
 
@@ -135,7 +160,7 @@ int main(int argc, char **argv){
 	}
 	
     	objectcloud[roomid].Write(file_io.GetRefinedObjectClouds(roomid));
-    }
+    }, num_concurrent_rooms);
 
     
 
@@ -208,8 +233,10 @@ int main(int argc, char **argv){
 //     	cout<<"Saving "<<savepath<<endl;
 //     	resultCloud[roomid].Write(savepath);
 //     }
-    end = clock();
-    printf("Running time for object refinement: %f\n",(float)(end-start)/CLOCKS_PER_SEC);
+    const double running_time =
+	chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+    printf("Running time for object refinement: %f\n", running_time);
+    printf("Panorama loads: %d for %d panoramas\n", panoramas.GetNumLoads(), panoramas.GetNumPanoramas());
 
     return 0;
 }
@@ -0,0 +1,79 @@
+#include "panorama_cache.h"
+#include "../../base/file_io.h"
+#include "../../base/panorama.h"
+#include <cstdlib>
+#include <iostream>
+
+using namespace std;
+
+namespace structured_indoor_modeling{
+
+  PanoramaCache::PanoramaCache(const FileIO& file_io, const int startid, const int endid, const size_t budget)
+    : file_io(file_io), startid(startid), budget(budget), resident_bytes(0), num_loads(0){
+    const int num_panoramas = max(0, endid - startid + 1);
+    centers.resize(num_panoramas);
+    entries.resize(num_panoramas);
+    for(int index=0; index<num_panoramas; ++index){
+      Panorama camera;
+      camera.InitWithoutLoadingImages(file_io, startid + index);
+      centers[index] = camera.GetCenter();
+      entries[index].loading = false;
+      entries[index].bytes = 0;
+    }
+  }
+
+  shared_ptr<const Panorama> PanoramaCache::Get(const int index){
+    unique_lock<mutex> lock(cache_mutex);
+    Entry& entry = entries[index];
+    loaded.wait(lock, [&]() { return !entry.loading; });
+    if(entry.resident){
+      lru.splice(lru.begin(), lru, entry.lru_position);
+      return entry.resident;
+    }
+
+    shared_ptr<const Panorama> panorama = entry.alive.lock();
+    if(!panorama){
+      entry.loading = true;
+      lock.unlock();
+      shared_ptr<Panorama> new_panorama(new Panorama);
+      if(!new_panorama->Init(file_io, startid + index))
+	exit (1);
+      new_panorama->MakeOnlyBackgroundBlack();
+      lock.lock();
+
+      panorama = new_panorama;
+      entry.alive = panorama;
+      entry.loading = false;
+      ++num_loads;
+      loaded.notify_all();
+    }
+
+    entry.resident = panorama;
+    const cv::Mat rgb_image = panorama->GetRGBImage();
+    entry.bytes = rgb_image.total() * rgb_image.elemSize() +
+      (size_t)panorama->DepthWidth() * panorama->DepthHeight() * sizeof(double);
+    resident_bytes += entry.bytes;
+    lru.push_front(index);
+    entry.lru_position = lru.begin();
+    Evict();
+    return panorama;
+  }
+
+  int PanoramaCache::GetNumLoads(){
+    lock_guard<mutex> lock(cache_mutex);
+    return num_loads;
+  }
+
+  void PanoramaCache::Evict(){
+    if(budget == 0)
+      return;
+    // The panorama just used is never evicted.
+    while(resident_bytes > budget && lru.size() > 1){
+      Entry& entry = entries[lru.back()];
+      lru.pop_back();
+      resident_bytes -= entry.bytes;
+      entry.resident.reset();
+    }
+  }
+
+}  // namespace structured_indoor_modeling
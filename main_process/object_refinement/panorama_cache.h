@@ -0,0 +1,60 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace structured_indoor_modeling{
+
+  class FileIO;
+  class Panorama;
+
+  // Loads panoramas [startid, endid] on demand (Init followed by
+  // MakeOnlyBackgroundBlack) and keeps the recently used ones while
+  // their RGB and depth fit in the budget. Only camera centers stay
+  // resident. Panoramas are indexed from 0 (i.e., id - startid).
+  //
+  // A returned panorama stays valid while the pointer is held, even if
+  // it is evicted meanwhile, so the memory in use is the budget plus
+  // the panoramas held by callers. Thread-safe.
+  class PanoramaCache{
+  public:
+    // budget is in bytes. 0 keeps every loaded panorama.
+    PanoramaCache(const FileIO& file_io, const int startid, const int endid, const size_t budget);
+
+    int GetNumPanoramas() const{return centers.size();}
+    const Eigen::Vector3d& GetCenter(const int index) const{return centers[index];}
+    std::shared_ptr<const Panorama> Get(const int index);
+    // Number of times panoramas were read from disk.
+    int GetNumLoads();
+
+  private:
+    struct Entry{
+      std::shared_ptr<const Panorama> resident;
+      // Still alive while a caller holds it after the eviction.
+      std::weak_ptr<const Panorama> alive;
+      bool loading;
+      size_t bytes;
+      std::list<int>::iterator lru_position;
+    };
+
+    void Evict();
+
+    const FileIO& file_io;
+    const int startid;
+    const size_t budget;
+    std::vector<Eigen::Vector3d> centers;
+
+    std::vector<Entry> entries;
+    // The most recently used comes first.
+    std::list<int> lru;
+    size_t resident_bytes;
+    int num_loads;
+    std::mutex cache_mutex;
+    std::condition_variable loaded;
+  };
+
+}  // namespace structured_indoor_modeling
@@ -0,0 +1,71 @@
+#include <Eigen/Dense>
+#include <algorithm>
+
+#include "../../base/kdtree/KDtree.h"
+#include "../../base/parallel.h"
+#include "../../base/point_cloud.h"
+#include "neighbor_graph.h"
+
+using namespace Eigen;
+using namespace std;
+
+namespace structured_indoor_modeling {
+
+void BuildNeighborGraph(const std::vector<Point>& points,
+                        const int num_neighbors,
+                        NeighborGraph* graph,
+                        const int num_threads) {
+  const int num_points = points.size();
+  graph->offsets.assign(num_points + 1, 0);
+  graph->indices.clear();
+  graph->distances.clear();
+  if (num_points == 0)
+    return;
+
+  vector<float> point_data;
+  point_data.reserve(3 * num_points);
+  for (const auto& point : points) {
+    for (int i = 0; i < 3; ++i)
+      point_data.push_back(point.position[i]);
+  }
+  const KDtree kdtree(point_data);
+
+  // Queries are answered into fixed size slots, then compacted.
+  vector<int> counts(num_points, 0);
+  vector<int> slot_indices((size_t)num_points * num_neighbors);
+  vector<float> slot_distances((size_t)num_points * num_neighbors);
+
+  const int kBatchSize = 1024;
+  const int num_batches = (num_points + kBatchSize - 1) / kBatchSize;
+  ParallelFor(0, num_batches, [&](const int batch) {
+    vector<const float*> knn;
+    const int end = min(num_points, (batch + 1) * kBatchSize);
+    for (int p = batch * kBatchSize; p < end; ++p) {
+      knn.clear();
+      const Vector3f ref_point(point_data[3 * p], point_data[3 * p + 1], point_data[3 * p + 2]);
+      kdtree.find_k_closest_to_pt(knn, num_neighbors, &ref_point[0]);
+
+      const size_t slot = (size_t)p * num_neighbors;
+      for (int i = 0; i < (int)knn.size(); ++i) {
+        const float* fp = knn[i];
+        slot_indices[slot + i] = (fp - &point_data[0]) / 3;
+        slot_distances[slot + i] = (Vector3f(fp[0], fp[1], fp[2]) - ref_point).norm();
+      }
+      counts[p] = knn.size();
+    }
+  }, num_threads);
+
+  for (int p = 0; p < num_points; ++p)
+    graph->offsets[p + 1] = graph->offsets[p] + counts[p];
+  graph->indices.resize(graph->offsets[num_points]);
+  graph->distances.resize(graph->offsets[num_points]);
+  for (int p = 0; p < num_points; ++p) {
+    const size_t slot = (size_t)p * num_neighbors;
+    copy(slot_indices.begin() + slot, slot_indices.begin() + slot + counts[p],
+         graph->indices.begin() + graph->offsets[p]);
+    copy(slot_distances.begin() + slot, slot_distances.begin() + slot + counts[p],
+         graph->distances.begin() + graph->offsets[p]);
+  }
+}
+
+}  // namespace structured_indoor_modeling
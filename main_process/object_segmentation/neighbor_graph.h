@@ -0,0 +1,76 @@
+#ifndef NEIGHBOR_GRAPH_H_
+#define NEIGHBOR_GRAPH_H_
+
+/*
+  k-nearest neighbor graph of a point set in a compressed sparse row
+  layout. Neighbors of point p are stored at [offsets[p], offsets[p + 1])
+  of indices and distances, sorted from the closest. As in a raw
+  KDtree query, the point itself is its own first neighbor.
+
+  BuildNeighborGraph builds one KDtree and answers the queries in
+  parallel batches over num_threads threads.
+
+  < Example >
+
+  NeighborGraph neighbors;
+  BuildNeighborGraph(points, 8, &neighbors);
+  for (int i = 0; i < neighbors[p].size(); ++i)
+    const int q = neighbors[p][i];
+ */
+
+#include <vector>
+
+#include "../../base/parallel.h"
+
+namespace structured_indoor_modeling {
+
+struct Point;
+
+class NeighborGraph {
+ public:
+  // Read-only view of the neighbors of one point.
+  class Neighbors {
+  public:
+    Neighbors(const int* indices, const float* distances, const int length)
+      : indices(indices), distances(distances), length(length) {}
+    int size() const { return length; }
+    int operator[](const int i) const { return indices[i]; }
+    float GetDistance(const int i) const { return distances[i]; }
+    const int* begin() const { return indices; }
+    const int* end() const { return indices + length; }
+  private:
+    const int* indices;
+    const float* distances;
+    int length;
+  };
+
+  NeighborGraph() {}
+
+  int size() const { return offsets.empty() ? 0 : (int)offsets.size() - 1; }
+  Neighbors operator[](const int p) const {
+    return Neighbors(indices.data() + offsets[p], distances.data() + offsets[p],
+                     offsets[p + 1] - offsets[p]);
+  }
+
+  const std::vector<int>& GetOffsets() const { return offsets; }
+  const std::vector<int>& GetIndices() const { return indices; }
+
+ private:
+  std::vector<int> offsets;
+  std::vector<int> indices;
+  std::vector<float> distances;
+
+  friend void BuildNeighborGraph(const std::vector<Point>& points,
+                                 const int num_neighbors,
+                                 NeighborGraph* graph,
+                                 const int num_threads);
+};
+
+void BuildNeighborGraph(const std::vector<Point>& points,
+                        const int num_neighbors,
+                        NeighborGraph* graph,
+                        const int num_threads = GetDefaultNumThreads());
+
+}  // namespace structured_indoor_modeling
+
+#endif  // NEIGHBOR_GRAPH_H_
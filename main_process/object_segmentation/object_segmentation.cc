@@ -8,7 +8,7 @@
 #include "../../base/floorplan.h"
 #include "../../base/indoor_polygon.h"
 #include "../../base/point_cloud.h"
-#include "../../base/kdtree/KDtree.h"
+#include "neighbor_graph.h"
 #include "object_segmentation.h"
 
 using namespace Eigen;
@@ -29,16 +29,24 @@ namespace {
 
   void InitializeCentroids(const std::vector<Point>& points,
                            const int num_initial_clusters,
+                           std::mt19937* generator,
                            std::vector<int>* segments);
   
   void ComputeDistances(const std::vector<Point>& points,
-                        const std::vector<std::vector<int> >& neighbors,
+                        const NeighborGraph& neighbors,
                         const int index,
                         const std::vector<int>& segments,
                         std::vector<double>* distances);
+
+  void ComputeClosestSeeds(const std::vector<Point>& points,
+                           const NeighborGraph& neighbors,
+                           const std::vector<int>& seeds,
+                           const std::vector<int>& segments,
+                           std::vector<double>* distances,
+                           std::vector<int>* clusters);
   
   void AssignFromCentroids(const std::vector<Point>& points,
-                           const std::vector<std::vector<int> >& neighbors,
+                           const NeighborGraph& neighbors,
                            std::vector<int>* segments);
   
   void ComputeCentroids(const std::vector<Point>& points, const double ratio, vector<int>* segments);
@@ -48,7 +56,7 @@ namespace {
                  std::map<int, int>* old_to_new);
   
   bool Merge(const std::vector<Point>& points,
-             const std::vector<std::vector<int> >& neighbors,
+             const NeighborGraph& neighbors,
              std::vector<int>* segments,
              std::map<int, Eigen::Vector3i>* color_table);
 
@@ -268,6 +276,20 @@ void CollectPointsInRoom(const std::vector<PointCloud>& point_clouds,
   }
 }
 
+void PartitionPointsByRoom(const PointCloud& point_cloud,
+                           const Floorplan& floorplan,
+                           const std::vector<int>& room_occupancy,
+                           std::vector<std::vector<Point> >* room_points) {
+  for (int p = 0; p < point_cloud.GetNumPoints(); ++p) {
+    const Vector3d& local = point_cloud.GetPoint(p).position;
+    const Vector2i grid_int = floorplan.LocalToGridInt(Vector2d(local[0], local[1]));
+    const int index = grid_int[1] * floorplan.GetGridSize()[0] + grid_int[0];
+    const int room = room_occupancy[index];
+    if (0 <= room && room < room_points->size())
+      room_points->at(room).push_back(point_cloud.GetPoint(p));
+  }
+}
+
 void IdentifyFloorWallCeiling(const std::vector<Point>& points,
                               const Floorplan& floorplan,
                               const int room,
@@ -404,35 +426,18 @@ void IdentifyDetails(const std::vector<Point>& points,
   }
 }
   
-void FilterNoisyPoints(std::vector<Point>* points) {
+void FilterNoisyPoints(std::vector<Point>* points, const int num_threads) {
   const int kNumNeighbors = 20;
 
-  vector<float> point_data;
-  {
-    point_data.reserve(3 * points->size());
-    for (int p = 0; p < points->size(); ++p) {
-      for (int i = 0; i < 3; ++i)
-        point_data.push_back(points->at(p).position[i]);
-    }
-  }
-  KDtree kdtree(point_data);
-  vector<const float*> knn;
+  NeighborGraph neighbors;
+  BuildNeighborGraph(*points, kNumNeighbors, &neighbors, num_threads);
   vector<float> neighbor_distances(points->size());
   for (int p = 0; p < points->size(); ++p) {
-    knn.clear();
-    const Vector3f ref_point(points->at(p).position[0],
-                             points->at(p).position[1],
-                             points->at(p).position[2]);
-                      
-    kdtree.find_k_closest_to_pt(knn, kNumNeighbors, &ref_point[0]);
-                               
+    const NeighborGraph::Neighbors knn = neighbors[p];
     double neighbor_distance = 0.0;
-    for (int i = 0; i < knn.size(); ++i) {
-      const float* fp = knn[i];
-      const Vector3f point(fp[0], fp[1], fp[2]);
-      neighbor_distance += (point - ref_point).norm();
-    }
-    neighbor_distances[p] = neighbor_distance / max(1, (int)knn.size());
+    for (int i = 0; i < knn.size(); ++i)
+      neighbor_distance += knn.GetDistance(i);
+    neighbor_distances[p] = neighbor_distance / max(1, knn.size());
   }
   //----------------------------------------------------------------------
   double average = 0.0;
@@ -458,19 +463,20 @@ void FilterNoisyPoints(std::vector<Point>* points) {
   points->swap(new_points);
 }
 
-void Subsample(const double ratio, std::vector<Point>* points) {
+void Subsample(const double ratio, std::mt19937* generator, std::vector<Point>* points) {
   const int new_size = static_cast<int>(round(ratio * points->size()));
-  random_shuffle(points->begin(), points->end());
+  shuffle(points->begin(), points->end(), *generator);
   points->resize(new_size);
 }
   
 void SegmentObjects(const std::vector<Point>& points,
                     const double centroid_subsampling_ratio,
                     const int num_initial_clusters,
-                    const std::vector<std::vector<int> >& neighbors,
+                    const NeighborGraph& neighbors,
+                    std::mt19937* generator,
                     std::vector<int>* segments) {
   // WritePointsWithColor(points, *segments, "0_first.ply");
-  InitializeCentroids(points, num_initial_clusters, segments);
+  InitializeCentroids(points, num_initial_clusters, generator, segments);
   // WriteObjectPointsWithColor(points, *segments, "1_init.ply");
 
   /*
@@ -514,7 +520,7 @@ void SegmentObjects(const std::vector<Point>& points,
   }  
 }
 
-void SmoothObjects(const std::vector<std::vector<int> >& neighbors,
+void SmoothObjects(const NeighborGraph& neighbors,
                    std::vector<Point>* points) {
   double unit = 0.0;
   int denom = 0;
@@ -557,7 +563,7 @@ void SmoothObjects(const std::vector<std::vector<int> >& neighbors,
 }
   
 // This function calls makes neighbors invalid.
-void DensifyObjects(const std::vector<std::vector<int> >& neighbors,
+void DensifyObjects(const NeighborGraph& neighbors,
                     std::vector<Point>* points,
                     std::vector<int>* segments) {
   double unit = 0.0;
@@ -614,38 +620,11 @@ void DensifyObjects(const std::vector<std::vector<int> >& neighbors,
   
 void SetNeighbors(const std::vector<Point>& points,
                   const int num_neighbors,
-                  std::vector<std::vector<int> >* neighbors) {
-  vector<float> point_data;
-  {
-    point_data.reserve(3 * points.size());
-    for (int p = 0; p < points.size(); ++p) {
-      for (int i = 0; i < 3; ++i)
-        point_data.push_back(points[p].position[i]);
-    }
-  }
-  KDtree kdtree(point_data);
-  vector<const float*> knn;
-  vector<float> neighbor_distances(points.size());
-
-  neighbors->clear();
-  neighbors->resize(points.size());
-
-  for (int p = 0; p < points.size(); ++p) {
-    knn.clear();
-    const Vector3f ref_point(points[p].position[0],
-                             points[p].position[1],
-                             points[p].position[2]);
-                      
-    kdtree.find_k_closest_to_pt(knn, num_neighbors, &ref_point[0]);
-
-    for (int i = 0; i < (int)knn.size(); ++i) {
-      const int index = (knn[i] - &point_data[0]) / 3;
-      neighbors->at(p).push_back(index);
-    }
-  }
+                  const int num_threads,
+                  NeighborGraph* neighbors) {
+  BuildNeighborGraph(points, num_neighbors, neighbors, num_threads);
 }
 
-
 namespace {
 
 bool IsOnFloor(const double floor_height, const double margin, const Point& point) {
@@ -679,6 +658,7 @@ double PointDistance(const Point& lhs, const Point& rhs) {
 
 void InitializeCentroids(const std::vector<Point>& points,
                          const int num_initial_clusters,
+                         std::mt19937* generator,
                          std::vector<int>* segments) {
   // Randomly initialize seeds.
   /*
@@ -705,7 +685,7 @@ void InitializeCentroids(const std::vector<Point>& points,
         candidates.push_back(p);
 
     // Pick the first one at random.
-    random_shuffle(candidates.begin(), candidates.end());
+    shuffle(candidates.begin(), candidates.end(), *generator);
     if (candidates.empty())
       return;
 
@@ -746,7 +726,7 @@ void InitializeCentroids(const std::vector<Point>& points,
   
 const double kUnreachable = -1.0;
 void ComputeDistances(const std::vector<Point>& points,
-                      const std::vector<std::vector<int> >& neighbors,
+                      const NeighborGraph& neighbors,
                       const int index,
                       const std::vector<int>& segments,
                       std::vector<double>* distances) {
@@ -783,49 +763,98 @@ void ComputeDistances(const std::vector<Point>& points,
   }
 }
 
+// Multi-source version of ComputeDistances. Every point reachable from
+// a seed gets the distance to the closest seed and its cluster. Equally
+// close seeds are resolved toward the larger cluster id.
+void ComputeClosestSeeds(const std::vector<Point>& points,
+                         const NeighborGraph& neighbors,
+                         const std::vector<int>& seeds,
+                         const std::vector<int>& segments,
+                         std::vector<double>* distances,
+                         std::vector<int>* clusters) {
+  distances->clear();
+  distances->resize(points.size(), kUnreachable);
+  clusters->clear();
+  clusters->resize(points.size(), kInitial);
+
+  // ((-distance, cluster), point).
+  priority_queue<pair<pair<double, int>, int> > distance_index_queue;
+  for (const auto& seed : seeds)
+    distance_index_queue.push(make_pair(make_pair(0.0, segments[seed]), seed));
+
+  while (!distance_index_queue.empty()) {
+    const auto distance_index = distance_index_queue.top();
+    const double distance = -distance_index.first.first;
+    const int cluster     = distance_index.first.second;
+    const int point_index = distance_index.second;
+
+    distance_index_queue.pop();
+    if (distances->at(point_index) != kUnreachable)
+      continue;
+    if (segments[point_index] == kFloor ||
+        segments[point_index] == kWall ||
+        segments[point_index] == kCeiling)
+      continue;
+
+    distances->at(point_index) = distance;
+    clusters->at(point_index) = cluster;
+    for (int i = 0; i < neighbors[point_index].size(); ++i) {
+      const int neighbor = neighbors[point_index][i];
+      if (distances->at(neighbor) != kUnreachable)
+        continue;
+
+      const double new_distance = distance + PointDistance(points[point_index], points[neighbor]);
+      distance_index_queue.push(make_pair(make_pair(- new_distance, cluster), neighbor));
+    }
+  }
+}
+
 void AssignFromCentroids(const std::vector<Point>& points,
-                         const std::vector<std::vector<int> >& neighbors,
+                         const NeighborGraph& neighbors,
                          std::vector<int>* segments) {
   // cluster_pair_distances->clear();
   // For each unassigned point, compute distance from centroids. Use
   // the top 25 percents average to assign to the closest centroid.
   const double kSumRatio = 0.25;
 
-  vector<map<int, vector<double> > > point_cluster_distances(points.size());
-  vector<double> distances;
-//  cerr << "Compute distances..." << flush;
+  map<int, vector<int> > cluster_to_seeds;
   for (int p = 0; p < segments->size(); ++p) {
-//    if (p % (segments->size() / 10) == 0)
-//      cerr << '.' << flush;
-    // Only compute distances to neighbors at the seed points.
     const int cluster = segments->at(p);
-    if (cluster < 0)
-      continue;
+    if (cluster >= 0)
+      cluster_to_seeds[cluster].push_back(p);
+  }
 
-    ComputeDistances(points, neighbors, p, *segments, &distances);
-    for (int p = 0; p < distances.size(); ++p) {
-      if (distances[p] != kUnreachable) {
-        point_cluster_distances[p][cluster].push_back(distances[p]);
-      }
-    }
+  // The average for a cluster with a single seed is the distance to
+  // that seed, so all of them are handled by one multi-source pass.
+  vector<int> single_seeds;
+  for (const auto& item : cluster_to_seeds) {
+    if (item.second.size() == 1)
+      single_seeds.push_back(item.second[0]);
   }
-//  cerr << "done." << endl;
+  vector<double> best_distances;
+  vector<int> best_clusters;
+  ComputeClosestSeeds(points, neighbors, single_seeds, *segments, &best_distances, &best_clusters);
 
-  // For each point, compute the per cluster distance and pick the best.
-  for (int p = 0; p < segments->size(); ++p) {
-    if (segments->at(p) != kInitial)
+  // Clusters with multiple seeds need every seed distance.
+  vector<double> distances;
+  vector<vector<double> > seed_distances;
+  for (const auto& item : cluster_to_seeds) {
+    if (item.second.size() == 1)
       continue;
-
-    const map<int, vector<double> >& cluster_distances = point_cluster_distances[p];
-    double best_distance = 0.0;
-    int best_cluster = kInitial;
-    for (const auto& item : cluster_distances) {
-      const int cluster        = item.first;
-      vector<double> distances = item.second;
-      if (distances.empty()) {
-        cerr << "Impossible." << endl;
-        exit (1);
+    const int cluster = item.first;
+    seed_distances.assign(points.size(), vector<double>());
+    for (const auto& seed : item.second) {
+      ComputeDistances(points, neighbors, seed, *segments, &distances);
+      for (int p = 0; p < distances.size(); ++p) {
+        if (distances[p] != kUnreachable)
+          seed_distances[p].push_back(distances[p]);
       }
+    }
+
+    for (int p = 0; p < segments->size(); ++p) {
+      if (segments->at(p) != kInitial || seed_distances[p].empty())
+        continue;
+      vector<double>& distances = seed_distances[p];
       sort(distances.begin(), distances.end());
       const int length_to_sum = max(1, static_cast<int>(round(distances.size() * kSumRatio)));
       double average_distance = 0.0;
@@ -833,15 +862,21 @@ void AssignFromCentroids(const std::vector<Point>& points,
         average_distance += distances[i];
       }
       average_distance /= length_to_sum;
-      if (best_cluster == kInitial || average_distance <= best_distance) {
-        best_cluster = cluster;
-        best_distance = average_distance;
+      // Same order as visiting clusters in increasing id with <=.
+      if (best_clusters[p] == kInitial ||
+          average_distance < best_distances[p] ||
+          (average_distance == best_distances[p] && best_clusters[p] < cluster)) {
+        best_clusters[p] = cluster;
+        best_distances[p] = average_distance;
       }
     }
-    segments->at(p) = best_cluster;
   }
 
-  
+  for (int p = 0; p < segments->size(); ++p) {
+    if (segments->at(p) == kInitial)
+      segments->at(p) = best_clusters[p];
+  }
+
   /*
   // Initialize remaining.
   //vector<pair<double, int> > distance_segment(segments->size(), pair<double, int>(0.0, kInitial));
@@ -981,7 +1016,7 @@ void UnionFind(const std::set<std::pair<int, int> >& merged,
 }
 
 bool Merge(const std::vector<Point>& points,
-           const std::vector<std::vector<int> >& neighbors,
+           const NeighborGraph& neighbors,
            std::vector<int>* segments,
            map<int, Vector3i>* color_table) {
   map<pair<int, int>, vector<double> > cluster_pair_to_distances;
@@ -1299,6 +1334,7 @@ void WriteObjectPointsWithColor(const std::vector<Point>& points,
                                 const std::vector<int>& segments,
                                 const std::string& filename,
                                 const Eigen::Matrix3d& rotation,
+                                std::mt19937* generator,
                                 map<int, Vector3i>* color_table) {  
   if (points.size() != segments.size()) {
     cerr << "Size do not match: " << (int)points.size() << ' ' << (int)segments.size() << endl;
@@ -1318,9 +1354,10 @@ void WriteObjectPointsWithColor(const std::vector<Point>& points,
     }
     default: {
       if ((*color_table).find(segments[p]) == (*color_table).end()) {
-        (*color_table)[segments[p]][0] = rand() % 255;
-        (*color_table)[segments[p]][1] = rand() % 255;
-        (*color_table)[segments[p]][2] = rand() % 255;
+        uniform_int_distribution<int> channel(0, 254);
+        (*color_table)[segments[p]][0] = channel(*generator);
+        (*color_table)[segments[p]][1] = channel(*generator);
+        (*color_table)[segments[p]][2] = channel(*generator);
       }
       
       point.color[0] = (*color_table)[segments[p]][0];
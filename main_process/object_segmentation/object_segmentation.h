@@ -1,6 +1,7 @@
 #ifndef OBJECT_SEGMENTATION_H_
 #define OBJECT_SEGMENTATION_H_
 
+#include <random>
 #include <vector>
 
 namespace structured_indoor_modeling {
@@ -14,6 +15,7 @@ const int kDetail = -5;
   
 class Floorplan;
 class IndoorPolygon;
+class NeighborGraph;
 class PointCloud;
 struct Point;
 
@@ -37,6 +39,13 @@ void CollectPointsInRoom(const std::vector<PointCloud>& point_clouds,
                          const int room,
                          std::vector<Point>* points);                          
 
+// Same as calling CollectPointsInRoom for every room, but in one pass
+// over the point cloud. room_points must have one bucket per room.
+void PartitionPointsByRoom(const PointCloud& point_cloud,
+                           const Floorplan& floorplan,
+                           const std::vector<int>& room_occupancy,
+                           std::vector<std::vector<Point> >* room_points);
+
 void IdentifyFloorWallCeiling(const std::vector<Point>& points,
                               const Floorplan& floorplan,
                               const int room,
@@ -50,26 +59,30 @@ void IdentifyDetails(const std::vector<Point>& points,
                      const double rescale_margin,
                      std::vector<int>* segments);                          
  
-void Subsample(const double ratio, std::vector<Point>* points);
+// Random choices draw from generator, so that rooms processed in
+// parallel stay reproducible.
+void Subsample(const double ratio, std::mt19937* generator, std::vector<Point>* points);
  
-void FilterNoisyPoints(std::vector<Point>* points);
+void FilterNoisyPoints(std::vector<Point>* points, const int num_threads);
  
 void SegmentObjects(const std::vector<Point>& points,
                     const double centroid_subsampling_ratio,
                     const int num_initial_clusters,
-                    const std::vector<std::vector<int> >& neighbors,
+                    const NeighborGraph& neighbors,
+                    std::mt19937* generator,
                     std::vector<int>* segments);
 
-void SmoothObjects(const std::vector<std::vector<int> >& neighbors,
+void SmoothObjects(const NeighborGraph& neighbors,
                    std::vector<Point>* points);
 
-void DensifyObjects(const std::vector<std::vector<int> >& neighbors,
+void DensifyObjects(const NeighborGraph& neighbors,
                     std::vector<Point>* points,
                     std::vector<int>* segments);
  
 void SetNeighbors(const std::vector<Point>& points,
                   const int num_neighbors,
-                  std::vector<std::vector<int> >* neighbors);
+                  const int num_threads,
+                  NeighborGraph* neighbors);
 
 void RemoveWindowAndMirror(const Floorplan& floorplan,
                            const std::vector<int>& room_occupancy_with_doors,
@@ -80,6 +93,7 @@ void WriteObjectPointsWithColor(const std::vector<Point>& points,
                                 const std::vector<int>& segments,
                                 const std::string& filename,
                                 const Eigen::Matrix3d& rotation,
+                                std::mt19937* generator,
                                 std::map<int, Eigen::Vector3i>* color_table);
 
 void WriteOtherPointsWithColor(const std::vector<Point>& points,
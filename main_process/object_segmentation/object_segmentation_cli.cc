@@ -1,21 +1,34 @@
 #include <Eigen/Dense>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <fstream>
 #include "gflags/gflags.h"
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <random>
 #include <vector>
-#include <time.h>
 
 #include "../../base/file_io.h"
 #include "../../base/floorplan.h"
 #include "../../base/indoor_polygon.h"
+#include "../../base/parallel.h"
 #include "../../base/point_cloud.h"
+#include "neighbor_graph.h"
 #include "object_segmentation.h"
 
 DEFINE_double(point_subsampling_ratio, 1.0, "Make the point set smaller.");
 DEFINE_double(centroid_subsampling_ratio, 0.005, "Ratio of centroids in each segment.");
 DEFINE_double(num_initial_clusters, 100, "Initial cluster.");
 DEFINE_double(rescale_margin, 1.0, "Rescale margins for identification.");
+DEFINE_int32(num_threads, 0, "Total number of threads shared by all the rooms (0 uses all the cores).");
+DEFINE_int32(num_concurrent_rooms, 0,
+             "Number of rooms processed at the same time (0 uses one per thread).");
+DEFINE_int32(memory_budget_mb, 0,
+             "Approximate memory for the working sets of the rooms being processed at once. "
+             "The input points of all the rooms are loaded beforehand and are not counted. "
+             "0 means no limit.");
 
 using namespace Eigen;
 using namespace structured_indoor_modeling;
@@ -54,19 +67,55 @@ void ReportSegments(const std::vector<int>& segments) {
 //       << " detail " << detail << endl;
 }
     
+// Rough upper bound of the working set per point while a room is
+// segmented: the points, the k-NN graph, segments, and search queues.
+const size_t kBytesPerPoint = sizeof(Point) + 256;
+
+// Admits rooms while their estimated working sets fit in the budget.
+// A room larger than the whole budget still runs, but alone.
+class MemoryBudget {
+ public:
+  MemoryBudget(const size_t budget) : budget(budget), in_use(0) {}
+
+  void Acquire(const size_t bytes) {
+    unique_lock<mutex> lock(budget_mutex);
+    released.wait(lock, [&]() {
+        return budget == 0 || in_use == 0 || in_use + bytes <= budget;
+      });
+    in_use += bytes;
+  }
+
+  void Release(const size_t bytes) {
+    {
+      lock_guard<mutex> lock(budget_mutex);
+      in_use -= bytes;
+    }
+    released.notify_all();
+  }
+
+ private:
+  const size_t budget;
+  size_t in_use;
+  mutex budget_mutex;
+  condition_variable released;
+};
+
+// room_points is the bucket of the room and is consumed. Random choices
+// are seeded by the room id, so results do not depend on the schedule.
 bool ProcessRoom(const FileIO& file_io,
                  const int room,
                  const Floorplan& floorplan,
                  const IndoorPolygon& indoor_polygon,
-                 const std::vector<PointCloud>& point_clouds,
-                 const std::vector<int>& room_occupancy) {
+                 const int num_threads,
+                 std::vector<Point>* room_points) {
 //  cout << "Room: " << room << endl;
   vector<Point> points;
-  CollectPointsInRoom(point_clouds, floorplan, room_occupancy, room, &points);
+  points.swap(*room_points);
   if (points.empty())
     return false;
+  mt19937 generator(room);
 //  cout << "Filtering... " << points.size() << " -> " << flush;
-  FilterNoisyPoints(&points);
+  FilterNoisyPoints(&points, num_threads);
 //  cout << points.size() << " done." << endl;
   
   if (points.empty())
@@ -74,7 +123,7 @@ bool ProcessRoom(const FileIO& file_io,
   
   if (FLAGS_point_subsampling_ratio != 1.0) {
 //    cout << "Subsampling... " << points.size() << " -> " << flush;
-    Subsample(FLAGS_point_subsampling_ratio, &points);
+    Subsample(FLAGS_point_subsampling_ratio, &generator, &points);
 //    cout << points.size() << " done." << endl;
     if (points.empty())
       return false;
@@ -92,17 +141,17 @@ bool ProcessRoom(const FileIO& file_io,
 //  ReportSegments(segments);
   
   // Compute neighbors.
-  vector<vector<int> > neighbors;
+  NeighborGraph neighbors;
   const int kNumNeighbors = 8;
 //  cout << "SetNeighbors..." << flush;
-  SetNeighbors(points, kNumNeighbors, &neighbors);
+  SetNeighbors(points, kNumNeighbors, num_threads, &neighbors);
 //  cout << "done." << endl;
 
   ReportSegments(segments);
 
 //  cout << "SegmentObjects..." << flush;
   SegmentObjects(points, FLAGS_centroid_subsampling_ratio, FLAGS_num_initial_clusters, neighbors,
-                 &segments);
+                 &generator, &segments);
 //  cout << "done." << endl;
   
   ReportSegments(segments);
@@ -125,6 +174,7 @@ bool ProcessRoom(const FileIO& file_io,
 //    printf("%s\n", file_io.GetObjectPointClouds(room).c_str());
     WriteObjectPointsWithColor(points, segments, file_io.GetObjectPointClouds(room),
                                floorplan.GetFloorplanToGlobal(),
+                               &generator,
                                &color_table);
 //    cout << "done." << endl;
   }
@@ -171,7 +221,6 @@ int main(int argc, char* argv[]) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
 #endif
 
-  clock_t totaltime = 0, start_t, end_t;
   FileIO file_io(argv[1]);
   
   Floorplan floorplan;
@@ -196,37 +245,73 @@ int main(int argc, char* argv[]) {
   SetDoorOccupancy(floorplan, &room_occupancy_with_doors);
   
   const int num_panoramas = GetNumPanoramas(file_io);
-  vector<PointCloud> point_clouds(num_panoramas);
+  const int num_rooms = floorplan.GetNumRooms();
+  const int num_threads = FLAGS_num_threads > 0 ? FLAGS_num_threads : GetDefaultNumThreads();
+  const int num_concurrent_rooms =
+    max(1, min(num_threads,
+               FLAGS_num_concurrent_rooms > 0 ? FLAGS_num_concurrent_rooms : num_threads));
+  const int num_threads_per_room = max(1, num_threads / num_concurrent_rooms);
 
-  start_t = clock();
+  const auto start_time = chrono::steady_clock::now();
 
+  // Read point clouds and distribute their points to room buckets. A
+  // cloud is released as soon as it is partitioned.
+  vector<vector<vector<Point> > > panorama_room_points(num_panoramas);
 //  cout << "Reading point clouds..." << flush;
-  for (int p = 0; p < num_panoramas; ++p) {
+  ParallelFor(0, num_panoramas, [&](const int p) {
 //    cout << '.' << flush;
-    const int index = p;
-    if (!point_clouds[index].Init(file_io, p)) {
+    PointCloud point_cloud;
+    if (!point_cloud.Init(file_io, p)) {
 //      cerr << "Failed in loading the point cloud." << endl;
       exit (1);
     }
     // Make the 3D coordinates into the floorplan coordinate system.
-    point_clouds[index].ToGlobal(file_io, p);
+    point_cloud.ToGlobal(file_io, p);
     const Matrix3d global_to_floorplan = floorplan.GetFloorplanToGlobal().transpose();
-    point_clouds[index].Rotate(global_to_floorplan);
+    point_cloud.Rotate(global_to_floorplan);
 
     const Vector3d global_center = GetCenter(file_io, p);
 
     RemoveWindowAndMirror(floorplan,
                           room_occupancy_with_doors,
                           global_to_floorplan * global_center,
-                          &point_clouds[index]);
-  }
+                          &point_cloud);
+
+    panorama_room_points[p].resize(num_rooms);
+    PartitionPointsByRoom(point_cloud, floorplan, room_occupancy, &panorama_room_points[p]);
+  }, num_threads);
 //  cout << "done." << endl;
 
-  // Per room processing.
-  for (int room = 0; room < floorplan.GetNumRooms(); ++room) {
-    ProcessRoom(file_io, room, floorplan, indoor_polygon, point_clouds, room_occupancy);
+  // Concatenate in panorama order, as CollectPointsInRoom does.
+  vector<vector<Point> > room_points(num_rooms);
+  for (int p = 0; p < num_panoramas; ++p) {
+    for (int room = 0; room < num_rooms; ++room) {
+      room_points[room].insert(room_points[room].end(),
+                               panorama_room_points[p][room].begin(),
+                               panorama_room_points[p][room].end());
+    }
+    vector<vector<Point> >().swap(panorama_room_points[p]);
   }
-  end_t = clock();
-  totaltime += end_t - start_t;
-  printf("Running time for object segmentation: %f\n", (float)(end_t - start_t) / CLOCKS_PER_SEC);
+
+  // Per room processing. Larger rooms start first to balance the load.
+  vector<int> room_order(num_rooms);
+  for (int room = 0; room < num_rooms; ++room)
+    room_order[room] = room;
+  stable_sort(room_order.begin(), room_order.end(), [&](const int lhs, const int rhs) {
+      return room_points[lhs].size() > room_points[rhs].size();
+    });
+
+  MemoryBudget memory_budget((size_t)max(0, FLAGS_memory_budget_mb) * 1024 * 1024);
+  ParallelFor(0, num_rooms, [&](const int i) {
+    const int room = room_order[i];
+    const size_t bytes = room_points[room].size() * kBytesPerPoint;
+    memory_budget.Acquire(bytes);
+    ProcessRoom(file_io, room, floorplan, indoor_polygon, num_threads_per_room,
+                &room_points[room]);
+    memory_budget.Release(bytes);
+  }, num_concurrent_rooms);
+
+  const double running_time =
+    chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+  printf("Running time for object segmentation: %f\n", running_time);
 }
@@ -91,6 +91,7 @@ void FindVisiblePanoramas(const std::vector<std::vector<Panorama> >& panoramas,
 
 void ReadPointClouds(const FileIO& file_io,
                      PointCloud* point_cloud) {
+  // One room is resident at a time. Appending only visits the new points.
   for (int room = 0; room < FLAGS_max_num_rooms; ++room) {
     PointCloud pc;
     if (pc.Init(file_io.GetObjectPointClouds(room))) {
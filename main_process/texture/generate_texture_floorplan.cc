@@ -901,6 +901,7 @@ void GenerateFloorTexture(const int room,
   synthesis_data.texture_size = floor_patch.texture_size;
   synthesis_data.patch_size   = max(kMinPatchSize, texture_input.patch_size_for_synthesis);
   synthesis_data.margin       = synthesis_data.patch_size / 6;
+  synthesis_data.search_stride = texture_input.patch_search_stride;
   synthesis_data.mask.resize(floor_patch.texture_size[0] * floor_patch.texture_size[1], false);
   int index = 0;
   for (int y = 0; y < floor_patch.texture_size[1]; ++y) {
@@ -909,11 +910,10 @@ void GenerateFloorTexture(const int room,
     }
   }
 
-  vector<cv::Mat> patches;
-  vector<Eigen::Vector2i> patch_positions;
+  vector<CandidatePatch> patches;
   const int kTimes = 3;
   for (int t = 0; t < kTimes; ++t) {
-    CollectCandidatePatches(synthesis_data, &patches, &patch_positions);
+    CollectCandidatePatches(synthesis_data, &patches);
     if (!patches.empty()) {
       break;
     }
@@ -940,7 +940,7 @@ void GenerateFloorTexture(const int room,
   }
 
   const bool kNoVerticalConstraint = false;
-  SynthesizePoisson(synthesis_data, patches, patch_positions, kNoVerticalConstraint, floor_texture);
+  SynthesizePoisson(synthesis_data, patches, kNoVerticalConstraint, floor_texture);
   
   cv::imshow("result", *floor_texture);
 }
@@ -964,16 +964,15 @@ void SynthesizePatch(Patch* patch) {
   weights.push_back(1.0);
   SynthesisData synthesis_data(projected_textures, weights);
 
-  synthesis_data.num_cg_iterations = 50;
+  synthesis_data.num_cg_iterations = 1000;
   synthesis_data.texture_size = patch->texture_size;
   synthesis_data.patch_size =
     min(80, min(patch->texture_size[0], patch->texture_size[1]));
   synthesis_data.margin = max(1, synthesis_data.patch_size / 4);
   synthesis_data.mask.resize(patch->texture_size[0] * patch->texture_size[1], true);
 
-  vector<cv::Mat> patches;
-  vector<Eigen::Vector2i> patch_positions;
-  CollectCandidatePatches(synthesis_data, &patches, &patch_positions);
+  vector<CandidatePatch> patches;
+  CollectCandidatePatches(synthesis_data, &patches);
   if (patches.empty())
     return;
   
@@ -982,7 +981,7 @@ void SynthesizePatch(Patch* patch) {
                               CV_8UC3,
                               cv::Scalar(0));
   const bool kVerticalConstraint = true;
-  SynthesizePoisson(synthesis_data, patches, patch_positions, kVerticalConstraint,
+  SynthesizePoisson(synthesis_data, patches, kVerticalConstraint,
                     &synthesized_texture);
   cv::imshow("result", synthesized_texture);
 
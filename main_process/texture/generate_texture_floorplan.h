@@ -59,6 +59,7 @@ struct TextureInput {
   double position_error_for_floor;
   int patch_size_for_synthesis;
   int num_cg_iterations;
+  int patch_search_stride;
 };
 
 void PackWallTextures(const std::vector<std::vector<Patch> >& wall_patches,
@@ -27,7 +27,8 @@ DEFINE_double(position_error_for_floor, 0.08, "How much error is allowed for a p
 // The following flags should be rescaled together. They are sensitive.
 DEFINE_int32(max_texture_size_per_floor_patch, 1500, "Maximum texture size for each floor patch.");
 DEFINE_int32(patch_size_for_synthesis, 45, "Patch size for synthesis.");
-DEFINE_int32(num_cg_iterations, 40, "Number of CG iterations.");
+DEFINE_int32(num_cg_iterations, 1000, "Safety cap on the CG iterations, used when the Poisson system cannot be factorized. CG stops on a tolerance, and a warning is printed if the cap is hit.");
+DEFINE_int32(patch_search_stride, 1, "Compare synthesis patches on every n-th pixel. 1 is exact, larger is faster.");
 
 using namespace Eigen;
 using namespace std;
@@ -72,6 +73,7 @@ int main(int argc, char* argv[]) {
     texture_input.position_error_for_floor = FLAGS_position_error_for_floor;
     texture_input.patch_size_for_synthesis = FLAGS_patch_size_for_synthesis;
     texture_input.num_cg_iterations        = FLAGS_num_cg_iterations;
+    texture_input.patch_search_stride      = max(1, FLAGS_patch_search_stride);
   }
   // Unit for a texel.
   // const double texel_size = ComputeTexelSize(panoramas) * FLAGS_texel_size_rescale;
@@ -2,6 +2,7 @@
 #include <fstream>
 #include "../../base/file_io.h"
 #include "../../base/panorama.h"
+#include "../../base/parallel.h"
 #include "../../base/imageProcess/morphological_operation.h"
 #include "generate_texture_indoor_polygon.h"
 #include "synthesize.h"
@@ -379,11 +380,13 @@ void SynthesizePatch(const int patch_size_for_synthesis,
 		     const std::vector<double>& weights,
                      const bool vertical_constraint,
                      const int num_patch_half_iterations,
+                     const int search_stride,
                      Patch* patch) {
   SynthesisData synthesis_data(projected_textures, weights);
+  synthesis_data.search_stride = search_stride;
   // This must be more than 4 for margin.
   const int kMinPatchSize = 4;
-  synthesis_data.num_cg_iterations = 50;
+  synthesis_data.num_cg_iterations = 1000;
   synthesis_data.texture_size = patch->texture_size;
   synthesis_data.patch_size =
     max(kMinPatchSize, min(80, min(patch_size_for_synthesis, min(patch->texture_size[0], patch->texture_size[1]))));
@@ -391,12 +394,10 @@ void SynthesizePatch(const int patch_size_for_synthesis,
   synthesis_data.margin = synthesis_data.patch_size / 4;
   synthesis_data.mask.resize(patch->texture_size[0] * patch->texture_size[1], true);
 
-  vector<cv::Mat> patches;
-  vector<Eigen::Vector2i> patch_positions;
+  vector<CandidatePatch> patches;
   for (int t = 0; t < num_patch_half_iterations; ++t) {
     patches.clear();
-    patch_positions.clear();
-    CollectCandidatePatches(synthesis_data, &patches, &patch_positions);
+    CollectCandidatePatches(synthesis_data, &patches);
     if (!patches.empty()) {
       break;
     }
@@ -421,7 +422,7 @@ void SynthesizePatch(const int patch_size_for_synthesis,
                                 patch->texture_size[0],
                                 CV_8UC3,
                                 cv::Scalar(0));
-    SynthesizePoisson(synthesis_data, patches, patch_positions, vertical_constraint,
+    SynthesizePoisson(synthesis_data, patches, vertical_constraint,
                       &synthesized_texture);
     cv::imshow("result", synthesized_texture);
     {
@@ -488,6 +489,53 @@ void ShrinkTexture(const int width,
   }
 }
   
+// Global coordinates of every texel in a patch, shared by all the
+// panoramas. Computed exactly as per texel ManhattanToGlobal calls.
+void ComputeTexelGlobals(const TextureInput& texture_input,
+                         const Patch& patch,
+                         std::vector<Eigen::Vector3d>* globals) {
+  const int width  = patch.texture_size[0];
+  const int height = patch.texture_size[1];
+  globals->resize(width * height);
+  ParallelFor(0, height, [&](const int y) {
+    Vector3d* row = &globals->at(y * width);
+    for (int x = 0; x < width; ++x) {
+      row[x] = texture_input.indoor_polygon.
+        ManhattanToGlobal(patch.UVToManhattan(patch.TextureToUV(Vector2d(x, y))));
+    }
+  });
+}
+
+// Projects one row of texels into a panorama. A texel is painted when
+// it is not behind the depthmap (by more than threshold).
+void ProjectTexelRow(const Panorama& panorama,
+                     const Panorama& panorama_for_depth,
+                     const double threshold,
+                     const Vector3d* globals,
+                     const int width,
+                     cv::Vec3b* texels) {
+  const int depth_width  = panorama_for_depth.DepthWidth();
+  const int depth_height = panorama_for_depth.DepthHeight();
+  const Vector3d& center = panorama_for_depth.GetCenter();
+  for (int x = 0; x < width; ++x) {
+    const Vector3d& global = globals[x];
+    // Project to the depth_mask.
+    const Vector2d pixel = panorama_for_depth.Project(global);
+    const Vector2d depth_pixel = panorama_for_depth.RGBToDepth(pixel);
+    const int depth_x = min(depth_width - 1, static_cast<int>(round(depth_pixel[0])));
+    const int depth_y = min(depth_height - 1, static_cast<int>(round(depth_pixel[1])));
+    const double depthmap_distance =
+      panorama_for_depth.GetDepth(Vector2d(depth_x, depth_y));
+    const double distance = (global - center).norm();
+    if (distance < depthmap_distance + threshold) {
+      const Vector2d pixel_for_rgb = panorama.Project(global);
+      const Vector3f rgb = panorama.GetRGB(pixel_for_rgb);
+      for (int i = 0; i < 3; ++i)
+        texels[x][i] = rgb[i];
+    }
+  }
+}
+
 void ComputeProjectedTextures(const TextureInput& texture_input,
                               const Patch& patch,
                               std::vector<cv::Mat>* projected_textures,
@@ -495,40 +543,29 @@ void ComputeProjectedTextures(const TextureInput& texture_input,
   const int kFirstLevel = 0;
   const int level = texture_input.pyramid_level;
   const double threshold = texture_input.visibility_margin * 2;
+
+  vector<Vector3d> globals;
+  ComputeTexelGlobals(texture_input, patch, &globals);
+
+  // Per panorama results, collected in the panorama order at the end.
+  const int num_panoramas = texture_input.panoramas.size();
+  vector<cv::Mat> panorama_textures(num_panoramas);
+  vector<double> panorama_weights(num_panoramas);
+  vector<char> non_hole_exists(num_panoramas, false);
   
-  for (int p = 0; p < texture_input.panoramas.size(); ++p) {
+  ParallelFor(0, num_panoramas, [&](const int p) {
     const Panorama& panorama = texture_input.panoramas[p][level];
     const Panorama& panorama_for_depth = texture_input.panoramas[p][kFirstLevel];
-    const int depth_width  = panorama_for_depth.DepthWidth();
-    const int depth_height = panorama_for_depth.DepthHeight();
 
     cv::Mat projected_texture(patch.texture_size[1],
                               patch.texture_size[0],
                               CV_8UC3,
                               cv::Scalar(0));
 
-    // For speed up.
     for (int y = 0; y < patch.texture_size[1]; ++y) {
-      for (int x = 0; x < patch.texture_size[0]; ++x) {
-        const Vector3d global =
-          texture_input.indoor_polygon.
-          ManhattanToGlobal(patch.UVToManhattan(patch.TextureToUV(Vector2d(x, y))));
-
-        // Project to the depth_mask.
-        const Vector2d pixel = panorama_for_depth.Project(global);
-        const Vector2d depth_pixel = panorama_for_depth.RGBToDepth(pixel);
-        const int depth_x = min(depth_width - 1, static_cast<int>(round(depth_pixel[0])));
-        const int depth_y = min(depth_height - 1, static_cast<int>(round(depth_pixel[1])));
-        const double depthmap_distance =
-          panorama_for_depth.GetDepth(Vector2d(depth_x, depth_y));
-        const double distance = (global - panorama_for_depth.GetCenter()).norm();
-        if (distance < depthmap_distance + threshold) {
-          const Vector2d pixel_for_rgb = panorama.Project(global);
-          Vector3f rgb = panorama.GetRGB(pixel_for_rgb);
-          for (int i = 0; i < 3; ++i)
-            projected_texture.at<cv::Vec3b>(y, x)[i] = rgb[i];
-        }
-      }
+      ProjectTexelRow(panorama, panorama_for_depth, threshold,
+                      &globals[y * patch.texture_size[0]], patch.texture_size[0],
+                      &projected_texture.at<cv::Vec3b>(y, 0));
     }
 
     if (texture_input.erode_texture) {
@@ -550,24 +587,26 @@ void ComputeProjectedTextures(const TextureInput& texture_input,
     }
 
     if (non_hole_exist) {
-      projected_textures->push_back(projected_texture);
+      non_hole_exists[p] = true;
+      panorama_textures[p] = projected_texture;
 
       // Compute the distance on the panorama image, along x and y axis of the patch.
-      const Vector3d global00 =
-          texture_input.indoor_polygon.
-	ManhattanToGlobal(patch.UVToManhattan(patch.TextureToUV(Vector2d(0, 0))));
-      const Vector3d global01 =
-	texture_input.indoor_polygon.
-	ManhattanToGlobal(patch.UVToManhattan(patch.TextureToUV(Vector2d(patch.texture_size[0] - 1, 0))));
-      const Vector3d global10 =
-	texture_input.indoor_polygon.
-	ManhattanToGlobal(patch.UVToManhattan(patch.TextureToUV(Vector2d(0, patch.texture_size[1] - 1))));
+      const Vector3d& global00 = globals[0];
+      const Vector3d& global01 = globals[patch.texture_size[0] - 1];
+      const Vector3d& global10 = globals[(patch.texture_size[1] - 1) * patch.texture_size[0]];
 
       const Vector2d pixel00 = panorama_for_depth.Project(global00);
       const Vector2d pixel01 = panorama_for_depth.Project(global01);
       const Vector2d pixel10 = panorama_for_depth.Project(global10);
       
-      weights->push_back(min((pixel00 - pixel01).norm(), (pixel00 - pixel10).norm()));
+      panorama_weights[p] = min((pixel00 - pixel01).norm(), (pixel00 - pixel10).norm());
+    }
+  });
+
+  for (int p = 0; p < num_panoramas; ++p) {
+    if (non_hole_exists[p]) {
+      projected_textures->push_back(panorama_textures[p]);
+      weights->push_back(panorama_weights[p]);
     }
   }
 }
@@ -676,7 +715,7 @@ void SetPatch(const TextureInput& texture_input,
       }
     } else {
       const bool kNoVerticalConstraint = false;     
-      SynthesizePatch(texture_input.patch_size_for_synthesis, projected_textures, weights, kNoVerticalConstraint, texture_input.num_patch_half_iterations, patch);
+      SynthesizePatch(texture_input.patch_size_for_synthesis, projected_textures, weights, kNoVerticalConstraint, texture_input.num_patch_half_iterations, texture_input.patch_search_stride, patch);
     }    
   } else {
     // Pick the best one and inpaint.
@@ -717,7 +756,7 @@ void SetPatch(const TextureInput& texture_input,
       projected_textures_empty.push_back(projected_texture);
       weights.push_back(1.0);
       
-      SynthesizePatch(texture_input.patch_size_for_synthesis, projected_textures_empty, weights, kVerticalConstraint, texture_input.num_patch_half_iterations, patch);
+      SynthesizePatch(texture_input.patch_size_for_synthesis, projected_textures_empty, weights, kVerticalConstraint, texture_input.num_patch_half_iterations, texture_input.patch_search_stride, patch);
     }
   }  
 }
@@ -45,6 +45,7 @@ struct TextureInput {
   double position_error_for_floor;
   double patch_size_for_synthesis;
   int num_cg_iterations;
+  int patch_search_stride;
 
   double texel_unit;
   double visibility_margin;
@@ -7,6 +7,7 @@
 #include "../../base/floorplan.h"
 #include "../../base/panorama.h"
 #include "../../base/file_io.h"
+#include "../../base/parallel.h"
 
 #include <opencv2/opencv.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -36,15 +37,13 @@ void Init(const string& data_directory, const int start_panorama, Input *input)
   input->data_directory = data_directory;
 
   const FileIO file_io(data_directory);
-  for (int p = start_panorama; ; ++p) {
-    Panorama panorama;
-    if (!panorama.Init(file_io, p))
-      break;
-    
+  const int num_panoramas = max(0, GetNumPanoramas(file_io) - start_panorama);
+  input->panoramas.resize(num_panoramas);
+  ParallelFor(0, num_panoramas, [&](const int p) {
+    Panorama& panorama = input->panoramas[p];
+    panorama.Init(file_io, start_panorama + p);
     panorama.Resize(Vector2i(input->panorama_width, input->panorama_height));
-
-    input->panoramas.push_back(panorama);
-  }
+  });
 
   {
     ifstream ifstr;
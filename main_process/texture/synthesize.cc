@@ -9,40 +9,152 @@ namespace structured_indoor_modeling {
 
 namespace {
 
-double AverageAbsoluteDifference(const cv::Mat& texture,
-                                 const cv::Mat& patch,
-                                 const Eigen::Vector2i& x_range,
-                                 const Eigen::Vector2i& y_range,
-                                 const double current_threshold) {
+// Pixels of the texture being synthesized that candidates are compared
+// against, sampled every stride pixels. mask is 0xFF for each channel
+// of a non-hole pixel and 0 otherwise.
+struct TargetWindow {
+  int width;
+  int height;
+  int stride;
+  std::vector<unsigned char> rgb;
+  std::vector<unsigned char> mask;
+  std::vector<int> num_valids;
+};
+
+void SetTargetWindow(const cv::Mat& texture,
+                     const Eigen::Vector2i& x_range,
+                     const Eigen::Vector2i& y_range,
+                     const int stride,
+                     TargetWindow* window) {
   const cv::Vec3b kHole(0, 0, 0);
   const int kNumChannels = 3;
-  double sum = 0;
-  int denom = 0;
+  window->stride = stride;
+  window->width  = (x_range[1] - x_range[0] + stride - 1) / stride;
+  window->height = (y_range[1] - y_range[0] + stride - 1) / stride;
+  window->rgb.resize(kNumChannels * window->width * window->height);
+  window->mask.resize(kNumChannels * window->width * window->height);
+  window->num_valids.assign(window->height, 0);
 
-  const double kLarge = 10000.0;
+  int index = 0;
+  for (int j = 0; j < window->height; ++j) {
+    const int y = y_range[0] + j * stride;
+    for (int i = 0; i < window->width; ++i, ++index) {
+      const cv::Vec3b& rgb = texture.at<cv::Vec3b>(y, x_range[0] + i * stride);
+      const unsigned char mask = (rgb == kHole) ? 0 : 0xFF;
+      if (mask)
+        ++window->num_valids[j];
+      for (int c = 0; c < kNumChannels; ++c) {
+        window->rgb[kNumChannels * index + c]  = rgb[c];
+        window->mask[kNumChannels * index + c] = mask;
+      }
+    }
+  }
+}
 
-  for (int y = y_range[0]; y < y_range[1]; ++y) {
-    for (int x = x_range[0]; x < x_range[1]; ++x) {
-      if (texture.at<cv::Vec3b>(y, x) == kHole)
-        continue;
+// Sum of absolute differences over one row, holes excluded. The
+// contiguous case is a plain byte loop that compilers vectorize.
+int RowAbsoluteDifference(const unsigned char* target,
+                          const unsigned char* mask,
+                          const unsigned char* candidate,
+                          const int width,
+                          const int stride) {
+  const int kNumChannels = 3;
+  int sum = 0;
+  if (stride == 1) {
+    for (int i = 0; i < kNumChannels * width; ++i)
+      sum += abs((int)target[i] - (int)candidate[i]) & mask[i];
+  } else {
+    for (int i = 0; i < width; ++i) {
+      for (int c = 0; c < kNumChannels; ++c) {
+        const int index = kNumChannels * i + c;
+        sum += abs((int)target[index] - (int)candidate[kNumChannels * i * stride + c]) &
+          mask[index];
+      }
+    }
+  }
+  return sum;
+}
 
-      for (int c = 0; c < kNumChannels; ++c) 
-        sum += abs(((int)texture.at<cv::Vec3b>(y, x)[c]) -
-                   ((int)patch.at<cv::Vec3b>(y - y_range[0], x - x_range[0])[c]));
-      denom += kNumChannels;
+// Average absolute difference between the target window and a
+// candidate. Gives up with a large value as soon as the running average
+// exceeds current_threshold (after more than 10 pixels). Whole rows are
+// summed first; a row is rescanned pixel by pixel only if the running
+// average could cross the threshold inside it.
+double AverageAbsoluteDifference(const TargetWindow& window,
+                                 const cv::Mat& texture,
+                                 const Eigen::Vector2i& position,
+                                 const double current_threshold) {
+  const int kNumChannels = 3;
+  const int kMinDenom = 30;
+  const double kLarge = 10000.0;
+  int sum = 0;
+  int denom = 0;
 
-      // Threshold check.
-      if (denom > 30 && current_threshold * denom < sum)
-        return kLarge;
+  for (int j = 0; j < window.height; ++j) {
+    if (window.num_valids[j] == 0)
+      continue;
+    const int offset = kNumChannels * window.width * j;
+    const unsigned char* target = &window.rgb[offset];
+    const unsigned char* mask   = &window.mask[offset];
+    const unsigned char* candidate =
+      texture.ptr<unsigned char>(position[1] + j * window.stride) + kNumChannels * position[0];
+
+    const int row_sum   = RowAbsoluteDifference(target, mask, candidate, window.width, window.stride);
+    const int row_denom = kNumChannels * window.num_valids[j];
+    const int min_denom = max(denom + kNumChannels, kMinDenom + kNumChannels);
+    if (denom + row_denom > kMinDenom && current_threshold * min_denom < sum + row_sum) {
+      for (int i = 0; i < window.width; ++i) {
+        if (!mask[kNumChannels * i])
+          continue;
+        for (int c = 0; c < kNumChannels; ++c) {
+          sum += abs((int)target[kNumChannels * i + c] -
+                     (int)candidate[kNumChannels * i * window.stride + c]);
+        }
+        denom += kNumChannels;
+        // Threshold check.
+        if (denom > kMinDenom && current_threshold * denom < sum)
+          return kLarge;
+      }
+    } else {
+      sum   += row_sum;
+      denom += row_denom;
     }
   }
 
   if (denom == 0) {
+    if (window.stride != 1)
+      return kLarge;
     cerr << "Impossible in AAD" << endl;
     exit (1);
   }
 
-  return sum / denom;
+  return sum / (double)denom;
+}
+
+// Counts of a binary image over rectangles in constant time.
+void SetIntegralImage(const int width,
+                      const int height,
+                      const std::vector<bool>& binary,
+                      std::vector<int>* integral) {
+  integral->assign((width + 1) * (height + 1), 0);
+  for (int y = 0; y < height; ++y) {
+    int row_count = 0;
+    for (int x = 0; x < width; ++x) {
+      row_count += binary[y * width + x] ? 1 : 0;
+      integral->at((y + 1) * (width + 1) + x + 1) =
+        integral->at(y * (width + 1) + x + 1) + row_count;
+    }
+  }
+}
+
+int CountInRectangle(const int width,
+                     const std::vector<int>& integral,
+                     const int x, const int y, const int size) {
+  return
+    integral[(y + size) * (width + 1) + x + size] -
+    integral[y * (width + 1) + x + size] -
+    integral[(y + size) * (width + 1) + x] +
+    integral[y * (width + 1) + x];
 }
 
 void CopyPatch(const std::vector<bool>& mask,
@@ -195,224 +307,58 @@ void SetDataForBlending(const int width,
   }
 }
 
-void PoissonBlendSub(const SynthesisData& synthesis_data,
-                     const vector<vector<Vector3d> >& laplacians,
-                     const vector<vector<Vector3d> >& values,
-                     const vector<Vector3d>& average_laplacian,
-                     const vector<Vector2i>& indexes,
-                     map<pair<int, int>, int>& inverse_indexes,
-                     const int channel,
-                     cv::Mat* floor_texture) {
+// Weight of a data term relative to the Laplacian in Poisson blending.
+const double kPoissonDataWeight = 2.0;
+
+// The blending system is the same for all the channels: a Laplacian
+// over the masked pixels plus data terms where a single value is given.
+// A is assembled column by column directly in compressed form. Every
+// column is filled in increasing row order.
+void SetPoissonSystem(const SynthesisData& synthesis_data,
+                      const vector<vector<Vector3d> >& values,
+                      const vector<Vector2i>& indexes,
+                      const vector<int>& inverse_indexes,
+                      SparseMatrix<double>* A) {
   const int width      = synthesis_data.texture_size[0];
   const int height     = synthesis_data.texture_size[1];
+  const int kMaxEntriesPerColumn = 5;
 
-  vector<Eigen::SparseVector<double> > A;
-  vector<double> b;
-  // Values constraints.
-  int index = 0;
-  int value_count = 0;
-  vector<bool> constraints(indexes.size(), false);
-  for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x, ++index) {
-      // Add a constraint, only when a single value is specified.
-      if (values[index].size() != 1)
-        continue;
-      ++value_count;
-      const int variable_index = inverse_indexes[make_pair(x, y)];
-      Eigen::SparseVector<double> a(indexes.size());
-      a.coeffRef(variable_index) = 1.0;
-      constraints[variable_index] = true;
-      A.push_back(a);
-      b.push_back(values[index][0][channel]);
-    }
-  }
-  
-  // Laplacian constraints.
-  int laplacian_count = 0;
-  for (int y = 1; y < height - 1; ++y) {
-    for (int x = 1; x < width - 1; ++x) {
-      const int index = y * width + x;
-      if (laplacians[index].empty())
-        continue;
-      Eigen::SparseVector<double> a(indexes.size());
-      int count = 0;
-      vector<Vector2i> neighbors;
-      neighbors.push_back(Vector2i(x - 1, y));
-      neighbors.push_back(Vector2i(x + 1, y));
-      neighbors.push_back(Vector2i(x, y - 1));
-      neighbors.push_back(Vector2i(x, y + 1));
-      for (const auto neighbor : neighbors) {
-        const int index = neighbor[1] * width + neighbor[0];
-        if (synthesis_data.mask[index]) {
-          if (inverse_indexes.find(pair<int, int>(neighbor[0], neighbor[1])) ==
-              inverse_indexes.end()) {
-            cout << "w1" << endl;
-            exit (1);
-          }
-          const int variable_index = inverse_indexes[pair<int, int>(neighbor[0], neighbor[1])];
-          a.coeffRef(variable_index) = -1;
-          constraints[variable_index] = true;
-          ++count;
-        }
-      }
-      {
-        if (inverse_indexes.find(pair<int, int>(x, y)) == inverse_indexes.end()){
-          cout << "w5" << endl;
-          exit (1);
-        }
-        const int variable_index = inverse_indexes[pair<int, int>(x, y)];
-        a.coeffRef(variable_index) = count;
-        constraints[variable_index] = true;
-      }
-      if (count != 0) {
-        A.push_back(a);
-        b.push_back(average_laplacian[index][channel]);
-      }
-    }
-  }  
-  
-  // If no constraint, add value constraints.
-  /*
-  int no_constraint_count = 0;
+  A->resize(indexes.size(), indexes.size());
+  A->reserve(VectorXi::Constant(indexes.size(), kMaxEntriesPerColumn));
   for (int v = 0; v < (int)indexes.size(); ++v) {
-    if (constraints[v])
-      continue;
-    ++no_constraint_count;
-    
-    const int index = indexes[v][1] * width + indexes[v][0];
-    if (values[index].empty()) {
-      cerr << "Impossible here." << endl;
-      exit (1);
-    }
-    double average = 0.0;
-    for (const auto& value : values[index])
-      average += value[channel];
-    average /= values[index].size();
-    
-    Eigen::SparseVector<double> a(indexes.size());
-    a.coeffRef(v) = 1.0;
-    A.push_back(a);
-    b.push_back(average);
-  }
-  */  
-
-  vector<Eigen::Triplet<double> > triplets;
-  for (int y = 0; y < A.size(); ++y) {
-    for (SparseVector<double>::InnerIterator it(A[y]); it; ++it)
-      triplets.push_back(Eigen::Triplet<double>(y, it.index(), it.value()));
-  }
-  
-  Eigen::SparseMatrix<double> A2(A.size(), indexes.size());
-  A2.setFromTriplets(triplets.begin(), triplets.end());
-  
-  Eigen::VectorXd b2(b.size());
-  for (int i = 0; i < (int)b.size(); ++i)
-    b2[i] = b[i];
-  
-  Eigen::SparseMatrix<double> ATA = A2.transpose() * A2;
-  Eigen::VectorXd ATb = A2.transpose() * b2;
-  
-  ConjugateGradient<SparseMatrix<double> > cg;
-  cg.setMaxIterations(synthesis_data.num_cg_iterations);
-  cg.compute(ATA);
-  cerr << "CG solve..." << flush;
-
-  Eigen::VectorXd x0(indexes.size());
-  for (int v = 0; v < indexes.size(); ++v)
-    x0[v] = floor_texture->at<cv::Vec3b>(indexes[v][1], indexes[v][0])[channel];
-        
-  VectorXd x = cg.solveWithGuess(ATb, x0);
-  cerr << "done. " << flush;
-  for (int v = 0; v < (int)indexes.size(); ++v) {
-    floor_texture->at<cv::Vec3b>(indexes[v][1], indexes[v][0])[channel] = 
-      static_cast<unsigned char>(max(0.0, min(255.0, x[v])));
-  }  
-}    
-
-void PoissonBlendSubNew(const SynthesisData& synthesis_data,
-                        const vector<vector<Vector3d> >& laplacians,
-                        const vector<vector<Vector3d> >& values,
-                        const vector<Vector3d>& average_laplacian,
-                        const vector<Vector2i>& indexes,
-                        map<pair<int, int>, int>& inverse_indexes,
-                        const int channel,
-                        cv::Mat* floor_texture) {
-  const int width      = synthesis_data.texture_size[0];
-  const int height     = synthesis_data.texture_size[1];
-
-  SparseMatrix<double> A(indexes.size(), indexes.size());
-  VectorXd b(indexes.size());
-
-  vector<Eigen::Triplet<double> > triplets;
-
-  // Laplacian constraints.
-  for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      const int index = y * width + x;
-      if (!synthesis_data.mask[index])
-        continue;
-
-      const int ref_variable_index = inverse_indexes[pair<int, int>(x, y)];
-      
-      int count = 0;
-      vector<Vector2i> neighbors;
-      if (x != 0)
-        neighbors.push_back(Vector2i(x - 1, y));
-      if (x != width - 1)
-        neighbors.push_back(Vector2i(x + 1, y));
-      if (y != 0)
-        neighbors.push_back(Vector2i(x, y - 1));
-      if (y != height - 1)
-        neighbors.push_back(Vector2i(x, y + 1));
-
-      for (const auto neighbor : neighbors) {
-        const int index = neighbor[1] * width + neighbor[0];
-        if (synthesis_data.mask[index]) {
-          if (inverse_indexes.find(pair<int, int>(neighbor[0], neighbor[1])) ==
-              inverse_indexes.end()) {
-            cout << "w1" << endl;
-            exit (1);
-          }
-          const int variable_index = inverse_indexes[pair<int, int>(neighbor[0], neighbor[1])];
-          triplets.push_back(Triplet<double>(ref_variable_index, variable_index, -1));
-          ++count;
-        }
-      }
-      if (count != 0) {
-        if (inverse_indexes.find(pair<int, int>(x, y)) == inverse_indexes.end()){
-          cout << "w5" << endl;
-          exit (1);
-        }
-        triplets.push_back(Triplet<double>(ref_variable_index, ref_variable_index, count));
-      }
+    const int x = indexes[v][0];
+    const int y = indexes[v][1];
+    const int index = y * width + x;
 
-      b[ref_variable_index] = average_laplacian[index][channel];      
+    // Neighbors in the increasing order of variables.
+    const int kNoNeighbor = -1;
+    const int neighbors[4] = { y != 0          ? inverse_indexes[index - width] : kNoNeighbor,
+                               x != 0          ? inverse_indexes[index - 1]     : kNoNeighbor,
+                               x != width - 1  ? inverse_indexes[index + 1]     : kNoNeighbor,
+                               y != height - 1 ? inverse_indexes[index + width] : kNoNeighbor };
+    int count = 0;
+    for (const auto neighbor : neighbors) {
+      if (neighbor != kNoNeighbor)
+        ++count;
     }
-  }  
-  
-  A.setFromTriplets(triplets.begin(), triplets.end());
+    double diagonal = count;
+    if (values[index].size() == 1)
+      diagonal += kPoissonDataWeight;
 
-  // Data terms.
-  const double kDataWeight = 2.0;
-  for (int i = 0; i < indexes.size(); ++i) {
-    const int x = indexes[i][0];
-    const int y = indexes[i][1];
-    const int index = y * width + x;
-    if (values[index].size() != 1)
-        continue;
-    A.coeffRef(i, i) += kDataWeight;
-    b[i] += kDataWeight * values[index][0][channel];
+    for (int n = 0; n < 2; ++n) {
+      if (neighbors[n] != kNoNeighbor)
+        A->insert(neighbors[n], v) = -1.0;
+    }
+    if (diagonal != 0.0)
+      A->insert(v, v) = diagonal;
+    for (int n = 2; n < 4; ++n) {
+      if (neighbors[n] != kNoNeighbor)
+        A->insert(neighbors[n], v) = -1.0;
+    }
   }
-  
-  SimplicialCholesky<SparseMatrix<double> > chol(A);
-  VectorXd x = chol.solve(b);
+  A->makeCompressed();
+}
 
-  for (int v = 0; v < (int)indexes.size(); ++v) {
-    floor_texture->at<cv::Vec3b>(indexes[v][1], indexes[v][0])[channel] = 
-      static_cast<unsigned char>(max(0.0, min(255.0, x[v])));
-  }  
-}    
-  
 void PoissonBlend(const SynthesisData& synthesis_data,
                   const vector<vector<Vector3d> >& laplacians,
                   const vector<vector<Vector3d> >& values,
@@ -432,24 +378,67 @@ void PoissonBlend(const SynthesisData& synthesis_data,
     }
   }
   // variable to index.
+  const int kInvalid = -1;
   vector<Vector2i> indexes;
-  map<pair<int, int>, int> inverse_indexes;
+  vector<int> inverse_indexes(width * height, kInvalid);
   index = 0;
   for (int y = 0; y < height; ++y) {
     for (int x = 0; x < width; ++x, ++index) {
       if (synthesis_data.mask[index]) {
-        inverse_indexes[make_pair(x, y)] = indexes.size();
+        inverse_indexes[index] = indexes.size();
         indexes.push_back(Vector2i(x, y));
       }
     }
   }
-  
-  // For each channel.
+  if (indexes.empty()) {
+    cerr << " nothing to blend." << endl;
+    return;
+  }
+
+  SparseMatrix<double> A;
+  SetPoissonSystem(synthesis_data, values, indexes, inverse_indexes, &A);
+
+  // All the channels are solved at once as columns of b.
   const int kNumChannels = 3;
-  for (int c = 0; c < kNumChannels; ++c) {
-    PoissonBlendSubNew(synthesis_data, laplacians, values, average_laplacian,
-                       indexes, inverse_indexes, c, floor_texture);
+  MatrixXd b(indexes.size(), kNumChannels);
+  MatrixXd x0(indexes.size(), kNumChannels);
+  for (int v = 0; v < (int)indexes.size(); ++v) {
+    const int index = indexes[v][1] * width + indexes[v][0];
+    const cv::Vec3b& color = floor_texture->at<cv::Vec3b>(indexes[v][1], indexes[v][0]);
+    // The target Laplacian, plus the data term where a single value is given.
+    for (int c = 0; c < kNumChannels; ++c) {
+      b(v, c) = average_laplacian[index][c];
+      if (values[index].size() == 1)
+        b(v, c) += kPoissonDataWeight * values[index][0][c];
+      x0(v, c) = color[c];
+    }
+  }
+
+  // A is factorized once. If a component of masked pixels has neither
+  // data nor neighbors, A is singular and CG, warm-started from the
+  // current texture, is used instead. CG stops on the tolerance, and
+  // num_cg_iterations is only a safety cap.
+  MatrixXd x;
+  SimplicialLDLT<SparseMatrix<double> > ldlt(A);
+  if (ldlt.info() == Success) {
+    x = ldlt.solve(b);
+  } else {
+    const double kTolerance = 1e-4;
+    ConjugateGradient<SparseMatrix<double> > cg;
+    cg.setTolerance(kTolerance);
+    cg.setMaxIterations(synthesis_data.num_cg_iterations);
+    cg.compute(A);
+    cerr << "CG solve..." << flush;
+    x = cg.solveWithGuess(b, x0);
+    if (cg.iterations() >= synthesis_data.num_cg_iterations)
+      cerr << " CG stopped at the cap of " << synthesis_data.num_cg_iterations
+           << " iterations with error " << cg.error() << "..." << flush;
+  }
 
+  for (int v = 0; v < (int)indexes.size(); ++v) {
+    cv::Vec3b& color = floor_texture->at<cv::Vec3b>(indexes[v][1], indexes[v][0]);
+    for (int c = 0; c < kNumChannels; ++c)
+      color[c] = static_cast<unsigned char>(max(0.0, min(255.0, x(v, c))));
   }
   cerr << " all done." << endl;
 }
@@ -601,51 +590,55 @@ void InitializeTexture(const SynthesisData& synthesis_data, cv::Mat* floor_textu
 }  // namespace
 
 void CollectCandidatePatches(const SynthesisData& synthesis_data,
-                             std::vector<cv::Mat>* patches,
-                             std::vector<Eigen::Vector2i>* patch_positions) {
+                             std::vector<CandidatePatch>* patches) {
   const std::vector<bool>& mask = synthesis_data.mask;
   const Eigen::Vector2i& texture_size = synthesis_data.texture_size;
   const int patch_size = synthesis_data.patch_size;
-  
-  for (int y = 0; y < texture_size[1] - patch_size; ++y) {
-    for (int x = 0; x < texture_size[0] - patch_size; ++x) {
-      // Checks if the patch at (x, y) is in a mask.
-      bool fail = false;
-      for (int j = 0; j < patch_size; ++j) {
-        if (fail)
-          break;
-        const int ytmp = y + j;
-        for (int i = 0; i < patch_size; ++i) {
-          const int xtmp = x + i;
-          if (!mask[ytmp * texture_size[0] + xtmp]) {
-            fail = true;
-            break;
-          }
+  const int width  = texture_size[0];
+  const int height = texture_size[1];
+  const int num_textures = synthesis_data.projected_textures.size();
+  if (width - patch_size <= 0 || height - patch_size <= 0)
+    return;
+
+  // Positions whose window has no hole, per projected texture.
+  vector<vector<bool> > valid_positions(num_textures);
+  {
+    vector<int> integral;
+    vector<bool> holes(width * height);
+    for (int y = 0; y < height; ++y)
+      for (int x = 0; x < width; ++x)
+        holes[y * width + x] = !mask[y * width + x];
+    SetIntegralImage(width, height, holes, &integral);
+    vector<bool> in_mask(width * height, false);
+    for (int y = 0; y < height - patch_size; ++y)
+      for (int x = 0; x < width - patch_size; ++x)
+        in_mask[y * width + x] = CountInRectangle(width, integral, x, y, patch_size) == 0;
+
+    for (int t = 0; t < num_textures; ++t) {
+      const cv::Mat& projected_texture = synthesis_data.projected_textures[t];
+      for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+          holes[y * width + x] = projected_texture.at<cv::Vec3b>(y, x) == cv::Vec3b(0, 0, 0);
+      SetIntegralImage(width, height, holes, &integral);
+      valid_positions[t].resize(width * height, false);
+      for (int y = 0; y < height - patch_size; ++y) {
+        for (int x = 0; x < width - patch_size; ++x) {
+          const int index = y * width + x;
+          valid_positions[t][index] =
+            in_mask[index] && CountInRectangle(width, integral, x, y, patch_size) == 0;
         }
       }
-      if (fail)
-        continue;
+    }
+  }
 
-      for (const auto& projected_texture : synthesis_data.projected_textures) {
-        cv::Mat patch(patch_size, patch_size, CV_8UC3);
-        bool fail_texture = false;
-        for (int j = 0; j < patch_size; ++j) {
-          if (fail_texture)
-            break;
-          const int ytmp = y + j;
-          for (int i = 0; i < patch_size; ++i) {
-            const int xtmp = x + i;
-            const cv::Vec3b rgb = projected_texture.at<cv::Vec3b>(ytmp, xtmp);
-            if (rgb == cv::Vec3b(0, 0, 0)) {
-              fail_texture = true;
-              break;
-            }
-            patch.at<cv::Vec3b>(j, i) = rgb;
-          }
-        }
-        if (!fail_texture) {
+  for (int y = 0; y < height - patch_size; ++y) {
+    for (int x = 0; x < width - patch_size; ++x) {
+      for (int t = 0; t < num_textures; ++t) {
+        if (valid_positions[t][y * width + x]) {
+          CandidatePatch patch;
+          patch.texture = t;
+          patch.position = Vector2i(x, y);
           patches->push_back(patch);
-          patch_positions->push_back(Vector2i(x, y));
         }
       }
     }
@@ -653,8 +646,7 @@ void CollectCandidatePatches(const SynthesisData& synthesis_data,
 }
 
 void SynthesizePoisson(const SynthesisData& synthesis_data,
-                       const std::vector<cv::Mat>& patches,
-                       const std::vector<Eigen::Vector2i>& patch_positions,
+                       const std::vector<CandidatePatch>& patches,
                        const bool vertical_constraint,
                        cv::Mat* texture) {
   // First identify the projected texture with the most area.
@@ -694,6 +686,7 @@ void SynthesizePoisson(const SynthesisData& synthesis_data,
   vector<vector<Vector3d> > values(width * height);
 
   cerr << "stitch " << flush;
+  TargetWindow window;
   set<pair<int, int> > visited_grids;
   while (true) {
     // Find a grid position with the most constraints.
@@ -733,6 +726,13 @@ void SynthesizePoisson(const SynthesisData& synthesis_data,
         }
       }
     } else {
+      SetTargetWindow(*texture, x_range, y_range, synthesis_data.search_stride, &window);
+      const auto residual = [&](const int p, const double threshold) {
+        return AverageAbsoluteDifference(window,
+                                         synthesis_data.projected_textures[patches[p].texture],
+                                         patches[p].position,
+                                         threshold);
+      };
       vector<double> residuals(patches.size(), 0);
       const double kLarge = 10000.0;
       double current_min = kLarge;
@@ -740,10 +740,9 @@ void SynthesizePoisson(const SynthesisData& synthesis_data,
       if (vertical_constraint) {
         // First search along vertical.
         bool found = false;
-        for (int p = 0; p < patch_positions.size(); ++p) {
-          if (patch_positions[p][0] == min_x) {
-            residuals[p] = AverageAbsoluteDifference(*texture, patches[p], x_range, y_range,
-                                                     current_min * kMarginResidualScale);
+        for (int p = 0; p < patches.size(); ++p) {
+          if (patches[p].position[0] == min_x) {
+            residuals[p] = residual(p, current_min * kMarginResidualScale);
             current_min = min(current_min, residuals[p]);
             found = true;
           } else {
@@ -752,8 +751,7 @@ void SynthesizePoisson(const SynthesisData& synthesis_data,
         }
         if (!found) {
           for (int p = 0; p < patches.size(); ++p) {
-            residuals[p] = AverageAbsoluteDifference(*texture, patches[p], x_range, y_range,
-                                                     current_min * kMarginResidualScale);
+            residuals[p] = residual(p, current_min * kMarginResidualScale);
             current_min = min(current_min, residuals[p]);
           }
         }          
@@ -765,8 +763,7 @@ void SynthesizePoisson(const SynthesisData& synthesis_data,
         }
       } else {
         for (int p = 0; p < patches.size(); ++p) {
-          residuals[p] = AverageAbsoluteDifference(*texture, patches[p], x_range, y_range,
-                                                   current_min * kMarginResidualScale);
+          residuals[p] = residual(p, current_min * kMarginResidualScale);
           current_min = min(current_min, residuals[p]);
         }
         
@@ -781,7 +778,12 @@ void SynthesizePoisson(const SynthesisData& synthesis_data,
       // << min_residual << ' ' << threshold;
       const int patch_id = candidates[rand() % candidates.size()];
       // cerr << "  patch: " << patch_id << endl;
-      patch_with_initial_texture = patches[patch_id];
+      const CandidatePatch& patch = patches[patch_id];
+      patch_with_initial_texture =
+        synthesis_data.projected_textures[patch.texture](cv::Rect(patch.position[0],
+                                                                  patch.position[1],
+                                                                  patch_size,
+                                                                  patch_size)).clone();
       // overwrite with texture and initial_mask.
       for (int y = y_range[0]; y < y_range[1]; ++y) {
         for (int x = x_range[0]; x < x_range[1]; ++x) {
@@ -10,26 +10,36 @@ namespace structured_indoor_modeling {
 struct SynthesisData {
 SynthesisData(const std::vector<cv::Mat>& projected_textures,
 	      const std::vector<double>& weights) :
-  projected_textures(projected_textures), weights(weights) {
+  projected_textures(projected_textures), weights(weights), search_stride(1) {
   }
   
   const std::vector<cv::Mat>& projected_textures;
   const std::vector<double>& weights;
   
+  // Safety cap on the CG fallback of Poisson blending, which stops on
+  // a tolerance.
   int num_cg_iterations;
   Eigen::Vector2i texture_size;
   int patch_size;
   int margin;
   std::vector<bool> mask;
+  // Candidates are compared on every search_stride-th row and column.
+  // 1 is an exact search. Larger values are faster but approximate.
+  int search_stride;
+};
+
+// A hole-free patch_size x patch_size window of a projected texture.
+// Pixels are read from the texture, not copied.
+struct CandidatePatch {
+  int texture;
+  Eigen::Vector2i position;
 };
 
 void CollectCandidatePatches(const SynthesisData& synthesis_data,
-                             std::vector<cv::Mat>* patches,
-                             std::vector<Eigen::Vector2i>* patch_positions);
+                             std::vector<CandidatePatch>* patches);
 
 void SynthesizePoisson(const SynthesisData& synthesis_data,
-                       const std::vector<cv::Mat>& patches,
-                       const std::vector<Eigen::Vector2i>& patch_positions,
+                       const std::vector<CandidatePatch>& patches,
                        const bool vertical_constraint,
                        cv::Mat* floor_texture);
  
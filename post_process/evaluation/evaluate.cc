@@ -1,12 +1,14 @@
+#include <cmath>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
-#include <list>
 #include <map>
 #include "evaluate.h"
 #include "../../base/file_io.h"
 #include "../../base/floorplan.h"
 #include "../../base/indoor_polygon.h"
 #include "../../base/panorama.h"
+#include "../../base/parallel.h"
 #include "../../base/point_cloud.h"
 
 using namespace Eigen;
@@ -14,10 +16,6 @@ using namespace std;
 
 namespace structured_indoor_modeling {
 
-struct Triple {
-  Eigen::Vector3d points[3];
-};
-  
 namespace {
 
 double ComputeUnit(const Panorama& panorama,
@@ -51,26 +49,190 @@ void PaintPoint(const Panorama& panorama,
   }
 }
 
-double UVDistance(const Eigen::Vector2d& lhs, const Eigen::Vector2d& rhs, const int width) {
-  double u_diff = fabs(lhs[0] - rhs[0]);
-  double v_diff = fabs(lhs[1] - rhs[1]);
-  
-  if (u_diff > width / 2)
-    u_diff = width - u_diff;
+// Ray directions through the depth pixel centers in the local frame of
+// a panorama. The direction of pixel (u, v) is
+// (cos_phi[v] * cos_theta[u], -cos_phi[v] * sin_theta[u], sin_phi[v]),
+// the inverse of Panorama::ProjectToDepth.
+struct PanoramaRays {
+  explicit PanoramaRays(const Panorama& panorama) {
+    width  = panorama.DepthWidth();
+    height = panorama.DepthHeight();
+    phi_per_pixel = panorama.GetPhiPerPixel() * panorama.Height() / height;
+    cos_theta.resize(width);
+    sin_theta.resize(width);
+    for (int u = 0; u < width; ++u) {
+      const double theta = 2.0 * M_PI * u / width;
+      cos_theta[u] = cos(theta);
+      sin_theta[u] = sin(theta);
+    }
+    cos_phi.resize(height);
+    sin_phi.resize(height);
+    for (int v = 0; v < height; ++v) {
+      const double phi = (height / 2.0 - v) * phi_per_pixel;
+      cos_phi[v] = cos(phi);
+      sin_phi[v] = sin(phi);
+    }
+    const Matrix4d local_to_global = panorama.GetLocalToGlobal();
+    rotation = local_to_global.block<3, 3>(0, 0);
+    translation = local_to_global.block<3, 1>(0, 3);
+    center = panorama.GetCenter();
+  }
+
+  // Continuous depth pixel coordinate of a direction in the local frame.
+  Vector2d ToPixel(const Vector3d& local) const {
+    double theta = -atan2(local[1], local[0]);
+    if (theta < 0.0)
+      theta += 2 * M_PI;
+    const double phi = atan2(local[2], sqrt(local[0] * local[0] + local[1] * local[1]));
+    return Vector2d(theta / (2 * M_PI) * width, height / 2.0 - phi / phi_per_pixel);
+  }
+
+  int width;
+  int height;
+  double phi_per_pixel;
+  std::vector<double> cos_theta;
+  std::vector<double> sin_theta;
+  std::vector<double> cos_phi;
+  std::vector<double> sin_phi;
+  // Distances are measured in the global frame from the panorama
+  // center, as in PaintPoint.
+  Matrix3d rotation;
+  Vector3d translation;
+  Vector3d center;
+};
+
+// Fills the pixels whose rays hit a triangle (in the local frame of
+// the panorama), keeping the closest surface. Coverage is tested
+// exactly with the planes through the panorama center and the triangle
+// edges. Large triangles are split first so that the pixel bounding box
+// of each piece is tight.
+void RasterizeTriangle(const PanoramaRays& rays,
+                       const Vector3d (&vertices)[3],
+                       const Vector3d& normal,
+                       const GeometryType& geometry_type,
+                       std::vector<RasterizedGeometry>* rasterized_geometry) {
+  const int width  = rays.width;
+  const int height = rays.height;
+
+  const double kMaxAngle = 32.0 * 2.0 * M_PI / width;
+  double max_angle = 0.0;
+  for (int i = 0; i < 3; ++i) {
+    const Vector3d& lhs = vertices[i];
+    const Vector3d& rhs = vertices[(i + 1) % 3];
+    max_angle = max(max_angle, atan2(lhs.cross(rhs).norm(), lhs.dot(rhs)));
+  }
+  if (max_angle > kMaxAngle) {
+    const Vector3d edge01 = (vertices[0] + vertices[1]) / 2.0;
+    const Vector3d edge12 = (vertices[1] + vertices[2]) / 2.0;
+    const Vector3d edge20 = (vertices[2] + vertices[0]) / 2.0;
+    const Vector3d triangles[4][3] = { { vertices[0], edge01, edge20 },
+                                       { vertices[1], edge12, edge01 },
+                                       { vertices[2], edge20, edge12 },
+                                       { edge01, edge12, edge20 } };
+    for (int t = 0; t < 4; ++t)
+      RasterizeTriangle(rays, triangles[t], normal, geometry_type, rasterized_geometry);
+    return;
+  }
+
+  // Edge planes, oriented so that rays through the triangle are positive.
+  const Vector3d local_normal = (vertices[1] - vertices[0]).cross(vertices[2] - vertices[0]);
+  const double plane_offset = local_normal.dot(vertices[0]);
+  if (plane_offset == 0.0)
+    return;
+  const double orientation = plane_offset > 0.0 ? 1.0 : -1.0;
+  Vector3d edges[3];
+  for (int i = 0; i < 3; ++i)
+    edges[i] = orientation * vertices[i].cross(vertices[(i + 1) % 3]);
+
+  // Pixel bounding box. u is unwrapped across the seam, and a triangle
+  // around a pole covers every column.
+  Vector2d pixels[3];
+  for (int i = 0; i < 3; ++i)
+    pixels[i] = rays.ToPixel(vertices[i]);
+  const bool north_pole = edges[0][2] >= 0 && edges[1][2] >= 0 && edges[2][2] >= 0;
+  const bool south_pole = edges[0][2] <= 0 && edges[1][2] <= 0 && edges[2][2] <= 0;
+
+  double min_u = min(pixels[0][0], min(pixels[1][0], pixels[2][0]));
+  double max_u = max(pixels[0][0], max(pixels[1][0], pixels[2][0]));
+  if (max_u - min_u > width / 2) {
+    for (int i = 0; i < 3; ++i) {
+      if (pixels[i][0] < width / 2)
+        pixels[i][0] += width;
+    }
+    min_u = min(pixels[0][0], min(pixels[1][0], pixels[2][0]));
+    max_u = max(pixels[0][0], max(pixels[1][0], pixels[2][0]));
+  }
+  int u_begin = static_cast<int>(floor(min_u)) - 1;
+  int u_end   = static_cast<int>(ceil(max_u)) + 2;
+  if (north_pole || south_pole || u_end - u_begin > width) {
+    u_begin = 0;
+    u_end = width;
+  }
+
+  // An edge (a great circle arc) can rise above or sink below both of
+  // its end points. Include its highest and lowest points when inside.
+  double min_v = min(pixels[0][1], min(pixels[1][1], pixels[2][1]));
+  double max_v = max(pixels[0][1], max(pixels[1][1], pixels[2][1]));
+  for (int i = 0; i < 3; ++i) {
+    const Vector3d& lhs = vertices[i];
+    const Vector3d& rhs = vertices[(i + 1) % 3];
+    const Vector3d arc_normal = lhs.cross(rhs);
+    const Vector3d top = Vector3d(0, 0, 1) - arc_normal * (arc_normal[2] / arc_normal.squaredNorm());
+    if (arc_normal.squaredNorm() == 0.0 || top.squaredNorm() == 0.0)
+      continue;
+    for (int sign = -1; sign <= 1; sign += 2) {
+      const Vector3d extreme = sign * top;
+      if (lhs.cross(extreme).dot(arc_normal) >= 0.0 && extreme.cross(rhs).dot(arc_normal) >= 0.0) {
+        const double v = rays.ToPixel(extreme)[1];
+        min_v = min(min_v, v);
+        max_v = max(max_v, v);
+      }
+    }
+  }
+  const int v_begin = north_pole ? 0 : max(0, static_cast<int>(floor(min_v)) - 1);
+  const int v_end   = south_pole ? height : min(height, static_cast<int>(ceil(max_v)) + 2);
+
+  for (int v = v_begin; v < v_end; ++v) {
+    const double cos_phi = rays.cos_phi[v];
+    const double sin_phi = rays.sin_phi[v];
+    double edge_z[3];
+    for (int i = 0; i < 3; ++i)
+      edge_z[i] = edges[i][2] * sin_phi;
+    const double normal_z = local_normal[2] * sin_phi;
+
+    for (int u_unwrapped = u_begin; u_unwrapped < u_end; ++u_unwrapped) {
+      const int u = (u_unwrapped % width + width) % width;
+      const double x = cos_phi * rays.cos_theta[u];
+      const double y = -cos_phi * rays.sin_theta[u];
+      if (edges[0][0] * x + edges[0][1] * y + edge_z[0] < 0.0 ||
+          edges[1][0] * x + edges[1][1] * y + edge_z[1] < 0.0 ||
+          edges[2][0] * x + edges[2][1] * y + edge_z[2] < 0.0)
+        continue;
 
-  const double distance = sqrt(u_diff * u_diff + v_diff * v_diff);
-  // cout << distance << ' ' << flush;
-  return distance;
+      const double denom = local_normal[0] * x + local_normal[1] * y + normal_z;
+      if (denom == 0.0)
+        continue;
+      const double t = plane_offset / denom;
+      if (t <= 0.0)
+        continue;
+
+      const Vector3d global = rays.rotation * (t * Vector3d(x, y, sin_phi)) + rays.translation;
+      const double distance = (global - rays.center).norm();
+      RasterizedGeometry& geometry = rasterized_geometry->at(v * width + u);
+      if (distance < geometry.depth) {
+        geometry.depth = distance;
+        geometry.normal = normal;
+        geometry.geometry_type = geometry_type;
+      }
+    }
+  }
 }
 
 void RasterizeMeshForPanorama(const Panorama& panorama,
                               const Mesh& mesh,
                               std::vector<RasterizedGeometry>* rasterized_geometry) {
-  const int width = panorama.DepthWidth();
-  const int height = panorama.DepthHeight();
+  const PanoramaRays rays(panorama);
 
-  const double kSmallestSize = 1.0;
-  
   for (int f = 0; f < mesh.faces.size(); ++f) {
     const Vector3i& triangle = mesh.faces[f];
     const Vector3d vs[3] = { mesh.vertices[triangle[0]],
@@ -83,73 +245,14 @@ void RasterizeMeshForPanorama(const Panorama& panorama,
     }
     normal.normalize();
 
+    // Triangles smaller than a pixel still leave a sample.
     const Vector3d center = (vs[0] + vs[1] + vs[2]) / 3.0;
     PaintPoint(panorama, center, normal, mesh.geometry_type, rasterized_geometry);
 
-    list<Triple> queue;
-    {
-      Triple initial_triple;
-      for (int i = 0; i < 3; ++i)
-        initial_triple.points[i] = vs[i];
-      queue.push_back(initial_triple);
-    }
-
-    while (!queue.empty()) {
-      const Triple triple = queue.front();
-      queue.pop_front();
-
-      const Vector2d uv0 = panorama.ProjectToDepth(triple.points[0]);
-      const Vector2d uv1 = panorama.ProjectToDepth(triple.points[1]);
-      const Vector2d uv2 = panorama.ProjectToDepth(triple.points[2]);
-      if ((uv0[1] < 0.5 && uv1[1] < 0.5 && uv2[1] < 0.5) ||
-          (uv0[1] > height - 1.5 && uv1[1] > height - 1.5 && uv2[1] > height - 1.5))
-        continue;
-
-      if (UVDistance(uv0, uv1, width) < kSmallestSize &&
-          UVDistance(uv1, uv2, width) < kSmallestSize &&
-          UVDistance(uv2, uv0, width) < kSmallestSize)
-        continue;
-
-      // Recurse.
-      const Vector3d edge01 = (triple.points[0] + triple.points[1]) / 2.0;
-      const Vector3d edge12 = (triple.points[1] + triple.points[2]) / 2.0;
-      const Vector3d edge20 = (triple.points[2] + triple.points[0]) / 2.0;
-
-      PaintPoint(panorama, (triple.points[0] + edge01 + edge20) / 3.0, normal, mesh.geometry_type,
-                 rasterized_geometry);
-      PaintPoint(panorama, (triple.points[1] + edge12 + edge01) / 3.0, normal, mesh.geometry_type,
-                 rasterized_geometry);
-      PaintPoint(panorama, (triple.points[2] + edge20 + edge12) / 3.0, normal, mesh.geometry_type,
-                 rasterized_geometry);
-      {
-        Triple triple0;
-        triple0.points[0] = triple.points[0];
-        triple0.points[1] = edge01;
-        triple0.points[2] = edge20;
-        queue.push_front(triple0);
-      }
-      {
-        Triple triple1;
-        triple1.points[0] = triple.points[1];
-        triple1.points[1] = edge12;
-        triple1.points[2] = edge01;
-        queue.push_front(triple1);
-      }
-      {
-        Triple triple2;
-        triple2.points[0] = triple.points[2];
-        triple2.points[1] = edge20;
-        triple2.points[2] = edge12;
-        queue.push_front(triple2);
-      }
-      {
-        Triple triple3;
-        triple3.points[0] = edge01;
-        triple3.points[1] = edge12;
-        triple3.points[2] = edge20;
-        queue.push_front(triple3);
-      }
-    }
+    const Vector3d locals[3] = { panorama.GlobalToLocal(vs[0]),
+                                 panorama.GlobalToLocal(vs[1]),
+                                 panorama.GlobalToLocal(vs[2]) };
+    RasterizeTriangle(rays, locals, normal, mesh.geometry_type, rasterized_geometry);
   }
   
   /*
@@ -209,6 +312,100 @@ void RasterizeMeshForPanorama(const Panorama& panorama,
   }
   */  
 }
+
+// Streaming statistics of depth errors. Memory is constant regardless
+// of the number of samples, and two histograms (e.g., from different
+// panoramas or threads) are combined by Merge.
+//
+// Two sets of counters are kept:
+// - fixed-width bins over [0, kNumBins * kBinWidth) plus an overflow bin,
+//   which are written to the histogram file, and
+// - log-scale buckets that answer quantile queries within a relative
+//   accuracy of kRelativeAccuracy over the whole range.
+class ErrorHistogram {
+ public:
+  static const int kNumBins = 1000;
+  static constexpr double kBinWidth = 0.001;
+
+  ErrorHistogram() : bins(kNumBins + 1, 0), buckets(kNumBuckets, 0), count(0) {}
+
+  // NaN errors go to the overflow bin and the last bucket.
+  void Add(const double error) {
+    ++bins[GetBin(error)];
+    ++buckets[GetBucket(error)];
+    ++count;
+  }
+
+  void Merge(const ErrorHistogram& histogram) {
+    for (int b = 0; b < (int)bins.size(); ++b)
+      bins[b] += histogram.bins[b];
+    for (int b = 0; b < (int)buckets.size(); ++b)
+      buckets[b] += histogram.buckets[b];
+    count += histogram.count;
+  }
+
+  int64_t GetCount() const { return count; }
+  const vector<int64_t>& GetBins() const { return bins; }
+
+  // Error below which the given fraction of the samples lie.
+  double GetQuantile(const double fraction) const {
+    if (count == 0)
+      return 0.0;
+    const int64_t rank = static_cast<int64_t>(fraction * (count - 1));
+    int64_t accumulated = 0;
+    for (int b = 0; b < (int)buckets.size(); ++b) {
+      accumulated += buckets[b];
+      if (accumulated > rank)
+        return GetBucketValue(b);
+    }
+    return GetBucketValue(kNumBuckets - 1);
+  }
+
+ private:
+  // Bucket b > 0 holds errors in (kMinError * gamma^(b-1), kMinError * gamma^b].
+  // Bucket 0 holds everything up to kMinError.
+  static const int kNumBuckets = 1600;
+  static constexpr double kRelativeAccuracy = 0.01;
+  static constexpr double kMinError = 1e-6;
+
+  static double GetGamma() {
+    return (1.0 + kRelativeAccuracy) / (1.0 - kRelativeAccuracy);
+  }
+
+  // Values are clamped in double before the cast, which is undefined
+  // out of the int range.
+  static int GetBin(const double error) {
+    if (std::isnan(error))
+      return kNumBins;
+    return static_cast<int>(min<double>(kNumBins, max(0.0, error / kBinWidth)));
+  }
+
+  static int GetBucket(const double error) {
+    if (std::isnan(error))
+      return kNumBuckets - 1;
+    if (error <= kMinError)
+      return 0;
+    const double bucket = ceil(log(error / kMinError) / log(GetGamma()));
+    return static_cast<int>(max<double>(1, min<double>(kNumBuckets - 1, bucket)));
+  }
+
+  static double GetBucketValue(const int bucket) {
+    if (bucket == 0)
+      return 0.0;
+    const double gamma = GetGamma();
+    return kMinError * 2.0 * pow(gamma, bucket) / (gamma + 1.0);
+  }
+
+  vector<int64_t> bins;
+  vector<int64_t> buckets;
+  int64_t count;
+};
+
+const int ErrorHistogram::kNumBins;
+constexpr double ErrorHistogram::kBinWidth;
+const int ErrorHistogram::kNumBuckets;
+constexpr double ErrorHistogram::kRelativeAccuracy;
+constexpr double ErrorHistogram::kMinError;
   
 }  // namespace  
 
@@ -248,12 +445,7 @@ void RasterizeFloorplan(const Floorplan& floorplan,
                         const vector<Panorama>& panoramas,
                         std::vector<std::vector<RasterizedGeometry> >* rasterized_geometries) {
   cout << "RasterizeFloorplan." << endl;
-  for (int p = 0; p < panoramas.size(); ++p) {
-    cout << "Panorama " << p << '/' << panoramas.size() << flush;
-    const Panorama& panorama = panoramas[p];
-    vector<RasterizedGeometry>& rasterized_geometry = rasterized_geometries->at(p);
-
-    cout << " floor" << flush;
+  ParallelFor(0, panoramas.size(), [&](const int p) {
     // Floor.
     for (int room = 0; room < floorplan.GetNumRooms(); ++room) {
       const FloorCeilingTriangulation& triangulation = floorplan.GetFloorTriangulation(room);
@@ -267,7 +459,6 @@ void RasterizeFloorplan(const Floorplan& floorplan,
       }
       RasterizeMeshForPanorama(panoramas[p], mesh, &rasterized_geometries->at(p));
     }
-    cout << " ceiling" << flush;
     // Ceiling.
     for (int room = 0; room < floorplan.GetNumRooms(); ++room) {
       const FloorCeilingTriangulation& triangulation = floorplan.GetCeilingTriangulation(room);
@@ -281,7 +472,6 @@ void RasterizeFloorplan(const Floorplan& floorplan,
       }
       RasterizeMeshForPanorama(panoramas[p], mesh, &rasterized_geometries->at(p));
     }
-    cout << " walls" << flush;
     // Walls.
     for (int room = 0; room < floorplan.GetNumRooms(); ++room) {
       for (int wall = 0; wall < floorplan.GetNumWalls(room); ++wall) {
@@ -297,7 +487,6 @@ void RasterizeFloorplan(const Floorplan& floorplan,
         RasterizeMeshForPanorama(panoramas[p], mesh, &rasterized_geometries->at(p));
       }
     }
-    cout << " doors" << flush;
     // Doors.
     for (int door = 0; door < floorplan.GetNumDoors(); ++door) {
       Mesh mesh;
@@ -311,16 +500,14 @@ void RasterizeFloorplan(const Floorplan& floorplan,
       }
       RasterizeMeshForPanorama(panoramas[p], mesh, &rasterized_geometries->at(p));
     }
-    cout << " done." << endl;
-  }
+  });
 }
 
 void RasterizeIndoorPolygon(const IndoorPolygon& indoor_polygon,
                             const vector<Panorama>& panoramas,
                             std::vector<std::vector<RasterizedGeometry> >* rasterized_geometries) {
   cout << "RasterizeIndoorPolygon." << endl;
-  for (int p = 0; p < panoramas.size(); ++p) {
-    cout << "Panorama " << p << '/' << panoramas.size() << endl;
+  ParallelFor(0, panoramas.size(), [&](const int p) {
     const Panorama& panorama = panoramas[p];
     vector<RasterizedGeometry>& rasterized_geometry = rasterized_geometries->at(p);
     for (int s = 0; s < indoor_polygon.GetNumSegments(); ++s) {
@@ -354,26 +541,53 @@ void RasterizeIndoorPolygon(const IndoorPolygon& indoor_polygon,
       
       RasterizeMeshForPanorama(panorama, mesh, &rasterized_geometry);
     }
-  }
+  });
 }
 
 void RasterizeObjectPointClouds(const std::vector<PointCloud>& object_point_clouds,
                                 const vector<Panorama>& panoramas,
                                 std::vector<std::vector<RasterizedGeometry> >* rasterized_geometries) {
-
-  for (int p = 0; p < panoramas.size(); ++p) {
-    cout << "Panorama " << p << '/' << panoramas.size() << endl;
+  cout << "RasterizeObjectPointClouds." << endl;
+  ParallelFor(0, panoramas.size(), [&](const int p) {
     const Panorama& panorama = panoramas[p];
     vector<RasterizedGeometry>& rasterized_geometry = rasterized_geometries->at(p);
 
     for (const auto& point_cloud : object_point_clouds) {
-      cout << "paint " << point_cloud.GetNumPoints() << endl;
       for (int p = 0; p < point_cloud.GetNumPoints(); ++p) {
         const Point& point = point_cloud.GetPoint(p);
         PaintPoint(panorama, point.position, point.normal, kObject, &rasterized_geometry);
       }
     }
-  }
+  });
+}
+
+void ObservePoints(const std::vector<PointCloud>& input_point_clouds,
+                   const std::vector<Panorama>& panoramas,
+                   std::vector<ObservedPoints>* observed_points) {
+  observed_points->clear();
+  observed_points->resize(input_point_clouds.size());
+  ParallelFor(0, input_point_clouds.size(), [&](const int p) {
+    const PointCloud& input_point_cloud = input_point_clouds[p];
+    const Panorama& panorama = panoramas[p];
+    ObservedPoints& observed = observed_points->at(p);
+
+    const int width  = panorama.DepthWidth();
+    const int height = panorama.DepthHeight();
+    const int num_points = input_point_cloud.GetNumPoints();
+    observed.pixels.resize(num_points);
+    observed.distances.resize(num_points);
+    observed.normals.resize(num_points);
+
+    for (int q = 0; q < num_points; ++q) {
+      const Point& point = input_point_cloud.GetPoint(q);
+      const Vector2d pixel = panorama.ProjectToDepth(point.position);
+      const int u = max(0, min(width - 1, static_cast<int>(round(pixel[0]))));
+      const int v = max(0, min(height - 1, static_cast<int>(round(pixel[1]))));
+      observed.pixels[q] = v * width + u;
+      observed.distances[q] = (panorama.GetCenter() - point.position).norm();
+      observed.normals[q] = point.normal.cast<float>();
+    }
+  });
 }
 
 bool ReadMesh(const std::string& filename, Mesh* mesh) {
@@ -482,23 +696,21 @@ bool ReadMeshBinary(const std::string& filename, Mesh* mesh) {
 void RasterizeMesh(const Mesh& mesh,
                    const std::vector<Panorama>& panoramas,
                    std::vector<std::vector<RasterizedGeometry> >* rasterized_geometries) {
-  for (int p = 0; p < panoramas.size(); ++p) {
-    cout << "Panorama " << p << '/' << panoramas.size() << endl;
-    const Panorama& panorama = panoramas[p];
-    vector<RasterizedGeometry>& rasterized_geometry = rasterized_geometries->at(p);
-    RasterizeMeshForPanorama(panorama, mesh, &rasterized_geometry);
-  }
+  cout << "RasterizeMesh." << endl;
+  ParallelFor(0, panoramas.size(), [&](const int p) {
+    RasterizeMeshForPanorama(panoramas[p], mesh, &rasterized_geometries->at(p));
+  });
 }
   
 void ReportErrors(const FileIO& file_io,
                   const std::string& prefix,
-                  const std::vector<PointCloud>& input_point_clouds,
+                  const std::vector<ObservedPoints>& observed_points,
                   const std::vector<std::vector<RasterizedGeometry> >& rasterized_geometries,
                   const vector<Panorama>& panoramas,
                   const RasterizedGeometry& initial_value,
                   const double depth_unit) {
   vector<map<GeometryType, pair<Vector2d, int> > > errors(panoramas.size());
-  vector<map<GeometryType, vector<double> > > error_histograms(panoramas.size());
+  vector<map<GeometryType, ErrorHistogram> > error_histograms(panoramas.size());
   const pair<Vector2d, int> kInitial(Vector2d(0, 0), 0);
   vector<GeometryType> all_geometry_types;
   {
@@ -512,54 +724,48 @@ void ReportErrors(const FileIO& file_io,
   for (int p = 0; p < (int)panoramas.size(); ++p) {
     for (const auto& type : all_geometry_types) {
       errors[p][type]  = kInitial;
-      error_histograms[p][type] = vector<double>();
+      error_histograms[p][type] = ErrorHistogram();
     }
   }
   
-  for (int p = 0; p < (int)input_point_clouds.size(); ++p) {
-    const PointCloud& input_point_cloud = input_point_clouds[p];
-    const Panorama& panorama = panoramas[p];
+  ParallelFor(0, observed_points.size(), [&](const int p) {
+    const ObservedPoints& observed = observed_points[p];
     const vector<RasterizedGeometry>& rasterized_geometry = rasterized_geometries[p];
 
-    const int width  = panorama.DepthWidth();
-    const int height = panorama.DepthHeight();
-
-    for (int q = 0; q < (int)input_point_cloud.GetNumPoints(); ++q) {
-      const Point& point = input_point_cloud.GetPoint(q);
-      const Vector2d pixel = panorama.ProjectToDepth(point.position);
-      const int u = max(0, min(width - 1, static_cast<int>(round(pixel[0]))));
-      const int v = max(0, min(height - 1, static_cast<int>(round(pixel[1]))));
-      const int index = v * width + u;
+    for (int q = 0; q < (int)observed.pixels.size(); ++q) {
+      const RasterizedGeometry& geometry = rasterized_geometry[observed.pixels[q]];
 
       // No rasterized geometry. Very unlikely...
-      if (rasterized_geometry[index].depth == initial_value.depth) {
+      if (geometry.depth == initial_value.depth) {
         // cerr << "Rendering hole. This should rarely happen." << endl;
         continue;
       }
       
-      const double depth_error = 
-        fabs(rasterized_geometry[index].depth - (panorama.GetCenter() - point.position).norm()) / depth_unit;
+      const double depth_error = fabs(geometry.depth - observed.distances[q]) / depth_unit;
       const double normal_error =
-        acos(min(1.0, max(-1.0, rasterized_geometry[index].normal.dot(point.normal)))) * 180.0 / M_PI;
+        acos(min(1.0, max(-1.0, geometry.normal.dot(observed.normals[q].cast<double>())))) * 180.0 / M_PI;
 
-      const auto& type = rasterized_geometry[index].geometry_type;
+      const auto& type = geometry.geometry_type;
       errors[p][type].first[0] += depth_error;
       errors[p][type].first[1] += normal_error; // min(normal_error, 180.0 - normal_error); //???
       errors[p][type].second += 1;
 
-      error_histograms[p][type].push_back(depth_error);
+      error_histograms[p][type].Add(depth_error);
     }
-  }
+  });
 
   map<GeometryType, pair<Vector2d, int> > total_errors;
+  map<GeometryType, ErrorHistogram> total_histograms;
   for (const auto& type : all_geometry_types) {
     total_errors[type]  = kInitial;
+    total_histograms[type] = ErrorHistogram();
   }
 
   for (int p = 0; p < panoramas.size(); ++p) {
     for (const auto& type : all_geometry_types) {
       total_errors[type].first += errors[p][type].first;
       total_errors[type].second += errors[p][type].second;
+      total_histograms[type].Merge(error_histograms[p][type]);
     }
   }
 
@@ -613,6 +819,18 @@ void ReportErrors(const FileIO& file_io,
               << errors[p][kObject].first[i] / max(1, errors[p][kObject].second) << endl;
       }
     }
+
+    const double kFractions[] = { 0.5, 0.9, 0.95, 0.99 };
+    ofstr << endl << "Position quantiles" << endl
+          << "Quantile\tFloor\tCeiling\tWall\tDoor\tObject" << endl;
+    for (const double fraction : kFractions) {
+      ofstr << fraction << '\t'
+            << total_histograms[kFloor].GetQuantile(fraction) << '\t'
+            << total_histograms[kCeiling].GetQuantile(fraction) << '\t'
+            << total_histograms[kWall].GetQuantile(fraction) << '\t'
+            << total_histograms[kDoor].GetQuantile(fraction) << '\t'
+            << total_histograms[kObject].GetQuantile(fraction) << endl;
+    }
   }
 
   {
@@ -621,12 +839,14 @@ void ReportErrors(const FileIO& file_io,
     ofstr << "#_Histogram_of_errors_(floor,ceiling,wall,door,object,hole)." << endl
           << "For_each_panorama,_the_file_contains_a_histogram." << endl
           << (int)panoramas.size() << " panoramas." << endl
-          << (int)all_geometry_types.size() << " types." << endl;
+          << (int)all_geometry_types.size() << " types." << endl
+          << ErrorHistogram::kNumBins + 1 << " bins of width " << ErrorHistogram::kBinWidth
+          << " (the last bin counts all the larger errors)." << endl;
     for (int p = 0; p < (int)panoramas.size(); ++p) {
       for (const auto& type : all_geometry_types) {
 	const auto& histogram = error_histograms[p][type];
-        ofstr << (int)histogram.size() << endl;
-	for (const auto& value : histogram) {
+        ofstr << histogram.GetCount() << endl;
+	for (const auto& value : histogram.GetBins()) {
 	  ofstr << value << ' ';
 	}
         ofstr << endl;
@@ -26,6 +26,16 @@ struct RasterizedGeometry {
   GeometryType geometry_type;
 };
 
+// Input points of a panorama projected into its depth grid. Computed
+// once and shared by all the evaluated models.
+struct ObservedPoints {
+  // Depth pixel index of each point.
+  std::vector<int> pixels;
+  // Distance from the panorama center.
+  std::vector<float> distances;
+  std::vector<Eigen::Vector3f> normals;
+};
+
 struct Mesh {
   std::vector<Eigen::Vector3d> vertices;
   std::vector<Eigen::Vector3i> faces;
@@ -56,6 +66,10 @@ void RasterizeObjectPointClouds(const std::vector<PointCloud>& object_point_clou
                                 const std::vector<Panorama>& panoramas,
                                 std::vector<std::vector<RasterizedGeometry> >* rasterized_geometries);
 
+void ObservePoints(const std::vector<PointCloud>& input_point_clouds,
+                   const std::vector<Panorama>& panoramas,
+                   std::vector<ObservedPoints>* observed_points);
+
 bool ReadMesh(const std::string& filename, Mesh* mesh);
 bool ReadMeshAscii(const std::string& filename, Mesh* mesh);
 bool ReadMeshBinary(const std::string& filename, Mesh* mesh);
@@ -66,7 +80,7 @@ void RasterizeMesh(const Mesh& mesh,
 
 void ReportErrors(const FileIO& file_io,
                   const std::string& prefix,
-                  const std::vector<PointCloud>& input_point_clouds,
+                  const std::vector<ObservedPoints>& observed_points,
                   const std::vector<std::vector<RasterizedGeometry> >& rasterized_geometries,
                   const std::vector<Panorama>& panoramas,
                   const RasterizedGeometry& initial_value,
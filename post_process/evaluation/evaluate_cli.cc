@@ -1,3 +1,4 @@
+#include <functional>
 #include <iostream>
 #include <fstream>
 #include <limits>
@@ -9,6 +10,7 @@
 #include "../../base/floorplan.h"
 #include "../../base/indoor_polygon.h"
 #include "../../base/panorama.h"
+#include "../../base/parallel.h"
 #include "../../base/point_cloud.h"
 #include "evaluate.h"
 
@@ -27,6 +29,9 @@ DEFINE_bool(evaluate_poisson_mesh, false, "Evaluate poisson mesh.");
 DEFINE_bool(evaluate_vgcut_mesh, false, "Evaluate poisson mesh.");
 
 DEFINE_bool(evaluate_all, false, "Evaluate all.");
+DEFINE_int32(num_concurrent_models, 2,
+             "Number of models evaluated at the same time. Each one holds its own "
+             "rasterized depth grids for all the panoramas.");
 
 using namespace Eigen;
 using namespace std;
@@ -93,27 +98,21 @@ void WriteDepthmap(const Panorama& panorama,
   */
 }
 
-void WriteDepthErrormap(const PointCloud& input_point_cloud,
+void WriteDepthErrormap(const ObservedPoints& observed_points,
                         const std::vector<RasterizedGeometry>& rasterized_geometry,
-                        const Panorama& panorama,
+                        const Panorama& small_panorama,
                         const double invalid_depth,
                         const double depth_unit,
                         const string& depth_error_filename,
                         const string& normal_error_filename) {
-  const int width  = panorama.DepthWidth();
-  const int height = panorama.DepthHeight();
-  Panorama small_panorama = panorama;
-  small_panorama.Resize(Vector2i(width, height));
+  const int width  = small_panorama.Width();
+  const int height = small_panorama.Height();
   const double kInvalid = -1.0;
   vector<double> depth_errors(width * height, kInvalid);
   vector<double> normal_errors(width * height, kInvalid);
   
-  for (int p = 0; p < (int)input_point_cloud.GetNumPoints(); ++p) {
-    const Point& point = input_point_cloud.GetPoint(p);
-    const Vector2d pixel = panorama.ProjectToDepth(point.position);
-    const int u = max(0, min(width - 1, static_cast<int>(round(pixel[0]))));
-    const int v = max(0, min(height - 1, static_cast<int>(round(pixel[1]))));
-    const int index = v * width + u;
+  for (int p = 0; p < (int)observed_points.pixels.size(); ++p) {
+    const int index = observed_points.pixels[p];
     
    // No rasterized geometry. Very unlikely...
     if (rasterized_geometry[index].depth == invalid_depth) {
@@ -122,9 +121,9 @@ void WriteDepthErrormap(const PointCloud& input_point_cloud,
     }
     
     const double depth_error = 
-      fabs(rasterized_geometry[index].depth - (panorama.GetCenter() - point.position).norm());
+      fabs(rasterized_geometry[index].depth - observed_points.distances[p]);
     const double normal_error =
-      acos(min(1.0, max(-1.0, rasterized_geometry[index].normal.dot(point.normal)))) * 180.0 / M_PI;
+      acos(min(1.0, max(-1.0, rasterized_geometry[index].normal.dot(observed_points.normals[p].cast<double>())))) * 180.0 / M_PI;
     
     depth_errors[index] = depth_error;
     normal_errors[index] = normal_error;
@@ -202,13 +201,15 @@ void WriteDepthErrormap(const PointCloud& input_point_cloud,
   }
 }
 
+// small_panoramas are the panoramas resized to their depth resolution.
 void VisualizeResults(const FileIO& file_io, const string prefix,
-                      const std::vector<PointCloud>& input_point_clouds,
+                      const std::vector<ObservedPoints>& observed_points,
                       const std::vector<std::vector<RasterizedGeometry> >& rasterized_geometries,
                       const std::vector<Panorama>& panoramas,
+                      const std::vector<Panorama>& small_panoramas,
                       const double invalid_depth,
                       const double depth_unit) {
-  for (int p = 0; p < rasterized_geometries.size(); ++p) {
+  ParallelFor(0, rasterized_geometries.size(), [&](const int p) {
     {
       char depth_filename[1024];
       sprintf(depth_filename,
@@ -224,10 +225,10 @@ void VisualizeResults(const FileIO& file_io, const string prefix,
       sprintf(normal_error_filename,
               "%s/images/%03d_normal_error_%s.ppm",
               file_io.GetEvaluationDirectory().c_str(), p, prefix.c_str());
-      WriteDepthErrormap(input_point_clouds[p], rasterized_geometries[p], panoramas[p],
+      WriteDepthErrormap(observed_points[p], rasterized_geometries[p], small_panoramas[p],
                          invalid_depth, depth_unit, depth_error_filename, normal_error_filename);
     }
-  }
+  });
 
     /*
   for (int p = 0; p < rasterized_geometries.size(); ++p) {
@@ -334,103 +335,89 @@ int main(int argc, char* argv[]) {
 
   // Accuracy and completeness.
   const RasterizedGeometry kInitial(numeric_limits<double>::max(), Vector3d(0, 0, 0), kHole);
-  std::vector<std::vector<RasterizedGeometry> > rasterized_geometries;
 
   double depth_unit = 0.0;
   for (int p = 0; p < panoramas.size(); ++p)
     depth_unit += panoramas[p].GetAverageDistance();
   depth_unit /= panoramas.size();
 
+  // Input points are projected once and shared by all the models.
+  vector<ObservedPoints> observed_points;
+  ObservePoints(input_point_clouds, panoramas, &observed_points);
+  input_point_clouds.clear();
+
+  vector<Panorama> small_panoramas(panoramas.size());
+  ParallelFor(0, panoramas.size(), [&](const int p) {
+    small_panoramas[p] = panoramas[p];
+    small_panoramas[p].Resize(Vector2i(panoramas[p].DepthWidth(), panoramas[p].DepthHeight()));
+  });
+
+  // Each model to evaluate is a prefix and a function that rasterizes
+  // it. Returns false if the model cannot be read.
+  typedef function<bool (std::vector<std::vector<RasterizedGeometry> >*)> Rasterizer;
+  vector<pair<string, Rasterizer> > models;
+
   //----------------------------------------------------------------------
   if (FLAGS_evaluate_all || FLAGS_evaluate_floorplan) {
     // Floorplan only.
-    Initialize(panoramas, kInitial, &rasterized_geometries);
-    RasterizeFloorplan(floorplan, panoramas, &rasterized_geometries);
-    VisualizeResults(file_io, "floorplan", input_point_clouds, rasterized_geometries, panoramas, kInitial.depth, depth_unit);
-    ReportErrors(file_io, "floorplan", input_point_clouds, rasterized_geometries, panoramas, kInitial, depth_unit);
+    models.push_back(make_pair(string("floorplan"), [&](std::vector<std::vector<RasterizedGeometry> >* rasterized_geometries) {
+      RasterizeFloorplan(floorplan, panoramas, rasterized_geometries);
+      return true;
+    }));
   }
   
   // Indoor polygon only.
   if (FLAGS_evaluate_all || FLAGS_evaluate_indoor_polygon) {
-    Initialize(panoramas, kInitial, &rasterized_geometries);
-    RasterizeIndoorPolygon(indoor_polygon, panoramas, &rasterized_geometries);
-    VisualizeResults(file_io, "indoor_polygon", input_point_clouds, rasterized_geometries, panoramas, kInitial.depth, depth_unit);
-    ReportErrors(file_io, "indoor_polygon", input_point_clouds, rasterized_geometries, panoramas, kInitial, depth_unit);
+    models.push_back(make_pair(string("indoor_polygon"), [&](std::vector<std::vector<RasterizedGeometry> >* rasterized_geometries) {
+      RasterizeIndoorPolygon(indoor_polygon, panoramas, rasterized_geometries);
+      return true;
+    }));
   }
 
   if (FLAGS_evaluate_all || FLAGS_evaluate_indoor_polygon_and_object_point_clouds) {
-    Initialize(panoramas, kInitial, &rasterized_geometries);
-    RasterizeIndoorPolygon(indoor_polygon, panoramas, &rasterized_geometries);
-    RasterizeObjectPointClouds(object_point_clouds, panoramas, &rasterized_geometries);
-    VisualizeResults(file_io, "indoor_polygon_and_object_point_clouds", input_point_clouds, rasterized_geometries, panoramas, kInitial.depth, depth_unit);
-    ReportErrors(file_io, "indoor_polygon_and_object_point_clouds", input_point_clouds, rasterized_geometries, panoramas, kInitial, depth_unit);
+    models.push_back(make_pair(string("indoor_polygon_and_object_point_clouds"), [&](std::vector<std::vector<RasterizedGeometry> >* rasterized_geometries) {
+      RasterizeIndoorPolygon(indoor_polygon, panoramas, rasterized_geometries);
+      RasterizeObjectPointClouds(object_point_clouds, panoramas, rasterized_geometries);
+      return true;
+    }));
   }
 
-  if (FLAGS_evaluate_all || FLAGS_evaluate_poisson_mesh) {
-    {
-      const vector<string> filenames = file_io.GetPoissonMeshes();
-      for (int i = 1; i < filenames.size(); ++i) {
-	Mesh poisson_mesh;
-	if (!ReadMesh(filenames[i], &poisson_mesh))
-          continue;
-	Initialize(panoramas, kInitial, &rasterized_geometries);
-	RasterizeMesh(poisson_mesh, panoramas, &rasterized_geometries);
-	
-	char buffer[1024];
-	sprintf(buffer, "poisson%d", i);
-	VisualizeResults(file_io, buffer, input_point_clouds, rasterized_geometries, panoramas, kInitial.depth, depth_unit);
-	ReportErrors(file_io, buffer, input_point_clouds, rasterized_geometries, panoramas, kInitial, depth_unit);
-      }
-    }
-    {
-      const vector<string> filenames = file_io.GetFilteredPoissonMeshes();
-      for (int i = 1; i < filenames.size(); ++i) {
-	Mesh poisson_mesh;
-	if (!ReadMesh(filenames[i], &poisson_mesh))
-          continue;
-	Initialize(panoramas, kInitial, &rasterized_geometries);
-	RasterizeMesh(poisson_mesh, panoramas, &rasterized_geometries);
-	
-	char buffer[1024];
-	sprintf(buffer, "poisson_filtered%d", i);
-	VisualizeResults(file_io, buffer, input_point_clouds, rasterized_geometries, panoramas, kInitial.depth, depth_unit);
-	ReportErrors(file_io, buffer, input_point_clouds, rasterized_geometries, panoramas, kInitial, depth_unit);
-      }
+  // Meshes are read inside the task so that only the models being
+  // evaluated are in memory.
+  const auto add_meshes = [&](const vector<string>& filenames, const int start_index, const string& name) {
+    for (int i = start_index; i < filenames.size(); ++i) {
+      const string filename = filenames[i];
+      char buffer[1024];
+      sprintf(buffer, "%s%d", name.c_str(), i);
+      models.push_back(make_pair(string(buffer), [&panoramas, filename](std::vector<std::vector<RasterizedGeometry> >* rasterized_geometries) {
+        Mesh mesh;
+        if (!ReadMesh(filename, &mesh))
+          return false;
+        RasterizeMesh(mesh, panoramas, rasterized_geometries);
+        return true;
+      }));
     }
+  };
+
+  if (FLAGS_evaluate_all || FLAGS_evaluate_poisson_mesh) {
+    add_meshes(file_io.GetPoissonMeshes(), 1, "poisson");
+    add_meshes(file_io.GetFilteredPoissonMeshes(), 1, "poisson_filtered");
   }
 
   if (FLAGS_evaluate_all || FLAGS_evaluate_vgcut_mesh) {
-    {
-      const vector<string> filenames = file_io.GetVgcutMeshes();
-      for (int i = 0; i < filenames.size(); ++i) {
-	Mesh vgcut_mesh;
-	if (!ReadMesh(filenames[i], &vgcut_mesh))
-          continue;
-	Initialize(panoramas, kInitial, &rasterized_geometries);
-	RasterizeMesh(vgcut_mesh, panoramas, &rasterized_geometries);
-	
-	char buffer[1024];
-	sprintf(buffer, "vgcut%d", i);
-	VisualizeResults(file_io, buffer, input_point_clouds, rasterized_geometries, panoramas, kInitial.depth, depth_unit);
-	ReportErrors(file_io, buffer, input_point_clouds, rasterized_geometries, panoramas, kInitial, depth_unit);
-      }
-    }
-    {
-      const vector<string> filenames = file_io.GetFilteredVgcutMeshes();
-      for (int i = 0; i < filenames.size(); ++i) {
-	Mesh vgcut_mesh;
-	if (!ReadMesh(filenames[i], &vgcut_mesh))
-          continue;
-	Initialize(panoramas, kInitial, &rasterized_geometries);
-	RasterizeMesh(vgcut_mesh, panoramas, &rasterized_geometries);
-	
-	char buffer[1024];
-	sprintf(buffer, "vgcut_filtered%d", i);
-	VisualizeResults(file_io, buffer, input_point_clouds, rasterized_geometries, panoramas, kInitial.depth, depth_unit);
-	ReportErrors(file_io, buffer, input_point_clouds, rasterized_geometries, panoramas, kInitial, depth_unit);
-      }
-    }
+    add_meshes(file_io.GetVgcutMeshes(), 0, "vgcut");
+    add_meshes(file_io.GetFilteredVgcutMeshes(), 0, "vgcut_filtered");
   }
+
+  ParallelFor(0, models.size(), [&](const int m) {
+    const string& prefix = models[m].first;
+    std::vector<std::vector<RasterizedGeometry> > rasterized_geometries;
+    Initialize(panoramas, kInitial, &rasterized_geometries);
+    if (!models[m].second(&rasterized_geometries))
+      return;
+    VisualizeResults(file_io, prefix, observed_points, rasterized_geometries, panoramas, small_panoramas, kInitial.depth, depth_unit);
+    ReportErrors(file_io, prefix, observed_points, rasterized_geometries, panoramas, kInitial, depth_unit);
+  }, FLAGS_num_concurrent_models);
   
   return 0;
 }
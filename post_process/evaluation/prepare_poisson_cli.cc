@@ -1,6 +1,7 @@
 #include <iostream>
 #include <fstream>
 #include <limits>
+#include <unordered_set>
 #include <vector>
 
 #include <gflags/gflags.h>
@@ -13,10 +14,30 @@
 #pragma comment (lib, "Shlwapi.lib") 
 #endif
 
+DEFINE_bool(binary, false,
+            "Write 6 floats per point (poisson_input.bnpts) instead of ascii text.");
+DEFINE_double(voxel_size, 0.0,
+              "Keep at most one point per voxel of this size. 0 disables subsampling.");
+
 using namespace Eigen;
 using namespace std;
 using namespace structured_indoor_modeling;
 
+namespace {
+
+// Packs a voxel coordinate into 64 bits (21 bits per axis).
+long long GetVoxelKey(const Vector3d& position, const double voxel_size) {
+  const long long kMask = (1LL << 21) - 1;
+  long long key = 0;
+  for (int a = 0; a < 3; ++a) {
+    const long long index = static_cast<long long>(floor(position[a] / voxel_size));
+    key = (key << 21) | (index & kMask);
+  }
+  return key;
+}
+
+}  // namespace
+
 int main(int argc, char* argv[]) {
   if (argc < 2) {
     cerr << "Usage: " << argv[0] << " data_directory" << endl;
@@ -30,30 +51,54 @@ int main(int argc, char* argv[]) {
 
   FileIO file_io(argv[1]);
   const int num_panoramas = GetNumPanoramas(file_io);
-  vector<vector<double> > oriented_points;
+
+  // Points are converted and written one panorama at a time.
+  ofstream ofstr;
+  if (FLAGS_binary)
+    ofstr.open(file_io.GetPoissonBinaryInput().c_str(), ios::out | ios::binary);
+  else
+    ofstr.open(file_io.GetPoissonInput().c_str());
+  if (!ofstr.is_open()) {
+    cerr << "Cannot open the output file." << endl;
+    exit (1);
+  }
+
+  unordered_set<long long> occupied_voxels;
+  int num_written = 0;
   for (int panorama = 0; panorama < num_panoramas; ++panorama) {
-    PointCloud point_cloud;
+    // Only positions and normals are needed.
+    ColumnarPointCloud point_cloud;
     point_cloud.Init(file_io, panorama);
     point_cloud.ToGlobal(file_io, panorama);
+    const vector<float>& positions = point_cloud.GetPositionData();
     for (int p = 0; p < point_cloud.GetNumPoints(); ++p) {
-      const Point& point = point_cloud.GetPoint(p);
-      vector<double> oriented_point;
-      for (int i = 0; i < 3; ++i)
-        oriented_point.push_back(point.position[i]);
-      for (int i = 0; i < 3; ++i)
-        oriented_point.push_back(point.normal[i]);
-      oriented_points.push_back(oriented_point);
+      const float* position = &positions[3 * p];
+      if (FLAGS_voxel_size > 0.0 &&
+          !occupied_voxels.insert(GetVoxelKey(Vector3d(position[0], position[1], position[2]),
+                                              FLAGS_voxel_size)).second)
+        continue;
+
+      const Vector3d normal = point_cloud.GetNormal(p);
+      if (FLAGS_binary) {
+        float oriented_point[6];
+        for (int i = 0; i < 3; ++i) {
+          oriented_point[i]     = position[i];
+          oriented_point[i + 3] = normal[i];
+        }
+        ofstr.write(reinterpret_cast<const char*>(oriented_point), sizeof(oriented_point));
+      } else {
+        for (int i = 0; i < 3; ++i)
+          ofstr << position[i] << ' ';
+        for (int i = 0; i < 3; ++i)
+          ofstr << normal[i] << ' ';
+        ofstr << '\n';
+      }
+      ++num_written;
     }
   }
+  ofstr.close();
 
-  ofstream ofstr;
-  ofstr.open(file_io.GetPoissonInput().c_str());
-  for (const auto& oriented_point : oriented_points) {
-    for (const auto& value : oriented_point)
-      ofstr << value << ' ';
-    ofstr << endl;
-  }
-  ofstr.close();  
+  cout << num_written << " points written." << endl;
   
   return 0;
 }
@@ -11,6 +11,9 @@
 #include "ceres/ceres.h"
 #include "depthmap_refiner.h"
 #include "../../base/file_io.h"
+#include "../../base/panorama.h"
+#include "../../base/point_cloud.h"
+#include "../../base/parallel.h"
 #include "gflags/gflags.h"
 #include "transformation.h"
 
@@ -24,8 +27,14 @@ DEFINE_int32(start_panorama, 0, "Start panorama index.");
 DEFINE_int32(end_panorama, 1, "End panorama index (exclusive).");
 DEFINE_int32(ncc_window_radius, 2, "ncc window radius");
 DEFINE_bool(load, true, "Load previous result.");
+DEFINE_string(depth_format, "ascii",
+              "Depth file format: ascii, float, or half (lossy, see WriteDepthPanorama).");
+DEFINE_int32(num_threads, 0, "Total number of threads shared by all the panoramas (0 uses all the cores).");
+DEFINE_int32(num_concurrent_panoramas, 0,
+             "Number of panoramas aligned at the same time (0 uses one per thread).");
 
 const double kInvalid = -1.0;
+const double kHuberParameter = 0.3;
 
 struct DepthPoint {
   int x;
@@ -45,41 +54,30 @@ struct Image {
   int height;
 };
 
+// Local plys may be in any format that PointCloud reads.
 void ReadPly(const string filename,
              int* depth_width,
              int* depth_height,
              vector<DepthPoint>* depth_points) {
-  ifstream ifstr;
-  ifstr.open(filename.c_str());
-  if (!ifstr.is_open()) {
+  PointCloud point_cloud;
+  if (!point_cloud.Init(filename)) {
     cerr << "ply file does not exist: " << filename << endl;
     exit (1);
   }
+  const int num_vertex = point_cloud.GetNumPoints();
 
-  string stmp;
-  for (int i = 0; i < 6; ++i)
-    ifstr >> stmp;
-  int num_vertex;
-  ifstr >> num_vertex;
-  for (int i = 0; i < 37; ++i)
-    ifstr >> stmp;
-    
-  const int kXOffset = 1;
-  const int kYOffset = 1;
-  
   int max_x = 0, max_y = 0;
 
   depth_points->resize(num_vertex);
   for (int i = 0; i < num_vertex; ++i) {
-    ifstr >> depth_points->at(i).y >> depth_points->at(i).x
-          >> depth_points->at(i).X >> depth_points->at(i).Y >> depth_points->at(i).Z;
-      
-    depth_points->at(i).x -= kXOffset;
-    depth_points->at(i).y -= kYOffset;
-    double dummy;
-    for (int j = 0; j < 7; ++j)
-      ifstr >> dummy;
-    
+    const structured_indoor_modeling::Point& point = point_cloud.GetPoint(i);
+    // The first column (depth_position[1]) is y here.
+    depth_points->at(i).y = point.depth_position[1];
+    depth_points->at(i).x = point.depth_position[0];
+    depth_points->at(i).X = point.position[0];
+    depth_points->at(i).Y = point.position[1];
+    depth_points->at(i).Z = point.position[2];
+
     const double distance = sqrt(depth_points->at(i).X * depth_points->at(i).X +
                                  depth_points->at(i).Y * depth_points->at(i).Y +
                                  depth_points->at(i).Z * depth_points->at(i).Z);
@@ -93,7 +91,6 @@ void ReadPly(const string filename,
       max_y = max(depth_points->at(i).y, max_y);
     }
   }
-  ifstr.close();
 
   *depth_width = max_x + 1;
   *depth_height = max_y + 1;
@@ -487,106 +484,6 @@ void FindEffectiveDepthPixels(const vector<double>& edge_image,
   */
 }
 
-void ExhaustiveSearch(const Image& color_image,
-                      const Image& depth_image,
-                      const double depth_phi_range,
-                      vector<double>* params,
-                      ceres::Problem* problem) {
-  const double depth_phi_per_pixel = depth_phi_range / depth_image.height;
-  // Identify the representative point.
-  double average_depth = 0.0;
-  {
-    int denom = 0;
-    int index = 0;
-    for (int y = 0; y < depth_image.height; ++y) {
-      for (int x = 0; x < depth_image.width; ++x, ++index) {
-        if (depth_image.depth[index] != kInvalid) {
-          average_depth += depth_image.depth[index];
-          ++denom;
-        }
-      }
-    }
-    if (denom == 0) {
-      cerr << "impossible0" << endl;
-      exit (1);
-    }
-    average_depth /= denom;
-  }
-  const Vector2d depth_pixel(depth_image.width / 2, depth_image.height / 3);
-  const Vector2d reference = DepthToPanorama(color_image.width,
-                                             color_image.height,
-                                             depth_image.width,
-                                             depth_image.height,
-                                             depth_phi_per_pixel,
-                                             &params->at(0),
-                                             depth_pixel,
-                                             average_depth);
-  vector<double> params_org = *params;
-
-  const double kTargetMove = 0.5;
-  vector<double> units(7);
-  vector<int> indexes;
-  indexes.push_back(2);
-  units[2] = M_PI * 0.005;
-  indexes.push_back(4);
-  units[4] = 20.0;
-  indexes.push_back(5);
-  units[5] = 40.0;
-  indexes.push_back(6);
-  units[6] = 40.0;
-  for (const auto index : indexes) {
-    *params = params_org;
-    params->at(index) += units[index];
-    const Vector2d move = DepthToPanorama(color_image.width,
-                                          color_image.height,
-                                          depth_image.width,
-                                          depth_image.height,
-                                          depth_phi_per_pixel,
-                                          &params->at(0),
-                                          depth_pixel,
-                                          average_depth);
-    const double diff = (reference - move).norm();
-    units[index] *= kTargetMove / diff;
-  }
-    
-  
-  double min_cost = 1000000;
-  double best_params[4];
-  for (int l = -40; l <= 40; ++l) {
-    cout << '*' << flush;
-    for (int k = -20; k <= 20; ++k) {
-      for (int j = -0; j <= 0; ++j) {
-        for (int i = -0; i <= 0; ++i) {
-          *params = params_org;
-          params->at(2) += l * units[2];
-          params->at(4) += k * units[4];
-          params->at(5) += j * units[5];
-          params->at(6) += i * units[6];
-          
-          double cost;
-          problem->Evaluate(ceres::Problem::EvaluateOptions(),
-                           &cost, NULL, NULL, NULL);
-          if (cost < min_cost) {
-            min_cost = cost;
-            best_params[0] = params->at(2);
-            best_params[1] = params->at(4);
-            best_params[2] = params->at(5);
-            best_params[3] = params->at(6);
-          }
-        }
-      }
-    }
-  }
-  cout << endl;
-  params->at(2) = best_params[0];
-  params->at(4) = best_params[1];
-  params->at(5) = best_params[2];
-  params->at(6) = best_params[3];
-  for (int i = 0; i < params->size(); ++i)
-    cout << params->at(i) << ' ';
-  cout << endl;
-}
-
 void SetBounds(ceres::Problem* problem, vector<double>* params) {
   problem->SetParameterLowerBound(&(*params)[0], 0, params->at(0) * 0.8);
   problem->SetParameterUpperBound(&(*params)[0], 0, params->at(0) * 1.2);
@@ -651,7 +548,8 @@ void VisualizeAlignment(const Image& color_image,
                         const double* const params,
                         const set<pair<int, int> >& depth_pixels,
                         const string header,
-                        const string filename) {
+                        const string filename,
+                        const bool display) {
   const int depth_width = depth_image.width;
   const int depth_height = depth_image.height;
   const double depth_phi_per_pixel = depth_phi_range / depth_height;
@@ -704,7 +602,8 @@ void VisualizeAlignment(const Image& color_image,
 
   if (!filename.empty())
     cv::imwrite(filename.c_str(), blended_panorama);  
-  cv::imshow(header.c_str(), blended_panorama);
+  if (display)
+    cv::imshow(header.c_str(), blended_panorama);
 }
 
 double Interpolate(const vector<double>& image,
@@ -861,6 +760,185 @@ private:
   double depth_to_color_scale;
 };
 
+// Evaluates the total cost of the residual blocks that SetupProblem would
+// create (AlignPanoramaToDepthResidual with a Huber loss) for a given
+// parameter vector, without going through ceres. The 3D point of each
+// depth pixel and its edge value are computed once, so that scoring a
+// candidate is a single pass over flat arrays. Used by ExhaustiveSearch,
+// which scores thousands of candidates.
+class AlignmentCostKernel {
+ public:
+  AlignmentCostKernel(const Image& color_image,
+                      const Image& depth_image,
+                      const double depth_phi_range,
+                      const int ncc_window_radius,
+                      const set<pair<int, int> >& depth_pixels) :
+    color_image(color_image) {
+    const double depth_phi_per_pixel = depth_phi_range / depth_image.height;
+    const double depth_to_color_scale = color_image.width / static_cast<double>(depth_image.width);
+    color_margin = ceil(depth_to_color_scale * ncc_window_radius) + 1;
+
+    const int num_pixels = depth_pixels.size();
+    xs.reserve(num_pixels);
+    ys.reserve(num_pixels);
+    zs.reserve(num_pixels);
+    edges.reserve(num_pixels);
+    for (const auto& depth_pixel : depth_pixels) {
+      const int index = depth_pixel.second * depth_image.width + depth_pixel.first;
+      Vector3d ray;
+      ConvertPanoramaToLocal(depth_image.width, depth_image.height, depth_phi_per_pixel,
+                             Vector2d(depth_pixel.first, depth_pixel.second), &ray);
+      ray.normalize();
+      ray *= depth_image.depth[index];
+      xs.push_back(ray[0]);
+      ys.push_back(ray[1]);
+      zs.push_back(ray[2]);
+      edges.push_back(depth_image.edge[index]);
+    }
+  }
+
+  double Evaluate(const vector<double>& params) const {
+    const double color_phi_per_pixel = params[0] / color_image.height;
+    const Matrix3d r = RotationY(params[3]) * RotationZ(params[2]) * RotationX(params[1]);
+    const Vector3d t(params[6], params[5], params[4]);
+    const double kMinPenalty = 1.0;
+    const double kHuberSquared = kHuberParameter * kHuberParameter;
+
+    double cost = 0.0;
+    for (int i = 0; i < (int)xs.size(); ++i) {
+      const Vector3d color_point = r * Vector3d(xs[i], ys[i], zs[i]) + t;
+      Vector2d color_pixel;
+      ConvertLocalToPanorama(color_image.width, color_image.height, color_phi_per_pixel,
+                             color_point, &color_pixel);
+
+      double residual = kMinPenalty;
+      if (color_margin < color_pixel[1] &&
+          color_pixel[1] < color_image.height - 1 - color_margin &&
+          edges[i] != kInvalid) {
+        const double rhs =
+          Interpolate(color_image.edge, color_image.width, color_image.height, color_pixel);
+        if (rhs != kInvalid)
+          residual = 1.0 - rhs;
+      }
+
+      // Same as ceres: 0.5 * HuberLoss(residual^2).
+      const double squared = residual * residual;
+      if (squared > kHuberSquared)
+        cost += 0.5 * (2.0 * kHuberParameter * sqrt(squared) - kHuberSquared);
+      else
+        cost += 0.5 * squared;
+    }
+    return cost;
+  }
+
+ private:
+  const Image& color_image;
+  int color_margin;
+  // Depth pixels in the local coordinate frame of the depth image.
+  vector<double> xs;
+  vector<double> ys;
+  vector<double> zs;
+  vector<double> edges;
+};
+
+void ExhaustiveSearch(const Image& color_image,
+                      const Image& depth_image,
+                      const double depth_phi_range,
+                      const int ncc_window_radius,
+                      const set<pair<int, int> >& depth_pixels,
+                      const int num_threads,
+                      vector<double>* params) {
+  const double depth_phi_per_pixel = depth_phi_range / depth_image.height;
+  // Identify the representative point.
+  double average_depth = 0.0;
+  {
+    int denom = 0;
+    int index = 0;
+    for (int y = 0; y < depth_image.height; ++y) {
+      for (int x = 0; x < depth_image.width; ++x, ++index) {
+        if (depth_image.depth[index] != kInvalid) {
+          average_depth += depth_image.depth[index];
+          ++denom;
+        }
+      }
+    }
+    if (denom == 0) {
+      cerr << "impossible0" << endl;
+      exit (1);
+    }
+    average_depth /= denom;
+  }
+  const Vector2d depth_pixel(depth_image.width / 2, depth_image.height / 3);
+  const Vector2d reference = DepthToPanorama(color_image.width,
+                                             color_image.height,
+                                             depth_image.width,
+                                             depth_image.height,
+                                             depth_phi_per_pixel,
+                                             &params->at(0),
+                                             depth_pixel,
+                                             average_depth);
+  vector<double> params_org = *params;
+
+  const double kTargetMove = 0.5;
+  vector<double> units(7);
+  vector<int> indexes;
+  indexes.push_back(2);
+  units[2] = M_PI * 0.005;
+  indexes.push_back(4);
+  units[4] = 20.0;
+  indexes.push_back(5);
+  units[5] = 40.0;
+  indexes.push_back(6);
+  units[6] = 40.0;
+  for (const auto index : indexes) {
+    *params = params_org;
+    params->at(index) += units[index];
+    const Vector2d move = DepthToPanorama(color_image.width,
+                                          color_image.height,
+                                          depth_image.width,
+                                          depth_image.height,
+                                          depth_phi_per_pixel,
+                                          &params->at(0),
+                                          depth_pixel,
+                                          average_depth);
+    const double diff = (reference - move).norm();
+    units[index] *= kTargetMove / diff;
+  }
+    
+  
+  const AlignmentCostKernel kernel(color_image, depth_image, depth_phi_range,
+                                   ncc_window_radius, depth_pixels);
+  const int kRotationRadius = 40;
+  const int kTranslationRadius = 20;
+  const int kNumTranslations = 2 * kTranslationRadius + 1;
+  const int kNumCandidates = (2 * kRotationRadius + 1) * kNumTranslations;
+  vector<double> costs(kNumCandidates);
+  ParallelFor(0, kNumCandidates, [&](const int c) {
+    vector<double> candidate = params_org;
+    candidate[2] += (c / kNumTranslations - kRotationRadius) * units[2];
+    candidate[4] += (c % kNumTranslations - kTranslationRadius) * units[4];
+    costs[c] = kernel.Evaluate(candidate);
+  }, num_threads);
+
+  // Scan in the original (rotation, translation) order so that ties
+  // resolve to the same candidate.
+  double min_cost = 1000000;
+  double best_params[4];
+  for (int c = 0; c < kNumCandidates; ++c) {
+    if (costs[c] < min_cost) {
+      min_cost = costs[c];
+      best_params[0] = params_org[2] + (c / kNumTranslations - kRotationRadius) * units[2];
+      best_params[1] = params_org[4] + (c % kNumTranslations - kTranslationRadius) * units[4];
+      best_params[2] = params_org[5];
+      best_params[3] = params_org[6];
+    }
+  }
+  params->at(2) = best_params[0];
+  params->at(4) = best_params[1];
+  params->at(5) = best_params[2];
+  params->at(6) = best_params[3];
+}
+
 void InitializeDepthImage(const FileIO& file_io,
                           const int p,
                           const double depth_phi_range,
@@ -982,7 +1060,6 @@ void BuildPyramid(vector<Image>* pyramid) {
 void SetupProblem(const Image& color_image, const Image& depth_image, const double depth_phi_range,
                   const int ncc_window_radius, const set<pair<int, int> >& depth_pixels,
                   ceres::Problem* problem, vector<double>* params) {
-  const double kHuberParameter = 0.3;
   cerr << "Pixels: " << depth_pixels.size() << endl;
   for (const auto& depth_pixel : depth_pixels) {
     problem->AddResidualBlock(new ceres::NumericDiffCostFunction
@@ -1127,19 +1204,8 @@ void WriteDepth(const FileIO& file_io, const int p, const vector<double>& params
     }
   }
   
-  {
-    char buffer[1024];
-    ofstream ofstr;
-    ofstr.precision(5);
-    ofstr.open(file_io.GetSmoothDepthPanorama(p));
-    ofstr << "Depth" << endl
-          << color_width << ' ' << color_height << endl
-          << min_distance << ' ' << max_distance << endl;
-    for (const auto value : depth_in_color) {
-      ofstr << value << ' ';
-    }
-    ofstr.close();
-  }
+  WriteDepthPanorama(file_io.GetSmoothDepthPanorama(p), color_width, color_height,
+                     depth_in_color, DepthPanoramaFormatFromName(FLAGS_depth_format));
   {
     cv::Mat depth_image(color_height, color_width, CV_8UC3);
     int index = 0;
@@ -1159,6 +1225,97 @@ void WriteDepth(const FileIO& file_io, const int p, const vector<double>& params
   }
 }
 
+// Aligns one panorama to its depth image and writes the results.
+// num_threads is the share of the global thread budget for this panorama.
+void AlignPanorama(const FileIO& file_io, const int p, const double depth_phi_range,
+                   const int num_threads, const bool display) {
+  Image depth_image;
+  InitializeDepthImage(file_io, p, depth_phi_range, &depth_image);
+  Image color_image;
+  InitializeColorImage(file_io, p, depth_image.width, depth_image.height, &color_image);
+
+  vector<Image> depth_pyramid(FLAGS_num_pyramid_levels);
+  vector<Image> color_pyramid(FLAGS_num_pyramid_levels);
+  const int kBottomLevel = 0;
+  depth_pyramid[kBottomLevel] = depth_image;
+  color_pyramid[kBottomLevel] = color_image;
+
+  BuildPyramid(&depth_pyramid);
+  BuildPyramid(&color_pyramid);
+  
+  // Align. Parameters.
+  // phi_coverage_along_ y, rotation_x, rotation_z, rotation_y, Tz, Ty, Tx.
+  // Rotation from panorama to the local coordinate frame is given by: Ry Rz Rx.
+  vector<double> params;
+
+  ifstream ifstr;
+  ifstr.open(file_io.GetPanoramaDepthAlignmentCalibration(p));
+  if (FLAGS_load && ifstr.is_open()) {
+    string stmp;
+    ifstr >> stmp;
+    const int kNumParams = 7;
+    params.resize(kNumParams);
+    for (int i = 0; i < kNumParams; ++i)
+      ifstr >> params[i];
+    ifstr.close();
+  } else {
+    InitializeParameters(file_io, p, &params);
+  }
+
+  for (int level = FLAGS_num_pyramid_levels - 1; level >= 0; --level) {
+    set<pair<int, int> > depth_pixels;
+    FindEffectiveDepthPixels(depth_pyramid[level].edge,
+                             depth_pyramid[level].width,
+                             depth_pyramid[level].height,
+                             FLAGS_ncc_window_radius,
+                             &depth_pixels);
+    
+    VisualizeAlignment(color_pyramid[level], depth_pyramid[level], depth_phi_range,
+                       &params[0], depth_pixels, "before", "", display);
+    
+    ceres::Problem problem;
+    SetupProblem(color_pyramid[level], depth_pyramid[level], depth_phi_range,
+                 FLAGS_ncc_window_radius, depth_pixels, &problem, &params);
+    
+    
+    if (level == FLAGS_num_pyramid_levels - 1)
+      ExhaustiveSearch(color_pyramid[level], depth_pyramid[level],
+                       depth_phi_range, FLAGS_ncc_window_radius, depth_pixels,
+                       num_threads, &params);
+    
+    SetBounds(&problem, &params);
+    
+    ceres::Solver::Options options;
+    options.max_num_iterations = 100;
+    options.num_threads = num_threads;
+    options.minimizer_progress_to_stdout = display;
+    
+    ceres::Solver::Summary summary;
+    ceres::Solve(options, &problem, &summary);
+    std::cout << summary.FullReport() << "\n";
+    
+    cout << "Param: ";
+    for (int i = 0; i < params.size(); ++i)
+      cout << params[i] << ' ';
+    cout << endl;
+    
+    if (level == 0) {
+      VisualizeAlignment(color_pyramid[level], depth_pyramid[level], depth_phi_range,
+                         &params[0], depth_pixels, "after",
+                         file_io.GetPanoramaDepthAlignmentVisualization(p), display);
+    } else {
+      VisualizeAlignment(color_pyramid[level], depth_pyramid[level], depth_phi_range,
+                         &params[0], depth_pixels, "after", "", display);
+    }
+    // cv::waitKey(0);
+  }
+
+  //----------------------------------------------------------------------
+  WriteResults(file_io, p, params);
+
+  WriteDepth(file_io, p, params);
+}
+
 int main(int argc, char* argv[]) {
   if (argc < 2) {
     cerr << "Usage: " << argv[0] << " data_directory" << endl;
@@ -1171,92 +1328,21 @@ int main(int argc, char* argv[]) {
   
   const double kDepthPhiRange = 0.8 * M_PI; // PhiPerPixel = 0.004363323;
 
-  for (int p = FLAGS_start_panorama; p < FLAGS_end_panorama; ++p) {
-    Image depth_image;
-    InitializeDepthImage(file_io, p, kDepthPhiRange, &depth_image);
-    Image color_image;
-    InitializeColorImage(file_io, p, depth_image.width, depth_image.height, &color_image);
-
-    vector<Image> depth_pyramid(FLAGS_num_pyramid_levels);
-    vector<Image> color_pyramid(FLAGS_num_pyramid_levels);
-    const int kBottomLevel = 0;
-    depth_pyramid[kBottomLevel] = depth_image;
-    color_pyramid[kBottomLevel] = color_image;
-
-    BuildPyramid(&depth_pyramid);
-    BuildPyramid(&color_pyramid);
-    
-    // Align. Parameters.
-    // phi_coverage_along_ y, rotation_x, rotation_z, rotation_y, Tz, Ty, Tx.
-    // Rotation from panorama to the local coordinate frame is given by: Ry Rz Rx.
-    vector<double> params;
-
-    ifstream ifstr;
-    ifstr.open(file_io.GetPanoramaDepthAlignmentCalibration(p));
-    if (FLAGS_load && ifstr.is_open()) {
-      string stmp;
-      ifstr >> stmp;
-      const int kNumParams = 7;
-      params.resize(kNumParams);
-      for (int i = 0; i < kNumParams; ++i)
-        ifstr >> params[i];
-      ifstr.close();
-    } else {
-      InitializeParameters(file_io, p, &params);
-    }
-
-    for (int level = FLAGS_num_pyramid_levels - 1; level >= 0; --level) {
-      set<pair<int, int> > depth_pixels;
-      FindEffectiveDepthPixels(depth_pyramid[level].edge,
-                               depth_pyramid[level].width,
-                               depth_pyramid[level].height,
-                               FLAGS_ncc_window_radius,
-                               &depth_pixels);
-      
-      VisualizeAlignment(color_pyramid[level], depth_pyramid[level], kDepthPhiRange,
-                         &params[0], depth_pixels, "before", "");
-      
-      ceres::Problem problem;
-      SetupProblem(color_pyramid[level], depth_pyramid[level], kDepthPhiRange,
-                   FLAGS_ncc_window_radius, depth_pixels, &problem, &params);
-      
-      
-      if (level == FLAGS_num_pyramid_levels - 1)
-        ExhaustiveSearch(color_pyramid[level], depth_pyramid[level],
-                         kDepthPhiRange, &params, &problem);
-      
-      SetBounds(&problem, &params);
-      
-      ceres::Solver::Options options;
-      options.max_num_iterations = 100;
-      options.num_threads = 2;
-      options.minimizer_progress_to_stdout = true;
-      
-      ceres::Solver::Summary summary;
-      ceres::Solve(options, &problem, &summary);
-      std::cout << summary.FullReport() << "\n";
-      
-      cout << "Param: ";
-      for (int i = 0; i < params.size(); ++i)
-        cout << params[i] << ' ';
-      cout << endl;
-      
-      if (level == 0) {
-        VisualizeAlignment(color_pyramid[level], depth_pyramid[level], kDepthPhiRange,
-                           &params[0], depth_pixels, "after",
-                           file_io.GetPanoramaDepthAlignmentVisualization(p));
-      } else {
-        VisualizeAlignment(color_pyramid[level], depth_pyramid[level], kDepthPhiRange,
-                           &params[0], depth_pixels, "after", "");
-      }
-      // cv::waitKey(0);
-    }
-
-    //----------------------------------------------------------------------
-    WriteResults(file_io, p, params);
-
-    WriteDepth(file_io, p, params);
-  }
+  // Panoramas are independent. The thread budget is split between
+  // panoramas aligned concurrently and the threads each one uses.
+  const int num_panoramas = max(0, FLAGS_end_panorama - FLAGS_start_panorama);
+  const int num_threads =
+    FLAGS_num_threads > 0 ? FLAGS_num_threads : GetDefaultNumThreads();
+  const int num_concurrent_panoramas =
+    max(1, min(num_panoramas,
+               FLAGS_num_concurrent_panoramas > 0 ? FLAGS_num_concurrent_panoramas : num_threads));
+  const int num_threads_per_panorama = max(1, num_threads / num_concurrent_panoramas);
+  // Windows and solver progress are shown only when panoramas run one at a time.
+  const bool display = num_concurrent_panoramas == 1;
+
+  ParallelFor(FLAGS_start_panorama, FLAGS_end_panorama, [&](const int p) {
+    AlignPanorama(file_io, p, kDepthPhiRange, num_threads_per_panorama, display);
+  }, num_concurrent_panoramas);
 
   return 0;
 }
@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "../../base/parallel.h"
+#include "depth_splatter.h"
+
+using namespace Eigen;
+using namespace std;
+
+namespace structured_indoor_modeling {
+
+namespace {
+
+// Points are split into at most kMaxNumChunks contiguous chunks, each
+// with its own buffer. Small clouds are not worth a per-chunk buffer.
+const int kMinPointsPerChunk = 1 << 16;
+const int kMaxNumChunks = 16;
+// Points projected at a time, before they are splatted.
+const int kBatchSize = 256;
+// Rows merged by one task when chunk buffers are combined.
+const int kRowsPerTile = 16;
+
+// Depends only on the point count, so that results do not depend on
+// the number of threads.
+int GetNumChunks(const int num_points) {
+  return max(1, min(kMaxNumChunks, num_points / kMinPointsPerChunk));
+}
+
+// Projects points [begin, end) to sub-pixel coordinates and distances.
+void ProjectBatch(const CylindricalTarget& target,
+                  const std::vector<float>& positions,
+                  const int begin,
+                  const int end,
+                  double* us,
+                  double* vs,
+                  double* distances) {
+  const Matrix<double, 3, 4>& m = target.to_local;
+  const double half_height = target.height / 2.0;
+  for (int p = begin; p < end; ++p) {
+    const double x = positions[3 * p];
+    const double y = positions[3 * p + 1];
+    const double z = positions[3 * p + 2];
+    const double local_x = m(0, 0) * x + m(0, 1) * y + m(0, 2) * z + m(0, 3);
+    const double local_y = m(1, 0) * x + m(1, 1) * y + m(1, 2) * z + m(1, 3);
+    const double local_z = m(2, 0) * x + m(2, 1) * y + m(2, 2) * z + m(2, 3);
+
+    double theta = -atan2(local_y, local_x);
+    if (theta < 0.0)
+      theta += 2 * M_PI;
+    double theta_ratio = max(0.0, min(1.0, theta / (2 * M_PI)));
+    if (theta_ratio == 1.0)
+      theta_ratio = 0.0;
+
+    const double horizontal = sqrt(local_x * local_x + local_y * local_y);
+    const double phi = atan2(local_z, horizontal);
+
+    const int i = p - begin;
+    us[i] = theta_ratio * target.width;
+    vs[i] = max(0.0, min(target.max_y, half_height - phi / target.phi_per_pixel));
+    distances[i] = sqrt(horizontal * horizontal + local_z * local_z);
+  }
+}
+
+// Calls function(chunk, point, u, v, distance) for every point. Chunks
+// are contiguous, fixed ranges of points, so that chunk buffers merged
+// in order give the same results for any num_threads.
+template <typename Function>
+void ForEachProjectedPoint(const CylindricalTarget& target,
+                           const std::vector<float>& positions,
+                           const int num_chunks,
+                           const int num_threads,
+                           const Function& function) {
+  const int num_points = positions.size() / 3;
+  ParallelFor(0, num_chunks, [&](const int chunk) {
+    const int begin = static_cast<long long>(num_points) * chunk / num_chunks;
+    const int end = static_cast<long long>(num_points) * (chunk + 1) / num_chunks;
+    double us[kBatchSize], vs[kBatchSize], distances[kBatchSize];
+    for (int batch = begin; batch < end; batch += kBatchSize) {
+      const int batch_end = min(end, batch + kBatchSize);
+      ProjectBatch(target, positions, batch, batch_end, us, vs, distances);
+      for (int p = batch; p < batch_end; ++p)
+        function(chunk, p, us[p - batch], vs[p - batch], distances[p - batch]);
+    }
+  }, num_threads);
+}
+
+// Calls function(begin, end) for pixel ranges of kRowsPerTile rows.
+template <typename Function>
+void ForEachRowTile(const CylindricalTarget& target,
+                    const int num_threads,
+                    const Function& function) {
+  const int num_tiles = (target.height + kRowsPerTile - 1) / kRowsPerTile;
+  ParallelFor(0, num_tiles, [&](const int tile) {
+    const int begin = tile * kRowsPerTile * target.width;
+    const int end = min(target.height, (tile + 1) * kRowsPerTile) * target.width;
+    function(begin, end);
+  }, num_threads);
+}
+
+}  // namespace
+
+void SplatDepthsBilinear(const CylindricalTarget& target,
+                         const std::vector<float>& positions,
+                         const double invalid,
+                         const int num_threads,
+                         std::vector<double>* depths) {
+  const int width = target.width;
+  const int height = target.height;
+  const int num_chunks = GetNumChunks(positions.size() / 3);
+
+  // Per chunk, the weighted sum of distances and the sum of weights.
+  vector<vector<double> > sums(num_chunks), weights(num_chunks);
+  ForEachProjectedPoint(target, positions, num_chunks, num_threads,
+                        [&](const int chunk, const int /* point */,
+                            const double dx, const double dy, const double distance) {
+    vector<double>& sum = sums[chunk];
+    vector<double>& weight_sum = weights[chunk];
+    if (sum.empty()) {
+      sum.assign(width * height, 0.0);
+      weight_sum.assign(width * height, 0.0);
+    }
+
+    int xs[2], ys[2];
+    xs[0] = static_cast<int>(floor(dx));
+    xs[1] = xs[0] + 1;
+    ys[0] = static_cast<int>(floor(dy));
+    ys[1] = ys[0] + 1;
+    for (int j = 0; j < 2; ++j) {
+      if (ys[j] < 0 || height <= ys[j])
+        continue;
+      for (int i = 0; i < 2; ++i) {
+        if (xs[i] < 0 || width <= xs[i])
+          continue;
+        const double weight = fabs(xs[1 - i] - dx) * fabs(ys[1 - j] - dy);
+        const int index = ys[j] * width + xs[i];
+        sum[index] += weight * distance;
+        weight_sum[index] += weight;
+      }
+    }
+  });
+
+  depths->assign(width * height, invalid);
+  ForEachRowTile(target, num_threads, [&](const int begin, const int end) {
+    for (int index = begin; index < end; ++index) {
+      double sum = 0.0, weight_sum = 0.0;
+      for (int c = 0; c < num_chunks; ++c) {
+        if (sums[c].empty())
+          continue;
+        sum += sums[c][index];
+        weight_sum += weights[c][index];
+      }
+      if (weight_sum != 0.0)
+        depths->at(index) = sum / weight_sum;
+    }
+  });
+}
+
+void SplatDepthsNearest(const CylindricalTarget& target,
+                        const std::vector<float>& positions,
+                        const int num_threads,
+                        std::vector<int>* indexes,
+                        std::vector<double>* depths) {
+  const int width = target.width;
+  const int height = target.height;
+  const int num_chunks = GetNumChunks(positions.size() / 3);
+
+  // Per chunk z-buffers. Ties go to the earlier point.
+  vector<vector<int> > chunk_indexes(num_chunks);
+  vector<vector<double> > chunk_depths(num_chunks);
+  ForEachProjectedPoint(target, positions, num_chunks, num_threads,
+                        [&](const int chunk, const int point,
+                            const double u, const double v, const double distance) {
+    vector<int>& z_indexes = chunk_indexes[chunk];
+    vector<double>& z_depths = chunk_depths[chunk];
+    if (z_indexes.empty()) {
+      z_indexes.assign(width * height, -1);
+      z_depths.assign(width * height, numeric_limits<double>::max());
+    }
+
+    int x = static_cast<int>(round(u));
+    if (x >= width)
+      x -= width;
+    const int y = max(0, min(height - 1, static_cast<int>(round(v))));
+    const int index = y * width + x;
+    if (distance < z_depths[index]) {
+      z_depths[index] = distance;
+      z_indexes[index] = point;
+    }
+  });
+
+  indexes->assign(width * height, -1);
+  depths->assign(width * height, 0.0);
+  ForEachRowTile(target, num_threads, [&](const int begin, const int end) {
+    for (int index = begin; index < end; ++index) {
+      for (int c = 0; c < num_chunks; ++c) {
+        if (chunk_indexes[c].empty() || chunk_indexes[c][index] == -1)
+          continue;
+        if (indexes->at(index) == -1 || chunk_depths[c][index] < depths->at(index)) {
+          indexes->at(index) = chunk_indexes[c][index];
+          depths->at(index) = chunk_depths[c][index];
+        }
+      }
+    }
+  });
+}
+
+}  // namespace structured_indoor_modeling
@@ -0,0 +1,40 @@
+#ifndef DEPTH_SPLATTER_H__
+#define DEPTH_SPLATTER_H__
+
+#include <Eigen/Dense>
+#include <vector>
+
+namespace structured_indoor_modeling {
+
+// A width x height cylindrical raster, projected as Panorama::Project
+// does. to_local maps input points to the local frame of the panorama
+// and must be rigid, as distances are measured from its origin.
+struct CylindricalTarget {
+  Eigen::Matrix<double, 3, 4> to_local;
+  int width;
+  int height;
+  double phi_per_pixel;
+  // Projected rows are clamped to [0, max_y].
+  double max_y;
+};
+
+// Bilinearly splats point distances and stores their weighted average
+// per pixel, or invalid where no point lands. positions holds x, y, z
+// triples, e.g., ColumnarPointCloud::GetPositionData().
+void SplatDepthsBilinear(const CylindricalTarget& target,
+                         const std::vector<float>& positions,
+                         const double invalid,
+                         const int num_threads,
+                         std::vector<double>* depths);
+
+// Z-buffered splatting into the nearest pixel. indexes holds the closest
+// point per pixel (-1 if none), and depths its distance.
+void SplatDepthsNearest(const CylindricalTarget& target,
+                        const std::vector<float>& positions,
+                        const int num_threads,
+                        std::vector<int>* indexes,
+                        std::vector<double>* depths);
+
+}  // namespace structured_indoor_modeling
+
+#endif  // DEPTH_SPLATTER_H__
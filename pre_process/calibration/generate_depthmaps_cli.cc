@@ -1,8 +1,8 @@
 #include <Eigen/Dense>
-#include <Eigen/Sparse>
 #include <opencv2/opencv.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include <atomic>
 #include <iostream>
 #include <fstream>
 #include <limits>
@@ -11,63 +11,36 @@
 #include <gflags/gflags.h>
 
 #include "../../base/panorama.h"
+#include "../../base/parallel.h"
 #include "../../base/point_cloud.h"
+#include "depth_splatter.h"
+#include "grid_poisson.h"
 
 using namespace Eigen;
 using namespace std;
 using namespace structured_indoor_modeling;
 
 DEFINE_int32(depthmap_shrink_ratio, 8, "8 times smaller.");
+DEFINE_string(depth_format, "ascii",
+              "Depth file format: ascii, float, or half (lossy, see WriteDepthPanorama).");
+DEFINE_int32(num_threads, 0, "Total number of threads shared by all the panoramas (0 uses all the cores).");
+DEFINE_int32(num_concurrent_panoramas, 0,
+             "Number of panoramas processed at the same time (0 uses one per thread).");
 
 void SmoothField(const int width,
                  const int height,
                  const double hole,
                  std::vector<double>* field) {
   const double kDataWeight = 4.0;
-  SparseMatrix<double> A(width * height, width * height);
-  VectorXd b(width * height);
-
-  vector<Eigen::Triplet<double> > triplets;
-  
-  int index = 0;
-  for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x, ++index) {
-      int count = 0;
-      if (x != 0) {
-        triplets.push_back(Eigen::Triplet<double>(index, index - 1, -1));
-        ++count;
-      }
-      if (x != width - 1) {
-        triplets.push_back(Eigen::Triplet<double>(index, index + 1, -1));
-        ++count;
-      }
-      if (y != 0) {
-        triplets.push_back(Eigen::Triplet<double>(index, index - width, -1));
-        ++count;
-      }
-      if (y != height - 1) {
-        triplets.push_back(Eigen::Triplet<double>(index, index + width, -1));
-        ++count;
-      }
-
-      if (field->at(index) == hole) {
-        triplets.push_back(Eigen::Triplet<double>(index, index, count));
-        b[index] = 0;
-      } else {
-        triplets.push_back(Eigen::Triplet<double>(index, index, kDataWeight + count));
-        b[index] = kDataWeight * field->at(index);
-      }
-    }
-  }
-  A.setFromTriplets(triplets.begin(), triplets.end());
-  
-  SimplicialCholesky<SparseMatrix<double> > chol(A);
-  VectorXd x = chol.solve(b);
-
-  for (int i = 0; i < (int)field->size(); ++i) {
-    field->at(i) = x[i];
-  }
-}  
+  vector<double> weights(field->size());
+  for (int i = 0; i < (int)field->size(); ++i)
+    weights[i] = (field->at(i) == hole) ? 0.0 : kDataWeight;
+
+  vector<double> x;
+  if (!SolveGridPoisson(width, height, weights, *field, 1.0, 0.0, &x))
+    return;
+  field->swap(x);
+}
 
 void WriteDepthmapData(const FileIO& file_io,
                        const int panorama,
@@ -90,18 +63,8 @@ void WriteDepthmapData(const FileIO& file_io,
     }
   }
   
-  {
-    ofstream ofstr;
-    ofstr.precision(5);
-    ofstr.open(file_io.GetDepthPanorama(panorama));
-    ofstr << "Depth" << endl
-          << depth_width << ' ' << depth_height << endl
-          << min_distance << ' ' << max_distance << endl;
-    for (const auto value : depthmap) {
-      ofstr << value << ' ';
-    }
-    ofstr.close();
-  }
+  WriteDepthPanorama(file_io.GetDepthPanorama(panorama), depth_width, depth_height,
+                     depthmap, DepthPanoramaFormatFromName(FLAGS_depth_format));
   {
     cv::Mat depth_image(depth_height, depth_width, CV_8UC3);
     int index = 0;
@@ -137,86 +100,53 @@ int main(int argc, char* argv[]) {
   vector<Panorama> panoramas;
   ReadPanoramasWithoutDepths(file_io, &panoramas);
 
-  vector<PointCloud> point_clouds;
-  ReadPointClouds(file_io, &point_clouds);
-
-  if (panoramas.size() != point_clouds.size()) {
-    cerr << "Impossible: " << panoramas.size() << ' ' << point_clouds.size() << endl;
-    exit (1);
-  }
-  
-  for (int p = 0; p < (int)panoramas.size(); ++p) {
+  // The thread budget is split between panoramas processed concurrently
+  // and the threads each one splats its points with.
+  const int num_panoramas = panoramas.size();
+  const int num_threads =
+    FLAGS_num_threads > 0 ? FLAGS_num_threads : GetDefaultNumThreads();
+  const int num_concurrent_panoramas =
+    max(1, min(num_panoramas,
+               FLAGS_num_concurrent_panoramas > 0 ? FLAGS_num_concurrent_panoramas : num_threads));
+  const int num_threads_per_panorama = max(1, num_threads / num_concurrent_panoramas);
+
+  // Workers must not exit while others are writing, so a failure is
+  // recorded and reported after all of them join.
+  atomic<bool> failed(false);
+  ParallelFor(0, num_panoramas, [&](const int p) {
     const Panorama& panorama = panoramas[p];
-    const PointCloud& point_cloud = point_clouds[p];    
+    // Only positions are used, so each cloud is read in columns.
+    ColumnarPointCloud point_cloud;
+    if (!point_cloud.Init(file_io, p)) {
+      cerr << "Cannot read a point cloud: " << p << endl;
+      failed = true;
+      return;
+    }
+    point_cloud.ToGlobal(file_io, p);
     const int depth_width =
       panorama.Width() / FLAGS_depthmap_shrink_ratio;
     const int depth_height =
       panorama.Height() / FLAGS_depthmap_shrink_ratio;
 
-    /*
-    const double kInvalid = -1.0;
-    vector<double> depthmap(depth_width * depth_height, kInvalid);
-
-    for (int q = 0; q < point_cloud.GetNumPoints(); ++q) {
-      const Point& point = point_cloud.GetPoint(q);
-      const Vector2d pixel = panorama.Project(point.position);
-      const int x = static_cast<int>(round(pixel[0] * depth_width / panorama.Width()));
-      const int y = static_cast<int>(round(pixel[1] * depth_height / panorama.Height()));
-
-      if (0 <= x && x < depth_width && 0 <= y && y < depth_height) {
-        const double distance = (panorama.GetCenter() - point.position).norm();
-        const int index = y * depth_width + x;
-        if (depthmap[index] == kInvalid ||
-            distance < depthmap[index]) {
-          depthmap[index] = distance;
-        }
-      }
-    }
-    */
-
-    const pair<double, double> kInvalidPair(0.0, 0.0);
-    vector<pair<double, double> > depthmap_pair(depth_width * depth_height, kInvalidPair);
-    for (int q = 0; q < point_cloud.GetNumPoints(); ++q) {
-      const Point& point = point_cloud.GetPoint(q);
-      const Vector2d pixel = panorama.Project(point.position);
-      const double dx = pixel[0] * depth_width / panorama.Width();
-      const double dy = pixel[1] * depth_height / panorama.Height();
-
-      int xs[2], ys[2];
-      xs[0] = static_cast<int>(floor(dx));
-      xs[1] = xs[0] + 1;
-      ys[0] = static_cast<int>(floor(dy));
-      ys[1] = ys[0] + 1;
-      
-      const double distance = (panorama.GetCenter() - point.position).norm();
-      for (int j = 0; j < 2; ++j) {
-        if (ys[j] < 0 || depth_height <= ys[j])
-          continue;
-        for (int i = 0; i < 2; ++i) {
-          if (xs[i] < 0 || depth_width <= xs[i])
-            continue;
-
-          const double weight = fabs(xs[1 - i] - dx) * fabs(ys[1 - j] - dy);
-          const int index = ys[j] * depth_width + xs[i];
-          depthmap_pair[index].first += weight * distance;
-          depthmap_pair[index].second += weight;
-        }
-      }
-    }
+    // Same projection as Panorama::Project, in depth pixels.
+    CylindricalTarget target;
+    target.to_local = panorama.GetGlobalToLocal().topRows<3>();
+    target.width = depth_width;
+    target.height = depth_height;
+    target.phi_per_pixel = panorama.GetPhiPerPixel() * panorama.Height() / depth_height;
+    target.max_y = (panorama.Height() - 1.1) * depth_height / panorama.Height();
 
     const double kInvalid = -1.0;
-    vector<double> depthmap(depth_width * depth_height, kInvalid);
-    for (int i = 0; i < (int)depthmap_pair.size(); ++i) {
-      if (depthmap_pair[i].second != 0.0) {
-        depthmap[i] = depthmap_pair[i].first / depthmap_pair[i].second;
-      }
-    }
-    
+    vector<double> depthmap;
+    SplatDepthsBilinear(target, point_cloud.GetPositionData(), kInvalid, num_threads_per_panorama, &depthmap);
+
     // Laplacian smoothing.
     SmoothField(depth_width, depth_height, kInvalid, &depthmap);
 
     WriteDepthmapData(file_io, p, depth_width, depth_height, depthmap);
-  }
-  
+  }, num_concurrent_panoramas);
+
+  if (failed)
+    exit (1);
   return 0;
 }
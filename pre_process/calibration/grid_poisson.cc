@@ -0,0 +1,383 @@
+#include <algorithm>
+#include <cmath>
+#include <Eigen/Dense>
+#include "grid_poisson.h"
+
+using namespace std;
+
+namespace structured_indoor_modeling {
+
+namespace {
+
+// Levels with at most this many cells are solved densely.
+const int kMaxCoarsestCells = 512;
+const int kNumSmoothingSteps = 3;
+const int kMaxIterations = 1000;
+const double kTolerance = 1e-8;
+
+// The operator W + smoothness * L + bending * L M^{-1} L on one level.
+// On the finest level every edge has weight 1 and M is the identity.
+// A coarse cell aggregates a 2x2 block of fine cells: its data weight and
+// size (M) are the sums over the block, and the weight of a coarse edge is
+// half the sum of the fine edges that cross it, which roughly matches the
+// Galerkin product under the bilinear transfer operators below.
+struct GridLevel {
+  int width;
+  int height;
+  vector<double> weights;
+  // Weight of the edge between (x, y) and (x + 1, y).
+  vector<double> horizontal;
+  // Weight of the edge between (x, y) and (x, y + 1).
+  vector<double> vertical;
+  vector<double> sizes;
+  vector<double> diagonal;
+  // Damping factor of the Jacobi smoother.
+  double omega;
+
+  // Dense factorization on the coarsest level.
+  Eigen::LDLT<Eigen::MatrixXd> coarsest;
+};
+
+void ApplyLaplacian(const GridLevel& level, const vector<double>& x, vector<double>* y) {
+  const int width = level.width;
+  y->assign(x.size(), 0.0);
+  int index = 0;
+  for (int j = 0; j < level.height; ++j) {
+    for (int i = 0; i < width; ++i, ++index) {
+      if (i != width - 1) {
+        const double flow = level.horizontal[index] * (x[index] - x[index + 1]);
+        (*y)[index] += flow;
+        (*y)[index + 1] -= flow;
+      }
+      if (j != level.height - 1) {
+        const double flow = level.vertical[index] * (x[index] - x[index + width]);
+        (*y)[index] += flow;
+        (*y)[index + width] -= flow;
+      }
+    }
+  }
+}
+
+void Apply(const GridLevel& level,
+           const double smoothness,
+           const double bending,
+           const vector<double>& x,
+           vector<double>* y,
+           vector<double>* buffer0,
+           vector<double>* buffer1) {
+  ApplyLaplacian(level, x, buffer0);
+  if (bending != 0.0) {
+    for (int i = 0; i < (int)x.size(); ++i)
+      (*buffer1)[i] = (*buffer0)[i] / level.sizes[i];
+    ApplyLaplacian(level, *buffer1, y);
+  } else {
+    y->assign(x.size(), 0.0);
+  }
+  for (int i = 0; i < (int)x.size(); ++i)
+    (*y)[i] = level.weights[i] * x[i] + smoothness * (*buffer0)[i] + bending * (*y)[i];
+}
+
+void SetDiagonal(const double smoothness, const double bending, GridLevel* level) {
+  const int width = level->width;
+  const int num_cells = width * level->height;
+  vector<double> degrees(num_cells, 0.0);
+  int index = 0;
+  for (int j = 0; j < level->height; ++j) {
+    for (int i = 0; i < width; ++i, ++index) {
+      if (i != width - 1) {
+        degrees[index] += level->horizontal[index];
+        degrees[index + 1] += level->horizontal[index];
+      }
+      if (j != level->height - 1) {
+        degrees[index] += level->vertical[index];
+        degrees[index + width] += level->vertical[index];
+      }
+    }
+  }
+
+  // Diagonal of L M^{-1} L is sum_j L_ji^2 / M_j.
+  level->diagonal.resize(num_cells);
+  for (int c = 0; c < num_cells; ++c)
+    level->diagonal[c] = degrees[c] * degrees[c] / level->sizes[c];
+  index = 0;
+  for (int j = 0; j < level->height; ++j) {
+    for (int i = 0; i < width; ++i, ++index) {
+      if (i != width - 1) {
+        const double squared = level->horizontal[index] * level->horizontal[index];
+        level->diagonal[index] += squared / level->sizes[index + 1];
+        level->diagonal[index + 1] += squared / level->sizes[index];
+      }
+      if (j != level->height - 1) {
+        const double squared = level->vertical[index] * level->vertical[index];
+        level->diagonal[index] += squared / level->sizes[index + width];
+        level->diagonal[index + width] += squared / level->sizes[index];
+      }
+    }
+  }
+  for (int c = 0; c < num_cells; ++c) {
+    level->diagonal[c] =
+      level->weights[c] + smoothness * degrees[c] + bending * level->diagonal[c];
+    // Only possible for an isolated cell without data.
+    if (level->diagonal[c] == 0.0)
+      level->diagonal[c] = 1.0;
+  }
+}
+
+void Coarsen(const GridLevel& fine, GridLevel* coarse) {
+  coarse->width  = (fine.width + 1) / 2;
+  coarse->height = (fine.height + 1) / 2;
+  const int num_cells = coarse->width * coarse->height;
+  coarse->weights.assign(num_cells, 0.0);
+  coarse->horizontal.assign(num_cells, 0.0);
+  coarse->vertical.assign(num_cells, 0.0);
+  coarse->sizes.assign(num_cells, 0.0);
+
+  int index = 0;
+  for (int j = 0; j < fine.height; ++j) {
+    for (int i = 0; i < fine.width; ++i, ++index) {
+      const int parent = (j / 2) * coarse->width + i / 2;
+      coarse->weights[parent] += fine.weights[index];
+      coarse->sizes[parent] += fine.sizes[index];
+      // Edges inside a block disappear.
+      if (i % 2 == 1 && i != fine.width - 1)
+        coarse->horizontal[parent] += 0.5 * fine.horizontal[index];
+      if (j % 2 == 1 && j != fine.height - 1)
+        coarse->vertical[parent] += 0.5 * fine.vertical[index];
+    }
+  }
+}
+
+// Largest eigenvalue of D^{-1} A by power iteration.
+double EstimateMaxEigenvalue(const GridLevel& level, const double smoothness, const double bending) {
+  const int num_cells = level.width * level.height;
+  vector<double> x(num_cells), y(num_cells), buffer0(num_cells), buffer1(num_cells);
+  for (int c = 0; c < num_cells; ++c)
+    x[c] = 1.0 + (c * 7919 % 101) / 101.0;
+
+  const int kNumIterations = 15;
+  double eigenvalue = 1.0;
+  for (int iteration = 0; iteration < kNumIterations; ++iteration) {
+    double norm = 0.0;
+    for (const auto value : x)
+      norm += value * value;
+    norm = sqrt(norm);
+    if (norm == 0.0)
+      break;
+    for (auto& value : x)
+      value /= norm;
+
+    Apply(level, smoothness, bending, x, &y, &buffer0, &buffer1);
+    eigenvalue = 0.0;
+    for (int c = 0; c < num_cells; ++c) {
+      y[c] /= level.diagonal[c];
+      eigenvalue += x[c] * y[c];
+    }
+    x.swap(y);
+  }
+  return eigenvalue;
+}
+
+void FactorizeCoarsest(const double smoothness, const double bending, GridLevel* level) {
+  const int num_cells = level->width * level->height;
+  Eigen::MatrixXd matrix(num_cells, num_cells);
+  vector<double> unit(num_cells, 0.0), column(num_cells), buffer0(num_cells), buffer1(num_cells);
+  for (int c = 0; c < num_cells; ++c) {
+    unit[c] = 1.0;
+    Apply(*level, smoothness, bending, unit, &column, &buffer0, &buffer1);
+    unit[c] = 0.0;
+    for (int r = 0; r < num_cells; ++r)
+      matrix(r, c) = column[r];
+  }
+  level->coarsest.compute(matrix);
+}
+
+// Cell-centered bilinear interpolation from the coarse grid. Fine cell i
+// lies at 3/4 from its parent i / 2 and 1/4 from the next parent over.
+void GetInterpolation(const int i, const int coarse_size, int* parents, double* weights) {
+  const int parent = i / 2;
+  const int other = i % 2 == 0 ? parent - 1 : parent + 1;
+  parents[0] = parent;
+  parents[1] = max(0, min(coarse_size - 1, other));
+  weights[0] = 0.75;
+  weights[1] = 0.25;
+}
+
+void Prolongate(const GridLevel& fine, const GridLevel& coarse,
+                const vector<double>& coarse_x, vector<double>* x) {
+  int index = 0;
+  for (int j = 0; j < fine.height; ++j) {
+    int ys[2];
+    double wys[2];
+    GetInterpolation(j, coarse.height, ys, wys);
+    for (int i = 0; i < fine.width; ++i, ++index) {
+      int xs[2];
+      double wxs[2];
+      GetInterpolation(i, coarse.width, xs, wxs);
+      for (int b = 0; b < 2; ++b)
+        for (int a = 0; a < 2; ++a)
+          (*x)[index] += wys[b] * wxs[a] * coarse_x[ys[b] * coarse.width + xs[a]];
+    }
+  }
+}
+
+void Restrict(const GridLevel& fine, const GridLevel& coarse,
+              const vector<double>& residual, vector<double>* coarse_b) {
+  coarse_b->assign(coarse.width * coarse.height, 0.0);
+  int index = 0;
+  for (int j = 0; j < fine.height; ++j) {
+    int ys[2];
+    double wys[2];
+    GetInterpolation(j, coarse.height, ys, wys);
+    for (int i = 0; i < fine.width; ++i, ++index) {
+      int xs[2];
+      double wxs[2];
+      GetInterpolation(i, coarse.width, xs, wxs);
+      for (int b = 0; b < 2; ++b)
+        for (int a = 0; a < 2; ++a)
+          (*coarse_b)[ys[b] * coarse.width + xs[a]] += wys[b] * wxs[a] * residual[index];
+    }
+  }
+}
+
+// Approximately solves A x = b on level l with x starting from 0.
+void VCycle(const vector<GridLevel>& levels,
+            const int l,
+            const double smoothness,
+            const double bending,
+            const vector<double>& b,
+            vector<double>* x) {
+  const GridLevel& level = levels[l];
+  const int num_cells = level.width * level.height;
+  if (l == (int)levels.size() - 1) {
+    const Eigen::VectorXd solution =
+      level.coarsest.solve(Eigen::Map<const Eigen::VectorXd>(&b[0], num_cells));
+    x->assign(solution.data(), solution.data() + num_cells);
+    return;
+  }
+
+  vector<double> ax(num_cells), buffer0(num_cells), buffer1(num_cells);
+  x->assign(num_cells, 0.0);
+  auto smooth = [&]() {
+    Apply(level, smoothness, bending, *x, &ax, &buffer0, &buffer1);
+    for (int c = 0; c < num_cells; ++c)
+      (*x)[c] += level.omega * (b[c] - ax[c]) / level.diagonal[c];
+  };
+
+  for (int s = 0; s < kNumSmoothingSteps; ++s)
+    smooth();
+
+  // Restrict the residual, correct, and prolongate.
+  const GridLevel& coarse = levels[l + 1];
+  Apply(level, smoothness, bending, *x, &ax, &buffer0, &buffer1);
+  vector<double> residual(num_cells);
+  for (int c = 0; c < num_cells; ++c)
+    residual[c] = b[c] - ax[c];
+  vector<double> coarse_b;
+  Restrict(level, coarse, residual, &coarse_b);
+  vector<double> coarse_x;
+  VCycle(levels, l + 1, smoothness, bending, coarse_b, &coarse_x);
+  Prolongate(level, coarse, coarse_x, x);
+
+  for (int s = 0; s < kNumSmoothingSteps; ++s)
+    smooth();
+}
+
+double Dot(const vector<double>& lhs, const vector<double>& rhs) {
+  double sum = 0.0;
+  for (int i = 0; i < (int)lhs.size(); ++i)
+    sum += lhs[i] * rhs[i];
+  return sum;
+}
+
+}  // namespace
+
+bool SolveGridPoisson(const int width,
+                      const int height,
+                      const std::vector<double>& data_weights,
+                      const std::vector<double>& data,
+                      const double smoothness,
+                      const double bending,
+                      std::vector<double>* solution) {
+  const int num_cells = width * height;
+  double total_weight = 0.0;
+  double average = 0.0;
+  for (int c = 0; c < num_cells; ++c) {
+    total_weight += data_weights[c];
+    average += data_weights[c] * data[c];
+  }
+  if (total_weight <= 0.0)
+    return false;
+  average /= total_weight;
+
+  // Multigrid hierarchy.
+  vector<GridLevel> levels(1);
+  {
+    GridLevel& finest = levels[0];
+    finest.width  = width;
+    finest.height = height;
+    finest.weights = data_weights;
+    finest.horizontal.assign(num_cells, 1.0);
+    finest.vertical.assign(num_cells, 1.0);
+    finest.sizes.assign(num_cells, 1.0);
+  }
+  while (levels.back().width * levels.back().height > kMaxCoarsestCells &&
+         (levels.back().width > 1 || levels.back().height > 1)) {
+    GridLevel coarse;
+    Coarsen(levels.back(), &coarse);
+    levels.push_back(coarse);
+  }
+  for (int l = 0; l < (int)levels.size(); ++l) {
+    SetDiagonal(smoothness, bending, &levels[l]);
+    if (l == (int)levels.size() - 1) {
+      FactorizeCoarsest(smoothness, bending, &levels[l]);
+    } else {
+      const double kSafety = 1.1;
+      levels[l].omega = 4.0 / (3.0 * kSafety * EstimateMaxEigenvalue(levels[l], smoothness, bending));
+    }
+  }
+
+  // Initial guess.
+  vector<double>& x = *solution;
+  if ((int)x.size() != num_cells) {
+    x.resize(num_cells);
+    for (int c = 0; c < num_cells; ++c)
+      x[c] = data_weights[c] > 0.0 ? data[c] : average;
+  }
+
+  vector<double> b(num_cells);
+  for (int c = 0; c < num_cells; ++c)
+    b[c] = data_weights[c] * data[c];
+  const double b_norm = sqrt(Dot(b, b));
+
+  // Preconditioned conjugate gradients.
+  vector<double> r(num_cells), z, p, ap(num_cells), buffer0(num_cells), buffer1(num_cells);
+  Apply(levels[0], smoothness, bending, x, &ap, &buffer0, &buffer1);
+  for (int c = 0; c < num_cells; ++c)
+    r[c] = b[c] - ap[c];
+  VCycle(levels, 0, smoothness, bending, r, &z);
+  p = z;
+  double rz = Dot(r, z);
+  for (int iteration = 0; iteration < kMaxIterations; ++iteration) {
+    if (sqrt(Dot(r, r)) <= kTolerance * b_norm)
+      break;
+    Apply(levels[0], smoothness, bending, p, &ap, &buffer0, &buffer1);
+    const double pap = Dot(p, ap);
+    if (pap <= 0.0)
+      break;
+    const double alpha = rz / pap;
+    for (int c = 0; c < num_cells; ++c) {
+      x[c] += alpha * p[c];
+      r[c] -= alpha * ap[c];
+    }
+    VCycle(levels, 0, smoothness, bending, r, &z);
+    const double new_rz = Dot(r, z);
+    const double beta = new_rz / rz;
+    rz = new_rz;
+    for (int c = 0; c < num_cells; ++c)
+      p[c] = z[c] + beta * p[c];
+  }
+
+  return true;
+}
+
+}  // namespace structured_indoor_modeling
@@ -0,0 +1,30 @@
+#ifndef GRID_POISSON_H__
+#define GRID_POISSON_H__
+
+#include <vector>
+
+namespace structured_indoor_modeling {
+
+// Smooths (and fills holes of) a width x height field by solving
+//
+//   (W + smoothness * L + bending * L L) x = W f
+//
+// where f is data, W is the diagonal matrix of data_weights (0 at holes)
+// and L is the 5-point graph Laplacian with free boundaries. The system
+// is solved by conjugate gradients preconditioned with a multigrid
+// V-cycle. The operator is applied as a stencil and never stored, so
+// memory is linear in the number of pixels.
+//
+// solution is used as the initial guess if it has the right size.
+// Returns false if no pixel has a positive data weight.
+bool SolveGridPoisson(const int width,
+                      const int height,
+                      const std::vector<double>& data_weights,
+                      const std::vector<double>& data,
+                      const double smoothness,
+                      const double bending,
+                      std::vector<double>* solution);
+
+}  // namespace structured_indoor_modeling
+
+#endif  // GRID_POISSON_H__
@@ -3,6 +3,9 @@
 #include <iostream>
 #include <vector>
 #include "../../base/file_io.h"
+#include "../../base/parallel.h"
+#include "../../base/point_cloud.h"
+#include "depth_splatter.h"
 #include "transformation.h"
 
 using namespace Eigen;
@@ -22,42 +25,33 @@ struct DepthPoint {
 };
 
 
+// Local plys may be in any format that PointCloud reads.
 void ReadPly(const string filename,
              int* depth_width,
              int* depth_height,
              vector<DepthPoint>* depth_points) {
-  ifstream ifstr;
-  ifstr.open(filename.c_str());
-  if (!ifstr.is_open()) {
+  PointCloud point_cloud;
+  if (!point_cloud.Init(filename)) {
     cerr << "ply file does not exist: " << filename << endl;
     exit (1);
   }
+  const int num_vertex = point_cloud.GetNumPoints();
 
-  string stmp;
-  for (int i = 0; i < 6; ++i)
-    ifstr >> stmp;
-  int num_vertex;
-  ifstr >> num_vertex;
-  for (int i = 0; i < 37; ++i)
-    ifstr >> stmp;
-    
-  const int kXOffset = 1;
-  const int kYOffset = 1;
-  
   int max_x = 0, max_y = 0;
 
   depth_points->resize(num_vertex);
   for (int i = 0; i < num_vertex; ++i) {
-    ifstr >> depth_points->at(i).y >> depth_points->at(i).x
-          >> depth_points->at(i).X >> depth_points->at(i).Y >> depth_points->at(i).Z
-          >> depth_points->at(i).red >> depth_points->at(i).green >> depth_points->at(i).blue;
-    
-    depth_points->at(i).x -= kXOffset;
-    depth_points->at(i).y -= kYOffset;
-    double dummy;
-    for (int j = 0; j < 4; ++j)
-      ifstr >> dummy;
-    
+    const Point& point = point_cloud.GetPoint(i);
+    // The first column (depth_position[1]) is y here.
+    depth_points->at(i).y = point.depth_position[1];
+    depth_points->at(i).x = point.depth_position[0];
+    depth_points->at(i).X = point.position[0];
+    depth_points->at(i).Y = point.position[1];
+    depth_points->at(i).Z = point.position[2];
+    depth_points->at(i).red = static_cast<int>(point.color[0]);
+    depth_points->at(i).green = static_cast<int>(point.color[1]);
+    depth_points->at(i).blue = static_cast<int>(point.color[2]);
+
     const double distance = sqrt(depth_points->at(i).X * depth_points->at(i).X +
                                  depth_points->at(i).Y * depth_points->at(i).Y +
                                  depth_points->at(i).Z * depth_points->at(i).Z);
@@ -71,30 +65,11 @@ void ReadPly(const string filename,
       max_y = max(depth_points->at(i).y, max_y);
     }
   }
-  ifstr.close();
 
   *depth_width = max_x + 1;
   *depth_height = max_y + 1;
 }
 
-Vector2d ProjectLocalToColor(const Vector3d& local_point,
-                             const vector<double>& params,
-                             const int color_width,
-                             const int color_height) {
-  const double color_phi_per_pixel = params[0] / color_height;
-  const Matrix3d rx = RotationX(params[1]);
-  const Matrix3d rz = RotationZ(params[2]);
-  const Matrix3d ry = RotationY(params[3]);
-  const Vector3d t(params[6], params[5], params[4]);
-  const Matrix3d r = ry * rz * rx;
-
-  Vector3d color_point = r * local_point + t;
-
-  Vector2d color_uv;
-  ConvertLocalToPanorama(color_width, color_height, color_phi_per_pixel, color_point, &color_uv);
-  return color_uv;
-}
-
 int main(int argc, char* argv[]) {
   if (argc < 4) {
     cerr << "Usage: " << argv[0] << " data_directory from_pano to_pano" << endl;
@@ -168,29 +143,47 @@ int main(int argc, char* argv[]) {
   const int kNumChannels = 3;
   vector<unsigned char> canvas(kWidth * kHeight * kNumChannels, 0);
 
-  cerr << "Render " << depth_points.size() << " points." << endl;
-  // For each point.
-  int count = 0;
+  // From the local frame of from_pano to the color camera of to_pano.
+  Matrix<double, 3, 4> from_local_to_color;
+  {
+    const Matrix3d rx = RotationX(params[1]);
+    const Matrix3d rz = RotationZ(params[2]);
+    const Matrix3d ry = RotationY(params[3]);
+    const Vector3d t(params[6], params[5], params[4]);
+    const Matrix3d r = ry * rz * rx;
+
+    const Matrix4d from_local_to_to_local = to_local_to_global.inverse() * from_local_to_global;
+    from_local_to_color.block<3, 3>(0, 0) = r * from_local_to_to_local.block<3, 3>(0, 0);
+    from_local_to_color.col(3) = r * from_local_to_to_local.block<3, 1>(0, 3) + t;
+  }
+
+  vector<float> positions;
+  positions.reserve(3 * depth_points.size());
   for (const auto& point : depth_points) {
-    if (count++ % 100 == 0)
-      cerr << count << ' ' << flush;
-
-    Vector4d from_local(point.X, point.Y, point.Z, 1.0);
-    Vector4d global = from_local_to_global * from_local;
-
-    Vector4d to_local = to_local_to_global.inverse() * global;  // ???
-    Vector2d uv = ProjectLocalToColor(Vector3d(to_local[0],
-                                               to_local[1],
-                                               to_local[2]),
-                                      params,
-                                      kWidth,
-                                      kHeight);
-    const int u = static_cast<int>(round(uv[0]));
-    const int v = max(0, min(kHeight - 1, static_cast<int>(round(uv[1]))));
-
-    canvas[3 * (v * kWidth + u) + 0] = point.red;
-    canvas[3 * (v * kWidth + u) + 1] = point.green;
-    canvas[3 * (v * kWidth + u) + 2] = point.blue;
+    positions.push_back(point.X);
+    positions.push_back(point.Y);
+    positions.push_back(point.Z);
+  }
+
+  CylindricalTarget target;
+  target.to_local = from_local_to_color;
+  target.width = kWidth;
+  target.height = kHeight;
+  target.phi_per_pixel = params[0] / kHeight;
+  target.max_y = kHeight - 1;
+
+  cerr << "Render " << depth_points.size() << " points." << endl;
+  // The closest point wins each pixel.
+  vector<int> indexes;
+  vector<double> distances;
+  SplatDepthsNearest(target, positions, GetDefaultNumThreads(), &indexes, &distances);
+  for (int p = 0; p < (int)indexes.size(); ++p) {
+    if (indexes[p] == -1)
+      continue;
+    const DepthPoint& point = depth_points[indexes[p]];
+    canvas[3 * p + 0] = point.red;
+    canvas[3 * p + 1] = point.green;
+    canvas[3 * p + 2] = point.blue;
   }
 
   ofstream ofstr;
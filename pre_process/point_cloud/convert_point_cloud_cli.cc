@@ -0,0 +1,120 @@
+/*
+  Rewrites the point clouds of a dataset in a binary format, so that
+  PointCloud::Init does not need to parse text. Files are converted in
+  place, as PointCloud::Init detects the format from the header. As the
+  originals are replaced, --format has no default and must be given.
+  Each file is written to a temporary file first and renamed over the
+  original only when complete.
+
+  < Example >
+  convert_point_cloud_cli data_directory --format=binary
+ */
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+#include "../../base/file_io.h"
+#include "../../base/floorplan.h"
+#include "../../base/point_cloud.h"
+
+#ifdef _WIN32
+#pragma comment (lib, "gflags.lib") 
+#pragma comment (lib, "Shlwapi.lib") 
+#endif
+
+DEFINE_string(format, "", "Output format (required, files are replaced): ascii, binary (little-endian ply), or native.");
+DEFINE_bool(convert_local_ply, true, "Convert input/ply/%03d.ply.");
+DEFINE_bool(convert_object_clouds, true, "Convert the per-room object point clouds.");
+
+using namespace std;
+using namespace structured_indoor_modeling;
+
+namespace {
+
+bool ConvertFile(const string& filename, const PointCloudFormat format) {
+  PointCloud point_cloud;
+  if (!point_cloud.Init(filename))
+    return false;
+  const string temporary = filename + ".converting";
+  point_cloud.Write(temporary, format);
+  if (rename(temporary.c_str(), filename.c_str()) != 0) {
+    cerr << "Cannot replace: " << filename << endl;
+    remove(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    cerr << "Usage: " << argv[0] << " data_directory --format=ascii|binary|native" << endl;
+    return 1;
+  }
+#ifdef __APPLE__
+  google::ParseCommandLineFlags(&argc, &argv, true);
+#else
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+#endif
+
+  PointCloudFormat format;
+  if (FLAGS_format == "ascii")
+    format = kAsciiPly;
+  else if (FLAGS_format == "binary")
+    format = kBinaryPly;
+  else if (FLAGS_format == "native")
+    format = kNativeBinary;
+  else if (FLAGS_format.empty()) {
+    cerr << "Specify --format. The point clouds are converted in place." << endl;
+    return 1;
+  } else {
+    cerr << "Unknown format: " << FLAGS_format << endl;
+    return 1;
+  }
+
+  FileIO file_io(argv[1]);
+
+  if (FLAGS_convert_local_ply) {
+    const int num_panoramas = GetNumPanoramas(file_io);
+    cout << "Converting local ply" << flush;
+    for (int p = 0; p < num_panoramas; ++p) {
+      cout << '.' << flush;
+      if (!ConvertFile(file_io.GetLocalPly(p), format))
+        cerr << "Cannot read: " << file_io.GetLocalPly(p) << endl;
+    }
+    cout << " done." << endl;
+  }
+
+  if (FLAGS_convert_object_clouds) {
+    Floorplan floorplan;
+    {
+      ifstream ifstr;
+      ifstr.open(file_io.GetFloorplan().c_str());
+      if (!ifstr.is_open()) {
+        cerr << "Cannot open a file: " << file_io.GetFloorplan() << endl;
+        return 1;
+      }
+      ifstr >> floorplan;
+      ifstr.close();
+    }
+
+    cout << "Converting object clouds" << flush;
+    for (int room = 0; room < floorplan.GetNumRooms(); ++room) {
+      cout << '.' << flush;
+      // Missing files are fine, as not every stage has been run.
+      ConvertFile(file_io.GetObjectPointClouds(room), format);
+      ConvertFile(file_io.GetObjectPointCloudsFinal(room), format);
+      ConvertFile(file_io.GetFloorWallPointClouds(room), format);
+      ConvertFile(file_io.GetRefinedObjectClouds(room), format);
+    }
+    cout << " done." << endl;
+  }
+
+  return 0;
+}
@@ -2,7 +2,9 @@
 #include <list>
 #include <opencv2/highgui/highgui.hpp>
 #include "ceres/ceres.h"
+#include "ceres/rotation.h"
 #include "stitch_panorama.h"
+#include "../../base/parallel.h"
 
 using cv::imread;
 using cv::imshow;
@@ -93,34 +95,36 @@ cv::Vec3b Interpolate(const cv::Mat& image, const Eigen::Vector2d& pixel) {
   return Vec3b(b, g, r);
 }
 
-Eigen::Vector3f InterpolateF(const cv::Mat& image, const Eigen::Vector2d& pixel) {
-  int x = (int)floor(pixel[0]);
-  int y = (int)floor(pixel[1]);
+// Value of a scalar or of a ceres::Jet, used where the computation
+// branches on or rounds a parameter-dependent value.
+inline double GetScalar(const double value) { return value; }
+
+template <typename T, int N>
+double GetScalar(const ceres::Jet<T, N>& value) { return value.a; }
+
+// Bilinear sampling. The weights carry the derivatives with respect to
+// the pixel position when T is a ceres::Jet.
+template <typename T>
+Eigen::Matrix<T, 3, 1> InterpolateF(const cv::Mat& image, const Eigen::Matrix<T, 2, 1>& pixel) {
+  int x = (int)floor(GetScalar(pixel[0]));
+  int y = (int)floor(GetScalar(pixel[1]));
 
   int x0 = cv::borderInterpolate(x,   image.cols, cv::BORDER_REFLECT_101);
   int x1 = cv::borderInterpolate(x+1, image.cols, cv::BORDER_REFLECT_101);
   int y0 = cv::borderInterpolate(y,   image.rows, cv::BORDER_REFLECT_101);
   int y1 = cv::borderInterpolate(y+1, image.rows, cv::BORDER_REFLECT_101);
 
-  float a = pixel[0] - (float)x;
-  float c = pixel[1] - (float)y;
+  const T a = pixel[0] - T(x);
+  const T c = pixel[1] - T(y);
 
-  Vector3f bgr;
-  bgr[0] =
-    (image.at<Vec3b>(y0, x0)[0] * (1.f - a) +
-     image.at<Vec3b>(y0, x1)[0] * a) * (1.f - c) +
-    (image.at<Vec3b>(y1, x0)[0] * (1.f - a) +
-     image.at<Vec3b>(y1, x1)[0] * a) * c;
-  bgr[1] =
-    (image.at<Vec3b>(y0, x0)[1] * (1.f - a) +
-     image.at<Vec3b>(y0, x1)[1] * a) * (1.f - c) +
-    (image.at<Vec3b>(y1, x0)[1] * (1.f - a) +
-     image.at<Vec3b>(y1, x1)[1] * a) * c;
-  bgr[2] =
-    (image.at<Vec3b>(y0, x0)[2] * (1.f - a) +
-     image.at<Vec3b>(y0, x1)[2] * a) * (1.f - c) +
-    (image.at<Vec3b>(y1, x0)[2] * (1.f - a) +
-     image.at<Vec3b>(y1, x1)[2] * a) * c;
+  Eigen::Matrix<T, 3, 1> bgr;
+  for (int i = 0; i < 3; ++i) {
+    bgr[i] =
+      (T(image.at<Vec3b>(y0, x0)[i]) * (T(1.0) - a) +
+       T(image.at<Vec3b>(y0, x1)[i]) * a) * (T(1.0) - c) +
+      (T(image.at<Vec3b>(y1, x0)[i]) * (T(1.0) - a) +
+       T(image.at<Vec3b>(y1, x1)[i]) * a) * c;
+  }
 
   return bgr;
 }
@@ -155,36 +159,41 @@ Eigen::Matrix3d RotationZ(const double radian) {
   return rotation;
 }
 
-double InverseNcc(std::vector<Vector3f>& patch0, std::vector<Vector3f>& patch1) {
+template <typename T>
+T InverseNcc(const std::vector<Eigen::Matrix<T, 3, 1> >& patch0,
+             const std::vector<Eigen::Matrix<T, 3, 1> >& patch1) {
   // Per channel intensity average.
-  Vector3f ave0(0, 0, 0);
+  Eigen::Matrix<T, 3, 1> ave0(T(0.0), T(0.0), T(0.0));
   for (const auto& p : patch0)
     ave0 += p;
-  Vector3f ave1(0, 0, 0);
+  Eigen::Matrix<T, 3, 1> ave1(T(0.0), T(0.0), T(0.0));
   for (const auto& p : patch1)
     ave1 += p;
 
-  ave0 /= patch0.size();
-  ave1 /= patch1.size();
+  ave0 /= T(patch0.size());
+  ave1 /= T(patch1.size());
 
-  double ncc = 0.0;
+  T ncc(0.0);
 
-  double var0 = 0.0;
-  double var1 = 0.0;
+  T var0(0.0);
+  T var1(0.0);
   for (int i = 0; i < patch0.size(); ++i) {
-    const auto& diff0 = patch0[i] - ave0;
-    const auto& diff1 = patch1[i] - ave1;
+    const Eigen::Matrix<T, 3, 1> diff0 = patch0[i] - ave0;
+    const Eigen::Matrix<T, 3, 1> diff1 = patch1[i] - ave1;
     var0 += diff0.squaredNorm();
     var1 += diff1.squaredNorm();
     ncc += diff0.dot(diff1);
   }
 
-  const int kNumChannels = 3;
-  var0 = sqrt(var0);
-  var1 = sqrt(var1);
+  // max(0.01, sqrt(var0) * sqrt(var1)), without differentiating sqrt at 0.
+  const T product = var0 * var1;
+  if (product < T(0.01 * 0.01))
+    ncc /= T(0.01);
+  else
+    ncc /= sqrt(product);
 
-  ncc /= max(0.01, var0 * var1);
-  return min(1.0 - ncc, 0.7);
+  const T inverse_ncc = T(1.0) - ncc;
+  return inverse_ncc < T(0.7) ? inverse_ncc : T(0.7);
 }
   
 }  // namespace
@@ -199,13 +208,16 @@ class RegularizationResidual {
 
   template <typename T> bool operator()(const T* params, T* residual) const {
     const double kScale = 1000.0;
-    const auto& mat = Rodrigues(Vector3d(params[0], params[1], params[2]));
+    T mat[9];
+    ceres::AngleAxisToRotationMatrix(params, ceres::RowMajorAdapter3x3(mat));
 
     // residual[0] = fabs(mat.row(0).dot(rotation_org_.row(1)));
     
     const double kOffset = 0.0;
-    residual[0] =
-      kScale * max(0.0, (1.0 - (mat.row(1)).dot(rotation_org_.row(1)) - kOffset));
+    const T dot =
+      mat[3] * rotation_org_(1, 0) + mat[4] * rotation_org_(1, 1) + mat[5] * rotation_org_(1, 2);
+    const T value = T(1.0) - dot - T(kOffset);
+    residual[0] = value > T(0.0) ? T(kScale) * value : T(0.0);
 
     return true;
   }
@@ -222,13 +234,26 @@ class RegularizationResidual2 {
 
   template <typename T> bool operator()(const T* params, T* residual) const {
     const double kScale = 0.01;
-    const Matrix3d mat = Rodrigues(Vector3d(params[0], params[1], params[2]));
-    const Matrix3d product = mat * rotation_org_.transpose();
-    const Vector3d vec = Rodrigues(product);
-    const double norm = vec.norm();
+    T mat[9];
+    ceres::AngleAxisToRotationMatrix(params, ceres::RowMajorAdapter3x3(mat));
+    // mat * rotation_org_^T.
+    T product[9];
+    for (int y = 0; y < 3; ++y) {
+      for (int x = 0; x < 3; ++x) {
+        product[3 * y + x] =
+          mat[3 * y] * rotation_org_(x, 0) + mat[3 * y + 1] * rotation_org_(x, 1) +
+          mat[3 * y + 2] * rotation_org_(x, 2);
+      }
+    }
+    T vec[3];
+    ceres::RotationMatrixToAngleAxis(ceres::RowMajorAdapter3x3(static_cast<const T*>(product)), vec);
+    const T squared_norm = vec[0] * vec[0] + vec[1] * vec[1] + vec[2] * vec[2];
 
     const double kOffset = 0.02;
-    residual[0] = kScale * max(0.0, norm - kOffset);
+    if (squared_norm <= T(kOffset * kOffset))
+      residual[0] = T(0.0);
+    else
+      residual[0] = T(kScale) * (sqrt(squared_norm) - T(kOffset));
     return true;
   }
 
@@ -283,22 +308,21 @@ PatchCorrelationResidual::PatchCorrelationResidual(const pre_process::StitchPano
   size_(size),
   index0_(index0),
   index1_(index1) {
+  rays_.reserve(size_ * size_);
+  for (int y = y_; y < y_ + size_; ++y) {
+    for (int x = x_; x < x_ + size_; ++x) {
+      rays_.push_back(stitch_panorama_.ScreenToRay(Vector2d(x, y)));
+    }
+  }
 }
 
 template<typename T>
   bool PatchCorrelationResidual::operator ()(const T* const param0,
                                              const T* const param1,
                                              T* residual) const {
-  const auto rot0 = Rodrigues(Vector3d(param0[0], param0[1], param0[2]));
-  const auto rot1 = Rodrigues(Vector3d(param1[0], param1[1], param1[2]));
-  const auto proj0 = stitch_panorama_.intrinsics * rot0;
-  const auto proj1 = stitch_panorama_.intrinsics * rot1;
-
-  vector<Vector3f> patch0, patch1;
-  if (!GrabPatch(index0_, proj0, patch0))
-    return false;
-  if (!GrabPatch(index1_, proj1, patch1))
-    return false;
+  vector<Eigen::Matrix<T, 3, 1> > patch0, patch1;
+  GrabPatch(index0_, param0, &patch0);
+  GrabPatch(index1_, param1, &patch1);
 
   residual[0] = InverseNcc(patch0, patch1);
 
@@ -310,24 +334,30 @@ template<typename T>
   return true;
 }
 
- bool PatchCorrelationResidual::GrabPatch(const int index,
-                                          const Eigen::Matrix3d& projection,
-                                          std::vector<Vector3f>& patch) const {
-   patch.clear();
-   patch.reserve(size_ * size_);
-   for (int y = y_; y < y_ + size_; ++y) {
-     for (int x = x_; x < x_ + size_; ++x) {
-       const auto& ray = stitch_panorama_.ScreenToRay(Vector2d(x, y));
-       Vector3d pixel = projection * ray;
-       if (pixel[2] != 0.0) {
-         pixel[0] /= pixel[2];
-         pixel[1] /= pixel[2];
-       }
-       patch.push_back(InterpolateF(stitch_panorama_.images[index], Vector2d(pixel[0], pixel[1])));
+template<typename T>
+  void PatchCorrelationResidual::GrabPatch(const int index,
+                                           const T* const param,
+                                           std::vector<Eigen::Matrix<T, 3, 1> >* patch) const {
+   const Matrix3d& intrinsics = stitch_panorama_.intrinsics;
+   patch->clear();
+   patch->reserve(rays_.size());
+   for (const auto& ray : rays_) {
+     const T point[3] = { T(ray[0]), T(ray[1]), T(ray[2]) };
+     T rotated[3];
+     ceres::AngleAxisRotatePoint(param, point, rotated);
+
+     Eigen::Matrix<T, 3, 1> pixel;
+     for (int i = 0; i < 3; ++i) {
+       pixel[i] = intrinsics(i, 0) * rotated[0] + intrinsics(i, 1) * rotated[1] +
+         intrinsics(i, 2) * rotated[2];
+     }
+     if (pixel[2] != T(0.0)) {
+       pixel[0] /= pixel[2];
+       pixel[1] /= pixel[2];
      }
+     patch->push_back(InterpolateF(stitch_panorama_.images[index],
+                                   Eigen::Matrix<T, 2, 1>(pixel[0], pixel[1])));
    }
-
-   return true;
  }
 
 bool StitchPanorama::Init(const std::vector<Eigen::Matrix3d>& initial_rotations) {
@@ -557,8 +587,8 @@ bool StitchPanorama::RefineCameras() {
     for (int i = 0; i < patch.indexes.size(); ++i) {
       for (int j = i+1; j < patch.indexes.size(); ++j) {
         ceres::CostFunction* cost_function =
-          new ceres::NumericDiffCostFunction
-          <PatchCorrelationResidual, ceres::CENTRAL, 1, 3, 3>
+          new ceres::AutoDiffCostFunction
+          <PatchCorrelationResidual, 1, 3, 3>
           (new PatchCorrelationResidual(*this, patch.x, patch.y, patch.size, patch.indexes[i], patch.indexes[j]));
         const int sampled_index0 = to_sampled_index[patch.indexes[i]];
         const int sampled_index1 = to_sampled_index[patch.indexes[j]];
@@ -572,8 +602,8 @@ bool StitchPanorama::RefineCameras() {
   for (int c = 0; c < num_cameras; c+= subsample) {
     const int sampled_index = to_sampled_index[c];
     ceres::CostFunction* cost_function =
-      new ceres::NumericDiffCostFunction
-      <RegularizationResidual, ceres::CENTRAL, 1, 3>(new RegularizationResidual(*this, c));
+      new ceres::AutoDiffCostFunction
+      <RegularizationResidual, 1, 3>(new RegularizationResidual(*this, c));
     problem.AddResidualBlock(cost_function, new ceres::TrivialLoss(),
                              &params[kNumOfParamsPerIndex * sampled_index]);
   }
@@ -581,8 +611,8 @@ bool StitchPanorama::RefineCameras() {
   for (int c = 0; c < num_cameras; c+= subsample) {
     const int sampled_index = to_sampled_index[c];
     ceres::CostFunction* cost_function =
-      new ceres::NumericDiffCostFunction
-      <RegularizationResidual2, ceres::CENTRAL, 1, 3>(new RegularizationResidual2(*this, c));
+      new ceres::AutoDiffCostFunction
+      <RegularizationResidual2, 1, 3>(new RegularizationResidual2(*this, c));
     problem.AddResidualBlock(cost_function, new ceres::TrivialLoss(),
                              &params[kNumOfParamsPerIndex * sampled_index]);
   }
@@ -975,8 +1005,16 @@ bool StitchPanorama::RefineCameras() {
   
   ceres::Solver::Options options;
   options.max_num_iterations = 25; // 50;
-  options.num_threads = 4;
+  options.num_threads = structured_indoor_modeling::GetDefaultNumThreads();
   options.minimizer_progress_to_stdout = true;
+  // Each residual touches at most two cameras, so the jacobian is sparse.
+  // Fall back to the dense solver if ceres is built without a sparse library.
+  options.linear_solver_type = ceres::SPARSE_NORMAL_CHOLESKY;
+  {
+    string error;
+    if (!options.IsValid(&error))
+      options.linear_solver_type = ceres::DENSE_QR;
+  }
   ceres::Solver::Summary summary;
   cerr << "Starts solving" << endl;
   ceres::Solve(options, &problem, &summary);
@@ -1034,54 +1072,88 @@ void StitchPanorama::SamplePatches() {
   cerr << patches.size() << " patches sampled." << endl;
 }
 
-bool StitchPanorama::Blend(const std::string& filename) {
-  cv::Mat output;
-  output.create(out_height, out_width, CV_32FC4);
-
+void StitchPanorama::BuildRemapTable(const int camera, RemapTable* table) const {
+  table->row_begins.resize(out_height + 1);
+  table->runs.clear();
   for (int y = 0; y < out_height; ++y) {
-    for (int x = 0; x < out_width; ++x) {
-      output.at<cv::Vec4f>(y, x) = cv::Vec4f(0, 0, 0, 0);
-    }
-  }
-
-  // Accumulate.
-  for (int c = 0; c < num_cameras; c += subsample) {
-    for (int y = 0; y < out_height; ++y) {
-      for (int x = 0; x < out_width; ++x) {
-        const float alpha = masks[c].at<unsigned char>(y, x) / 255.0;
-        if (alpha == 0.0)
-          continue;
-
-        const Vector3d pixel = Project(c, ScreenToRay(Vector2d(x, y)));
-        const auto& rgb = InterpolateF(images[c], Vector2d(pixel[0], pixel[1]));
-        for (int i = 0; i < 3; ++i)
-          output.at<Vec4f>(y, x)[i] += rgb[i] * alpha;
-        output.at<Vec4f>(y, x)[3] += alpha;
+    table->row_begins[y] = table->runs.size();
+    const unsigned char* mask = masks[camera].ptr<unsigned char>(y);
+    int x = 0;
+    while (x < out_width) {
+      if (mask[x] == 0) {
+        ++x;
+        continue;
       }
+      const int begin = x;
+      while (x < out_width && mask[x] != 0)
+        ++x;
+      table->runs.push_back(Vector2i(begin, x));
     }
   }
+  table->row_begins[out_height] = table->runs.size();
+}
 
+bool StitchPanorama::Blend(const std::string& filename) {
+  // (cos, sin) of the longitude of each column and the latitude of each
+  // row, so that the ray of a pixel is a few multiplications.
+  vector<Vector2d> longitudes(out_width), latitudes(out_height);
+  for (int x = 0; x < out_width; ++x) {
+    const double longitude = x * 2.0 * M_PI / out_width;
+    longitudes[x] = Vector2d(cos(longitude), sin(longitude));
+  }
   for (int y = 0; y < out_height; ++y) {
-    for (int x = 0; x < out_width; ++x) {
-      if (output.at<Vec4f>(y, x)[3] == 0.0)
-        continue;
-      output.at<Vec4f>(y, x) /= output.at<Vec4f>(y, x)[3];
-    }
+    const double latitude = y * M_PI / out_height - (M_PI / 2.0);
+    latitudes[y] = Vector2d(cos(latitude), sin(latitude));
   }
 
+  vector<RemapTable> tables(num_cameras);
+  structured_indoor_modeling::ParallelFor(0, (num_cameras + subsample - 1) / subsample, [&](const int i) {
+    BuildRemapTable(i * subsample, &tables[i * subsample]);
+  });
+
+  // Blend a tile of rows at a time. Only the accumulation buffers of the
+  // rows being processed are in memory, instead of a float image of the
+  // whole panorama.
   stitched_image.create(out_height, out_width, CV_8UC3);
-  for (int y = 0; y < out_height; ++y) {
-    const int out_y = out_height - 1 - y;
-    for (int x = 0; x < out_width; ++x) {
-      const int out_x = x; // (x + out_width / 2) % out_width;
-      for (int c = 0; c < 3; ++c) {
-        stitched_image.at<Vec3b>(out_y, out_x) =
-          Vec3b(min(255, (int)round(output.at<Vec4f>(y, x)[0])),
-                min(255, (int)round(output.at<Vec4f>(y, x)[1])),
-                min(255, (int)round(output.at<Vec4f>(y, x)[2])));
+  const int kRowsPerTile = 16;
+  const int num_tiles = (out_height + kRowsPerTile - 1) / kRowsPerTile;
+  structured_indoor_modeling::ParallelFor(0, num_tiles, [&](const int tile) {
+    vector<Vec4f> output(out_width);
+    const int end_y = min(out_height, (tile + 1) * kRowsPerTile);
+    for (int y = tile * kRowsPerTile; y < end_y; ++y) {
+      std::fill(output.begin(), output.end(), Vec4f(0, 0, 0, 0));
+      // Accumulate.
+      for (int c = 0; c < num_cameras; c += subsample) {
+        const RemapTable& table = tables[c];
+        const unsigned char* mask = masks[c].ptr<unsigned char>(y);
+        for (int r = table.row_begins[y]; r < table.row_begins[y + 1]; ++r) {
+          for (int x = table.runs[r][0]; x < table.runs[r][1]; ++x) {
+            const float alpha = mask[x] / 255.0;
+            // Same as ScreenToRay(Vector2d(x, y)).
+            const Vector3d ray(-longitudes[x][1] * latitudes[y][0],
+                               longitudes[x][0] * latitudes[y][0],
+                               latitudes[y][1]);
+            const Vector3d pixel = Project(c, ray);
+            const auto& rgb = InterpolateF(images[c], Vector2d(pixel[0], pixel[1]));
+            for (int i = 0; i < 3; ++i)
+              output[x][i] += rgb[i] * alpha;
+            output[x][3] += alpha;
+          }
+        }
+      }
+
+      const int out_y = out_height - 1 - y;
+      Vec3b* stitched = stitched_image.ptr<Vec3b>(out_y);
+      for (int x = 0; x < out_width; ++x) {
+        Vec4f color = output[x];
+        if (color[3] != 0.0)
+          color /= color[3];
+        stitched[x] = Vec3b(min(255, (int)round(color[0])),
+                            min(255, (int)round(color[1])),
+                            min(255, (int)round(color[2])));
       }
     }
-  }
+  });
 
   imwrite(filename.c_str(), stitched_image);
   imshow(filename.c_str(), stitched_image);
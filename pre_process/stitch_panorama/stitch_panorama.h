@@ -39,6 +39,14 @@ struct Patch {
   std::vector<int> indexes;
 };
 
+// Output pixels that a camera contributes to, as runs [begin, end) of
+// non-zero mask pixels. Runs of row y are in
+// [row_begins[y], row_begins[y + 1]).
+struct RemapTable {
+  std::vector<int> row_begins;
+  std::vector<Eigen::Vector2i> runs;
+};
+
 class StitchPanorama {
  public:
   bool Stitch(const Input& input);
@@ -54,6 +62,7 @@ class StitchPanorama {
   bool RefineCameras();
   void SamplePatches();
   bool Blend(const std::string& filename);
+  void BuildRemapTable(const int camera, RemapTable* table) const;
 
   Eigen::Vector3d ScreenToRay(const Eigen::Vector2d& screen) const;
   Eigen::Vector2d RayToScreen(const Eigen::Vector3d& ray) const;
@@ -90,6 +99,9 @@ class StitchPanorama {
   friend class ManualSpecification;
 };
 
+// Inverse NCC between the patches that two cameras observe at the same
+// screen location. Templated on the scalar type so that it can be used
+// with ceres::AutoDiffCostFunction.
 class PatchCorrelationResidual {
  public:
  PatchCorrelationResidual(const pre_process::StitchPanorama& stitch_panorama,
@@ -101,9 +113,10 @@ class PatchCorrelationResidual {
 
     template <typename T> bool operator()(const T* const param0, const T* const param1, T* residual) const;
 
-    bool GrabPatch(const int index,
-                   const Eigen::Matrix3d& projection,
-                   std::vector<Eigen::Vector3f>& patch) const;
+    // param is the angle-axis rotation of the camera.
+    template <typename T> void GrabPatch(const int index,
+                                         const T* const param,
+                                         std::vector<Eigen::Matrix<T, 3, 1> >* patch) const;
     
  private:
     const pre_process::StitchPanorama& stitch_panorama_;
@@ -112,6 +125,8 @@ class PatchCorrelationResidual {
     int size_;
     int index0_;
     int index1_;
+    // Screen rays of the patch pixels, which do not depend on the parameters.
+    std::vector<Eigen::Vector3d> rays_;
 };
  
 }  // namespace pre_process
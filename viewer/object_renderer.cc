@@ -128,27 +128,20 @@ void ObjectRenderer::Init(const string data_directory) {
 
     cout << point_cloud.GetNumObjects() << " objects." << endl;
 
-    vector<vector<int> >object_pt_num(point_cloud.GetNumObjects());
-    
     for(int objid = 0; objid < (int)centers[room].size(); ++objid){
-	centers[room][objid] = Vector3d(0,0,0);
-	point_cloud.GetObjectIndice(objid, object_pt_num[objid]);
+	centers[room][objid] = point_cloud.GetObjectCenter(objid);
+	vertices[room][objid].reserve(3 * point_cloud.GetObjectIndices(objid).size());
+	colors[room][objid].reserve(3 * point_cloud.GetObjectIndices(objid).size());
     }
     
     for (int p = 0; p < point_cloud.GetNumPoints(); ++p) {
       const Point& point = point_cloud.GetPoint(p);
-      centers[room][point.object_id] += point.position;
       for (int i = 0; i < 3; ++i)
         vertices[room][point.object_id].push_back(point.position[i]);
       for (int i = 0; i < 3; ++i) {
         colors[room][point.object_id].push_back(point.color[i] / 255.0f);
       }
     }
-
-    for(int objid=0; objid<point_cloud.GetNumObjects(); ++objid){
-	if(object_pt_num[objid].size() != 0)
-	    centers[room][objid] /= (double)object_pt_num[objid].size();
-    }
   }
 
   vertices_org = vertices;
@@ -60,7 +60,7 @@ qtHaveModule(opengl) {
         INCLUDEPATH += '/usr/include'
         INCLUDEPATH += '/usr/include/eigen3'
         INCLUDEPATH += '/usr/local/include'
-        LIBS += -L/usr/lib/x86_64-linux-gnu/ -lGLU -lopencv_core -lopencv_highgui -lopencv_imgproc
+        LIBS += -L/usr/lib/x86_64-linux-gnu/ -lGLU -lopencv_core -lopencv_highgui -lopencv_imgproc -lpthread
     }
 
     macx{